@@ -0,0 +1,111 @@
+#include "bypass.h"
+
+static const char *kNames[] = { "none", "pc_signature", "streaming" };
+
+int ParseBypass(const std::string &name) {
+  for (int i = 0; i < (int)(sizeof(kNames) / sizeof(kNames[0])); i++)
+    if (name == kNames[i]) return i;
+  return -1;
+}
+
+const char *BypassName(int kind) {
+  return kNames[kind];
+}
+
+BypassPolicy *BypassPolicy::Create(int kind, int sets, int assoc, int block_size) {
+  switch (kind) {
+    case kBypassPCSignature: return new PCSignatureBypass(sets, assoc);
+    case kBypassStreaming: return new StreamingBypass(block_size);
+    default: return nullptr;
+  }
+}
+
+PCSignatureBypass::PCSignatureBypass(int sets, int assoc)
+    : assoc_(assoc), lines_((size_t)sets * assoc), counters_(kSignatures) {
+  Reset();
+}
+
+void PCSignatureBypass::Reset() {
+  for (auto &l : lines_) l.sig = -1;
+  for (auto &c : counters_) c = 0;
+  samples_ = 0;
+}
+
+bool PCSignatureBypass::Bypass(uint64_t addr, uint64_t pc) {
+  if (pc == 0 || counters_[Signature(pc)] < kThreshold) return false;
+  return ++samples_ % kSampleInterval != 0;
+}
+
+void PCSignatureBypass::Filled(int set, int way, uint64_t pc) {
+  Line &l = lines_[(size_t)set * assoc_ + way];
+  l.sig = pc ? Signature(pc) : -1;
+  l.reused = false;
+}
+
+void PCSignatureBypass::Hit(int set, int way, uint64_t addr) {
+  Line &l = lines_[(size_t)set * assoc_ + way];
+  if (l.sig < 0 || l.reused) return;
+  l.reused = true;
+  if (counters_[l.sig] > 0) counters_[l.sig]--;
+}
+
+void PCSignatureBypass::Evicted(int set, int way) {
+  Line &l = lines_[(size_t)set * assoc_ + way];
+  if (l.sig >= 0 && !l.reused && counters_[l.sig] < kCounterMax) counters_[l.sig]++;
+  l.sig = -1;
+}
+
+StreamingBypass::StreamingBypass(int block_size)
+    : bbits_(__builtin_ctz(block_size)), streams_(kStreams), history_(kHistory) {
+  Reset();
+}
+
+void StreamingBypass::Reset() {
+  for (auto &s : streams_) s.next = s.run = s.lru = 0;
+  for (auto &h : history_) h.valid = false;
+  clock_ = 0;
+  conf_ = kConfThreshold;
+}
+
+void StreamingBypass::Touch(uint64_t block) {
+  Recent &h = history_[block & (kHistory - 1)];
+  if (h.valid && h.block == block && !h.reused) {
+    h.reused = true;
+    if (conf_ > 0) conf_--;
+  }
+}
+
+void StreamingBypass::Record(uint64_t block) {
+  Recent &h = history_[block & (kHistory - 1)];
+  if (h.valid && h.block == block) return;
+  if (h.valid && !h.reused && conf_ < kConfMax) conf_++;
+  h.block = block;
+  h.valid = true;
+  h.reused = false;
+}
+
+int StreamingBypass::Follow(uint64_t block) {
+  Stream *victim = &streams_[0];
+  for (auto &s : streams_) {
+    if (s.run && s.next - 1 == block) return s.run;   // Another miss in the last block
+    if (s.run && s.next == block) {
+      s.next = block + 1;
+      s.run++;
+      s.lru = ++clock_;
+      return s.run;
+    }
+    if (s.lru < victim->lru) victim = &s;
+  }
+  victim->next = block + 1;
+  victim->run = 1;
+  victim->lru = ++clock_;
+  return 1;
+}
+
+bool StreamingBypass::Bypass(uint64_t addr, uint64_t pc) {
+  uint64_t block = addr >> bbits_;
+  Touch(block);
+  if (Follow(block) < kRunThreshold) return false;
+  Record(block);
+  return conf_ >= kConfThreshold;
+}
@@ -0,0 +1,103 @@
+#ifndef CACHE_BYPASS_H_
+#define CACHE_BYPASS_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+enum BypassKind {
+  kBypassNone = 0,
+  kBypassPCSignature,   // Blocks brought in by PCs whose blocks die unused
+  kBypassStreaming      // Long sequential miss runs
+};
+
+// "none", "pc_signature" or "streaming", -1 when unknown
+int ParseBypass(const std::string &name);
+const char *BypassName(int kind);
+
+// Decides which missing blocks a cache level does not allocate. Bypassed
+// accesses go straight to the lower level.
+class BypassPolicy {
+ public:
+  virtual ~BypassPolicy() {}
+  // Called on a demand miss, true to bypass the cache
+  virtual bool Bypass(uint64_t addr, uint64_t pc) = 0;
+  // Line events for policies that learn from reuse. pc is 0 for prefetches
+  virtual void Filled(int set, int way, uint64_t pc) {}
+  virtual void Hit(int set, int way, uint64_t addr) {}
+  virtual void Evicted(int set, int way) {}
+  virtual void Reset() {}
+  virtual bool UsesPC() const { return false; }
+  // nullptr for kBypassNone
+  static BypassPolicy *Create(int kind, int sets, int assoc, int block_size);
+};
+
+// Dead block prediction by PC signature: every line remembers the signature
+// of the PC that filled it, a saturating counter per signature goes up when
+// such a line is evicted without reuse and down when one is reused. Misses
+// of PCs whose counter is high are bypassed, except for one in
+// kSampleInterval that is still inserted so the counter can recover.
+class PCSignatureBypass : public BypassPolicy {
+ public:
+  PCSignatureBypass(int sets, int assoc);
+  bool Bypass(uint64_t addr, uint64_t pc);
+  void Filled(int set, int way, uint64_t pc);
+  void Hit(int set, int way, uint64_t addr);
+  void Evicted(int set, int way);
+  void Reset();
+  bool UsesPC() const { return true; }
+
+ private:
+  static const int kSignatures = 4096;
+  static const int kCounterMax = 7;
+  static const int kThreshold = 6;
+  static const int kSampleInterval = 32;
+  static int Signature(uint64_t pc) { return ((pc >> 2) ^ (pc >> 14)) & (kSignatures - 1); }
+  struct Line {
+    int16_t sig;    // -1 when not tracked
+    bool reused;
+  };
+  int assoc_;
+  std::vector<Line> lines_;
+  std::vector<uint8_t> counters_;
+  unsigned samples_;
+};
+
+// Follows up to kStreams ascending miss streams and bypasses the misses of
+// a stream once it is kRunThreshold blocks long. Recent stream blocks are
+// remembered: a confidence counter drops when one of them is referenced
+// again and rises when one is forgotten unused, so streams whose blocks do
+// get reused (spatially too) stop being bypassed.
+class StreamingBypass : public BypassPolicy {
+ public:
+  StreamingBypass(int block_size);
+  bool Bypass(uint64_t addr, uint64_t pc);
+  void Hit(int set, int way, uint64_t addr) { Touch(addr >> bbits_); }
+  void Reset();
+
+ private:
+  static const int kStreams = 8;
+  static const int kRunThreshold = 8;
+  static const int kHistory = 256;
+  static const int kConfMax = 15;
+  static const int kConfThreshold = 8;
+  struct Stream {
+    uint64_t next;    // Block expected next
+    int run;
+    uint64_t lru;
+  };
+  struct Recent {
+    uint64_t block;
+    bool valid, reused;
+  };
+  void Touch(uint64_t block);
+  int Follow(uint64_t block);   // Run length of the stream block belongs to
+  void Record(uint64_t block);
+  int bbits_;
+  uint64_t clock_;
+  int conf_;
+  std::vector<Stream> streams_;
+  std::vector<Recent> history_;
+};
+
+#endif //CACHE_BYPASS_H_
@@ -1,69 +1,280 @@
 #include "cache.h"
 #include <math.h>
 #include <assert.h>
+#include <algorithm>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
-#define GETBITS(x, low, high) (x & ((~(1 << (low)) + 1) & ((1 << (high)) - 1)))
+// Bits [low, high) of x, in place; high may be 64
+static inline uint64_t GetBits(uint64_t x, int low, int high) {
+  uint64_t mask = high >= 64 ? ~0ULL : (1ULL << high) - 1;
+  return x & mask & ~((1ULL << low) - 1);
+}
+
+static const char *kReplacementNames[] = { "lru", "plru", "nru", "srrip", "brrip", "dip", "random" };
+
+int ParseReplacement(const std::string &name) {
+  for (int i = 0; i < (int)(sizeof(kReplacementNames) / sizeof(kReplacementNames[0])); i++)
+    if (name == kReplacementNames[i]) return i;
+  return -1;
+}
 
-void CacheLine::write(size_t offset, size_t bytes, char *content) { 
-  if (content) memcpy(data+offset, content, bytes);
-  else memset(data+offset, 0, bytes); 
-  dirty = true; 
+const char *ReplacementName(int kind) {
+  return kReplacementNames[kind];
 }
 
-void CacheSet::init(int associativity, int block_size) { 
+CacheSet::~CacheSet() {
+  delete[] tags;
+  delete[] age;
+  delete[] dirty;
+  delete[] pref;
+  delete[] data;
+}
+
+void CacheSet::init(int associativity, int block_size, bool tag_only,
+                    ReplacementState *repl, int index) { 
   e = associativity; 
-  lines = new CacheLine[e]; 
-  head = end = nullptr;
-  for (int i = 0; i < e; i++) lines[i].init(block_size);
-  tagmap.clear(); 
+  n = 0;
+  sz = block_size;
+  this->repl = repl;
+  kind = repl->kind;
+  leader = kFollower;
+  if (kind == kReplDIP && index % 32 == 0) leader = kLeaderLRU;
+  if (kind == kReplDIP && index % 32 == 1) leader = kLeaderBIP;
+  int padded = (e + 3) & ~3;
+  tags = new size_t[padded]();
+  bool aged = kind == kReplLRU || kind == kReplDIP || kind == kReplSRRIP || kind == kReplBRRIP;
+  age = aged ? new uint32_t[e]() : nullptr;
+  bits = 0;
+  dirty = new bool[e]();
+  pref = new bool[e]();
+  data = tag_only ? nullptr : new char[(size_t)e * sz];
+}
+
+void CacheSet::clear() {
+  n = 0;
+  holes = 0;
+  bits = 0;
+}
+
+int CacheSet::find(size_t tag) const {
+  int i = 0;
+#if defined(__AVX2__)
+  __m256i key = _mm256_set1_epi64x(tag);
+  for (; i < n; i += 4) {
+    __m256i t = _mm256_loadu_si256((const __m256i *)(tags + i));
+    int m = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(t, key)));
+    if (m) {
+      int way = i + __builtin_ctz(m);
+      return way < n ? way : -1;
+    }
+  }
+  return -1;
+#elif defined(__SSE2__)
+  // No 64-bit compare in SSE2: both 32-bit halves must match
+  __m128i key = _mm_set1_epi64x(tag);
+  for (; i < n; i += 2) {
+    __m128i t = _mm_loadu_si128((const __m128i *)(tags + i));
+    int m = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(t, key)));
+    int way = (m & 3) == 3 ? i : (m & 12) == 12 ? i + 1 : -1;
+    if (way >= 0) return way < n ? way : -1;
+  }
+  return -1;
+#else
+  for (; i < n; i++)
+    if (tags[i] == tag) return i;
+  return -1;
+#endif
+}
+
+int CacheSet::getVictim() {
+  if (!full()) return -1;
+  switch (kind) {
+    case kReplPLRU: {
+      int node = 1;
+      while (node < e) node = node * 2 + ((bits >> node) & 1);
+      return node - e;
+    }
+    case kReplNRU:    // touch() leaves a way unreferenced unless there is only one
+      return e == 1 ? 0 : __builtin_ctzll(~bits);
+    case kReplSRRIP:
+    case kReplBRRIP:
+      while (1) {
+        for (int i = 0; i < n; i++)
+          if (age[i] == 3) return i;
+        for (int i = 0; i < n; i++) age[i]++;
+      }
+    case kReplRandom: {
+      uint64_t &x = repl->rng;
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      return x % n;
+    }
+    default:
+      for (int i = 0; i < n; i++)
+        if (age[i] == (uint32_t)n - 1) return i;
+      return -1;
+  }
+}
+
+// Makes way the most recently used one
+void CacheSet::ageLRU(int way) {
+  uint32_t old = age[way];
+  for (int i = 0; i < n; i++)
+    if (age[i] < old) age[i]++;
+  age[way] = 0;
+}
+
+// Records a reference to way
+void CacheSet::touch(int way) {
+  switch (kind) {
+    case kReplPLRU:   // Point every node on the path away from way
+      for (int node = way + e; node > 1; node >>= 1) {
+        if (node & 1) bits &= ~(1ULL << (node >> 1));
+        else bits |= 1ULL << (node >> 1);
+      }
+      break;
+    case kReplNRU:
+      bits |= 1ULL << way;
+      if (bits == (e == 64 ? ~0ULL : (1ULL << e) - 1)) bits = 1ULL << way;
+      break;
+    case kReplSRRIP:
+    case kReplBRRIP:
+      age[way] = 0;
+      break;
+    case kReplRandom:
+      break;
+    default:
+      ageLRU(way);
+  }
 }
 
-void CacheSet::moveToHead(CacheLine *line) {
-  if (head == line) return;
-  if (line->prev) line->prev->next = line->next;
-  if (line->next) line->next->prev = line->prev;
-  line->next = head; 
-  if (head) head->prev = line;
-  head = line;
-  if (end == line) end = line->prev;
-  if (!end) end = line;
-  line->prev = nullptr; 
+void CacheSet::insert(int way) {
+  switch (kind) {
+    case kReplSRRIP:
+      age[way] = 2;
+      break;
+    case kReplBRRIP:
+      age[way] = ++repl->fills % kBimodalInterval ? 3 : 2;
+      break;
+    case kReplDIP: {
+      // Misses of the leader sets steer the followers
+      if (leader == kLeaderLRU && repl->psel < kDipPselMax) repl->psel++;
+      if (leader == kLeaderBIP && repl->psel > 0) repl->psel--;
+      bool bimodal = leader == kLeaderBIP || (leader == kFollower && repl->psel > kDipPselMax / 2);
+      if (bimodal && ++repl->fills % kBimodalInterval) break;   // Left in the LRU position
+      ageLRU(way);
+      break;
+    }
+    default:
+      touch(way);
+  }
 }
 
-bool CacheSet::hit(size_t tag) {
-  return tagmap.find(tag) != tagmap.end();
+void CacheSet::place(int way, size_t tag, char *content) {
+  tags[way] = tag;
+  dirty[way] = false;
+  pref[way] = false;
+  if (data) memcpy(getContent(way), content, sz);
+  insert(way);
 }
 
-bool CacheSet::full() {
-  return tagmap.size() == e;
+void CacheSet::read(int way, size_t offset, size_t bytes, char *content, bool reference) { 
+  if (data) memcpy(content, getContent(way) + offset, bytes);
+  if (reference) touch(way);
 }
 
-void CacheSet::read(size_t tag, size_t offset, size_t bytes, char *content) { 
-  assert(tagmap.find(tag) != tagmap.end());
-  int idx = tagmap[tag];
-  lines[idx].read(offset, bytes, content);
-  moveToHead(&lines[idx]);
+void CacheSet::write(int way, size_t offset, size_t bytes, char *content, bool reference) {
+  if (data) {
+    if (content) memcpy(getContent(way) + offset, content, bytes);
+    else memset(getContent(way) + offset, 0, bytes); 
+  }
+  dirty[way] = true; 
+  if (reference) touch(way);
 }
 
-void CacheSet::write(size_t tag, size_t offset, size_t bytes, char *content) {
-  assert(tagmap.find(tag) != tagmap.end());
-  int idx = tagmap[tag];
-  lines[idx].write(offset, bytes, content);
-  moveToHead(&lines[idx]);
+int CacheSet::add(size_t tag, char *content) {
+  int way = n;
+  if (holes) {    // Reuse an invalidated way, already the victim-to-be
+    way = 0;
+    while (tags[way] != kNoTag) way++;
+    holes--;
+  } else {
+    n++;
+    if (age) age[way] = way;   // Least recently used until placed
+  }
+  place(way, tag, content);
+  return way;
 }
 
-void CacheSet::add(size_t tag, char *content) {
-  int idx = tagmap[tag] = tagmap.size();
-  lines[idx].place(tag, content);
-  moveToHead(&lines[idx]);
+int CacheSet::replace(int victim, size_t tag, char *content) {
+  place(victim, tag, content);
+  return victim;
 }
 
-void CacheSet::replace(CacheLine *victim, size_t tag, char *content) {
-  assert(tagmap.find(victim->getTag()) != tagmap.end());
-  tagmap[tag] = tagmap[victim->getTag()];
-  tagmap.erase(victim->getTag());
-  victim->place(tag, content);
-  moveToHead(victim);
+// In place, so the per-way state of the bypass policy and the PLRU tree
+// keep pointing at the right lines
+void CacheSet::invalidate(int way) {
+  tags[way] = kNoTag;
+  dirty[way] = false;
+  pref[way] = false;
+  holes++;
+  switch (kind) {
+    case kReplLRU:
+    case kReplDIP:    // Least recently used, the ages stay 0..n-1
+      for (int i = 0; i < n; i++)
+        if (age[i] > age[way]) age[i]--;
+      age[way] = n - 1;
+      break;
+    case kReplSRRIP:
+    case kReplBRRIP:
+      age[way] = 3;
+      break;
+    case kReplNRU:
+      bits &= ~(1ULL << way);
+      break;
+    default:          // PLRU, random: add() refills the way before any victim is picked
+      break;
+  }
+}
+
+static void Put(std::vector<char> &out, const void *p, size_t bytes) {
+  out.insert(out.end(), (const char *)p, (const char *)p + bytes);
+}
+
+static void Take(const char *&p, void *dst, size_t bytes) {
+  memcpy(dst, p, bytes);
+  p += bytes;
+}
+
+void CacheSet::save(std::vector<char> &out) const {
+  Put(out, &n, sizeof(n));
+  Put(out, &holes, sizeof(holes));
+  Put(out, &bits, sizeof(bits));
+  Put(out, tags, e * sizeof(size_t));
+  if (age) Put(out, age, e * sizeof(uint32_t));
+  Put(out, dirty, e * sizeof(bool));
+  Put(out, pref, e * sizeof(bool));
+}
+
+void CacheSet::load(const char *&p) {
+  Take(p, &n, sizeof(n));
+  Take(p, &holes, sizeof(holes));
+  Take(p, &bits, sizeof(bits));
+  Take(p, tags, e * sizeof(size_t));
+  if (age) Take(p, age, e * sizeof(uint32_t));
+  Take(p, dirty, e * sizeof(bool));
+  Take(p, pref, e * sizeof(bool));
+  if (data) memset(data, 0, e * sz);
+}
+
+Cache::~Cache() {
+  delete[] cachesets;
+  delete[] shadow_;
+  delete prefetcher_;
+  delete bypass_;
 }
 
 void Cache::SetConfig(CacheConfig cc) {
@@ -76,128 +287,345 @@ void Cache::SetConfig(CacheConfig cc) {
   sbits = (int)(log(set_num)/log(2));
   bbits = (int)(log(block_size)/log(2));
   tbits = sizeof(size_t) * 8 - sbits - bbits;
+  repl_.kind = config_.replacement;
+  if ((repl_.kind == kReplPLRU && (associativity > 64 || (associativity & (associativity - 1)))) ||
+      (repl_.kind == kReplNRU && associativity > 64)) {
+    fprintf(stderr, "%s replacement does not support associativity %d, using lru\n",
+            ReplacementName(repl_.kind), associativity);
+    repl_.kind = kReplLRU;
+  }
+  repl_.rng = 0x9e3779b97f4a7c15ULL;
+  repl_.fills = 0;
+  repl_.psel = kDipPselMax / 2;
+  shadow_repl_ = repl_;
   cachesets = new CacheSet[set_num];
   for (int i = 0; i < set_num; i++) {
-    cachesets[i].init(associativity, block_size);
+    cachesets[i].init(associativity, block_size, tag_only_, &repl_, i);
+  }
+  fill_buf_.assign(tag_only_ ? 0 : block_size, 0);
+  delete prefetcher_;
+  prefetcher_ = Prefetcher::Create(config_.prefetcher, block_size, config_.prefetch_degree);
+  prefetch_queue_.clear();
+  delete bypass_;
+  delete[] shadow_;
+  bypass_ = BypassPolicy::Create(config_.bypass, set_num, associativity, block_size);
+  shadow_ = nullptr;
+  if (bypass_) {
+    shadow_ = new CacheSet[set_num];
+    for (int i = 0; i < set_num; i++) shadow_[i].init(associativity, block_size, true, &shadow_repl_, i);
   }
+  mshr_.assign(config_.mshrs, MSHR{0, 0, false});
+  prefetch_fills_.clear();
 }
 
 void Cache::GetConfig(CacheConfig &cc) {
   cc = config_;
 }
 
+// Layout: the geometry, replacement policy and tag_only flag it was saved
+// with, the shared replacement state, then every set
+void Cache::SaveState(std::vector<char> &out) const {
+  int geometry[5] = { config_.size, config_.associativity, config_.set_num,
+                      repl_.kind, tag_only_ };
+  out.clear();
+  Put(out, geometry, sizeof(geometry));
+  Put(out, &repl_, sizeof(repl_));
+  for (int i = 0; i < config_.set_num; i++) cachesets[i].save(out);
+}
+
+bool Cache::LoadState(const std::vector<char> &in) {
+  int geometry[5] = { config_.size, config_.associativity, config_.set_num,
+                      repl_.kind, tag_only_ };
+  if (in.size() < sizeof(geometry) + sizeof(repl_) ||
+      memcmp(in.data(), geometry, sizeof(geometry)) != 0)
+    return false;
+  const char *p = in.data() + sizeof(geometry);
+  Take(p, &repl_, sizeof(repl_));
+  for (int i = 0; i < config_.set_num; i++) cachesets[i].load(p);
+  for (auto &m : mshr_) m.ready = 0;
+  prefetch_fills_.clear();
+  prefetch_queue_.clear();
+  return true;
+}
+
 void Cache::flush() {
+  if (!cachesets) return;  // Not configured yet, nothing cached
   for (int i = 0; i < config_.set_num; i++) {
-    for (CacheLine *line = cachesets[i].head; line; line = line->next) {
-      if (!line->isDirty()) continue;
-      size_t wb_addr = ((line->getTag() << (sbits + bbits)) | (i << bbits));
+    CacheSet &set = cachesets[i];
+    set.forEach([&](int way) {
+      if (!set.isDirty(way)) return;
+      size_t wb_addr = ((set.getTag(way) << (sbits + bbits)) | (i << bbits));
+      int lower_hit, lower_time;
+      lower_->HandleRequest(wb_addr, 1 << bbits, 0, set.getContent(way), lower_hit, lower_time);
+    });
+  }
+}
+
+void Cache::invalidate() {
+  if (!cachesets) return;
+  for (int i = 0; i < config_.set_num; i++) cachesets[i].clear();
+  prefetch_queue_.clear();
+  prefetch_fills_.clear();
+  if (bypass_) {
+    for (int i = 0; i < config_.set_num; i++) shadow_[i].clear();
+    bypass_->Reset();
+  }
+  for (auto &m : mshr_) m.ready = 0;
+}
+
+ProbeResult Cache::Probe(uint64_t addr, uint64_t bytes, bool invalidate) {
+  ProbeResult result = kProbeMiss;
+  uint64_t end = addr + bytes;
+  for (uint64_t block = (addr >> bbits) << bbits; block < end; block += 1ULL << bbits) {
+    size_t tag = GetBits(block, sbits + bbits, sizeof(size_t) * 8) >> (sbits + bbits);
+    size_t s = GetBits(block, bbits, bbits + sbits) >> bbits;
+    CacheSet &set = cachesets[s];
+    int way = set.find(tag);
+    if (way < 0) continue;
+    if (set.isDirty(way)) {
       int lower_hit, lower_time;
-      lower_->HandleRequest(wb_addr, 1 << bbits, 0, line->getContent(), lower_hit, lower_time);
+      lower_->HandleRequest(block, 1 << bbits, 0, set.getContent(way), lower_hit, lower_time);
+      set.clean(way);
+      result = kProbeDirty;
+    } else if (result == kProbeMiss) {
+      result = kProbeClean;
+    }
+    if (invalidate) {
+      if (bypass_) bypass_->Evicted(s, way);
+      set.invalidate(way);
     }
   }
+  return result;
+}
+
+int Cache::Fill(size_t s, size_t tag, uint64_t addr, uint64_t pc, int &time) {
+  int lower_hit, lower_time;
+  // Replace or Add
+  int victim = cachesets[s].getVictim();
+  if (victim >= 0) stats_.replace_num++;
+  if (bypass_ && victim >= 0) bypass_->Evicted(s, victim);
+  if (!this->config_.write_through && victim >= 0 && cachesets[s].isDirty(victim)) {  // Write back
+    size_t wb_addr = ((cachesets[s].getTag(victim) << (sbits + bbits)) | (s << bbits));
+    lower_->SetCycle(cycle_ + time);
+    lower_->HandleRequest(wb_addr, 1 << bbits, 0, cachesets[s].getContent(victim), lower_hit, lower_time);
+    time += lower_time;
+  }
+  char *buf = tag_only_ ? nullptr : fill_buf_.data();
+  lower_->SetCycle(cycle_ + time);
+  lower_->HandleRequest((addr >> bbits) << bbits, 1 << bbits, 1, buf, lower_hit, lower_time);
+  time += lower_time;
+  int way = victim < 0 ? cachesets[s].add(tag, buf) : cachesets[s].replace(victim, tag, buf);
+  if (bypass_) bypass_->Filled(s, way, pc);
+  return way;
 }
 
 void Cache::HandleRequest(uint64_t addr, int bytes, int read,
                           char *content, int &hit, int &time) {
   hit = 0;
   time = 0;
-  // Bypass?
-  if (!BypassDecision()) {
-    stats_.access_counter++;
-    int lower_hit, lower_time;
-    size_t tag = GETBITS(addr, sbits + bbits, sizeof(size_t) * 8) >> (sbits + bbits);
-    size_t s = GETBITS(addr, bbits, bbits + sbits) >> bbits;
-    size_t offset = GETBITS(addr, 0, bbits);
-    time += latency_.bus_latency + latency_.hit_latency;
-    stats_.access_time += time;
-    if (cachesets[s].hit(tag)) {  // Hit
-      hit = 1;
-      if (read) {   // Read Hit 
-        cachesets[s].read(tag, offset, bytes, content);
-      } else {  // Write Hit
-        if (this->config_.write_through) {  // Write through
-          cachesets[s].write(tag, offset, bytes, content);
-          lower_->HandleRequest(addr, bytes, 0, content, lower_hit, lower_time);
-          time += lower_time;
-        } else {  // Write back
-          cachesets[s].write(tag, offset, bytes, content);
-        }
+  bool trigger = false;   // Prefetcher trigger
+  lower_->SetPC(pc_);
+  stats_.access_counter++;
+  int lower_hit, lower_time;
+  size_t tag = GetBits(addr, sbits + bbits, sizeof(size_t) * 8) >> (sbits + bbits);
+  size_t s = GetBits(addr, bbits, bbits + sbits) >> bbits;
+  size_t offset = GetBits(addr, 0, bbits);
+  time += latency_.bus_latency + latency_.hit_latency;
+  stats_.access_time += time;
+  int way = cachesets[s].find(tag);
+  if (way >= 0) {  // Hit
+    hit = 1;
+    if (cachesets[s].takePrefetched(way)) {
+      stats_.prefetch_useful++;
+      trigger = true;
+    }
+    if (bypass_) {
+      ShadowAccess(s, tag, read);
+      bypass_->Hit(s, way, addr);
+    }
+    if (read) {   // Read Hit 
+      cachesets[s].read(way, offset, bytes, content);
+    } else {  // Write Hit
+      if (this->config_.write_through) {  // Write through
+        cachesets[s].write(way, offset, bytes, content);
+        lower_->SetCycle(cycle_ + time);
+        lower_->HandleRequest(addr, bytes, 0, content, lower_hit, lower_time);
+        time += lower_time;
+      } else {  // Write back
+        cachesets[s].write(way, offset, bytes, content);
       }
-      return;
     }
-    else { // Miss
-      hit = 0;
-      stats_.miss_num++;
-      if (read) { 
-        // Replace or Add
-        CacheLine *victim = cachesets[s].getVictim();
-        if (victim) stats_.replace_num++;
-        if (!this->config_.write_through && victim && victim->isDirty()) {  // Write back
-          size_t wb_addr = ((victim->getTag() << (sbits + bbits)) | (s << bbits));
-          lower_->HandleRequest(wb_addr, 1 << bbits, 0, victim->getContent(), lower_hit, lower_time);
-          time += lower_time;
+    if (!mshr_.empty()) MSHRMerge((addr >> bbits) << bbits, time);
+    else if (!prefetch_fills_.empty()) PrefetchWait((addr >> bbits) << bbits, time);
+  }
+  else { // Miss
+    hit = 0;
+    trigger = true;
+    stats_.miss_num++;
+    if (prefetcher_) {    // Prefetch of this block not issued in time
+      uint64_t block = (addr >> bbits) << bbits;
+      for (auto it = prefetch_queue_.begin(); it != prefetch_queue_.end(); ++it) {
+        if (*it == block) {
+          prefetch_queue_.erase(it);
+          stats_.prefetch_late++;
+          break;
         }
-        char buf[1 << bbits];
-        lower_->HandleRequest((addr >> bbits) << bbits, 1 << bbits, 1, buf, lower_hit, lower_time);
-        time += lower_time;
+      }
+    }
+    time += MSHRWait(time);
+    // Bypass?
+    if (BypassDecision(s, tag, addr, read)) {
+      // Fetch from lower layer
+      lower_->SetCycle(cycle_ + time);
+      lower_->HandleRequest(addr, bytes, read, content, lower_hit, lower_time);
+      time += lower_time;
+      stats_.bypass_num++;
+    } else if (read) { 
+      way = Fill(s, tag, addr, pc_, time);
+      stats_.fetch_num++;
+      cachesets[s].read(way, offset, bytes, content, false);
+    } else {    // Write Miss
+      if (this->config_.write_allocate) { // Write alloc
+        way = Fill(s, tag, addr, pc_, time);
         stats_.fetch_num++;
-        if (victim == nullptr) cachesets[s].add(tag, buf);
-        else cachesets[s].replace(victim, tag, buf);
-        cachesets[s].read(tag, offset, bytes, content);
-      } else {    // Write Miss
-        if (this->config_.write_allocate) { // Write alloc
-          // Replace or Add
-          CacheLine *victim = cachesets[s].getVictim();
-          if (victim) stats_.replace_num++;
-          if (!this->config_.write_through && victim && victim->isDirty()) {  // Write back
-            size_t wb_addr = ((victim->getTag() << (sbits + bbits)) | (s << bbits));
-            lower_->HandleRequest(wb_addr, 1 << bbits, 0, victim->getContent(), lower_hit, lower_time);
-            time += lower_time;
-          }
-          char buf[1 << bbits];
-          lower_->HandleRequest((addr >> bbits) << bbits, 1 << bbits, 1, buf, lower_hit, lower_time);
-          time += lower_time;
-          stats_.fetch_num++;
-          if (victim == nullptr) cachesets[s].add(tag, buf);
-          else cachesets[s].replace(victim, tag, buf);
-          if (this->config_.write_through) {  // Write through
-            cachesets[s].write(tag, offset, bytes, content);
-            lower_->HandleRequest(addr, bytes, 0, content, lower_hit, lower_time);
-            time += lower_time;
-          } else {  // Write back
-            cachesets[s].write(tag, offset, bytes, content);
-          }
-        } else { // No write alloc
+        if (this->config_.write_through) {  // Write through
+          cachesets[s].write(way, offset, bytes, content, false);
+          lower_->SetCycle(cycle_ + time);
           lower_->HandleRequest(addr, bytes, 0, content, lower_hit, lower_time);
           time += lower_time;
+        } else {  // Write back
+          cachesets[s].write(way, offset, bytes, content, false);
         }
+      } else { // No write alloc
+        lower_->SetCycle(cycle_ + time);
+        lower_->HandleRequest(addr, bytes, 0, content, lower_hit, lower_time);
+        time += lower_time;
       }
     }
-  } else {
-    // Fetch from lower layer
-    int lower_hit, lower_time;
-    lower_->HandleRequest(addr, bytes, read, content, lower_hit, lower_time);
-    hit = 0;
-    time += latency_.bus_latency + lower_time;
-    stats_.fetch_num++;
-    stats_.access_time += latency_.bus_latency;
+    if (!mshr_.empty())
+      MSHRAllocate((addr >> bbits) << bbits, cycle_ + time, false);
   }
 
   // Prefetch?
-  if (PrefetchDecision()) {
+  if (PrefetchDecision(addr, trigger))
     PrefetchAlgorithm();
-    stats_.prefetch_num++;
-  } 
 }
 
-bool Cache::BypassDecision() {
-  return false;
+// Only misses are bypassed, a block already cached is always served here
+bool Cache::BypassDecision(size_t s, size_t tag, uint64_t addr, int read) {
+  if (!bypass_) return false;
+  ShadowAccess(s, tag, read);
+  return bypass_->Bypass(addr, pc_);
 }
 
-bool Cache::PrefetchDecision() {
-  return false;
+// The shadow sets see the same requests and fills as the cache, but
+// allocate every missing block, to count the misses bypassing saved or cost
+void Cache::ShadowAccess(size_t s, size_t tag, int read, bool demand) {
+  CacheSet &set = shadow_[s];
+  int way = set.find(tag);
+  if (way >= 0) {
+    set.read(way, 0, 0, nullptr);
+    return;
+  }
+  if (demand) stats_.shadow_miss_num++;
+  if (read || this->config_.write_allocate) {
+    int victim = set.getVictim();
+    if (victim < 0) set.add(tag, nullptr);
+    else set.replace(victim, tag, nullptr);
+  }
 }
 
+bool Cache::PrefetchDecision(uint64_t addr, bool trigger) {
+  if (!prefetcher_) return false;
+  prefetch_out_.clear();
+  prefetcher_->Train(addr, pc_, trigger, prefetch_out_);
+  // Physical pages are not contiguous, the next one may belong to anything
+  uint64_t page = prefetch_out_.empty() ? 0 : lower_->PageSize();
+  for (uint64_t block : prefetch_out_) {
+    if (prefetch_queue_.size() >= kPrefetchQueueSize) break;   // Dropped
+    if (page && block / page != addr / page) continue;
+    size_t tag = GetBits(block, sbits + bbits, sizeof(size_t) * 8) >> (sbits + bbits);
+    size_t s = GetBits(block, bbits, bbits + sbits) >> bbits;
+    if (cachesets[s].find(tag) >= 0) continue;
+    bool queued = false;
+    for (uint64_t q : prefetch_queue_) queued |= (q == block);
+    if (!queued) prefetch_queue_.push_back(block);
+  }
+  return !prefetch_queue_.empty();
+}
+
+// At most kPrefetchIssueWidth queued blocks go out per request, so
+// prefetches trail the demand stream instead of all landing at once
 void Cache::PrefetchAlgorithm() {
+  for (int i = 0; i < kPrefetchIssueWidth && !prefetch_queue_.empty(); i++) {
+    if (!mshr_.empty() && MSHRFreeAt() > cycle_) break;   // Stays queued
+    uint64_t block = prefetch_queue_.front();
+    prefetch_queue_.pop_front();
+    size_t tag = GetBits(block, sbits + bbits, sizeof(size_t) * 8) >> (sbits + bbits);
+    size_t s = GetBits(block, bbits, bbits + sbits) >> bbits;
+    if (cachesets[s].find(tag) >= 0) continue;   // Filled by a demand miss meanwhile
+    if (!lower_->Backed(block)) continue;         // Its page was freed meanwhile
+    int time = 0;
+    int way = Fill(s, tag, block, 0, time);
+    if (bypass_) ShadowAccess(s, tag, 1, false);
+    cachesets[s].setPrefetched(way);
+    stats_.prefetch_num++;
+    if (!mshr_.empty()) {
+      MSHRAllocate(block, cycle_ + time, true);
+      continue;
+    }
+    uint64_t now = cycle_;
+    prefetch_fills_.erase(std::remove_if(prefetch_fills_.begin(), prefetch_fills_.end(),
+                                         [now](const MSHR &m) { return m.ready <= now; }),
+                          prefetch_fills_.end());
+    prefetch_fills_.push_back(MSHR{block, cycle_ + time, true});
+  }
+}
+
+void Cache::PrefetchWait(uint64_t block, int &time) {
+  for (auto it = prefetch_fills_.begin(); it != prefetch_fills_.end(); ++it) {
+    if (it->block != block) continue;
+    if (it->ready > cycle_ + time) {
+      time = it->ready - cycle_;
+      stats_.prefetch_late++;
+    }
+    prefetch_fills_.erase(it);
+    return;
+  }
+}
+
+uint64_t Cache::MSHRFreeAt() const {
+  uint64_t earliest = mshr_[0].ready;
+  for (const MSHR &m : mshr_) earliest = std::min(earliest, m.ready);
+  return earliest;
+}
+
+// Secondary miss: the line is allocated but its data is still on the way,
+// so the request completes with the outstanding fill instead of a new one
+void Cache::MSHRMerge(uint64_t block, int &time) {
+  for (MSHR &m : mshr_) {
+    if (m.block != block || m.ready <= cycle_ + time) continue;
+    time = m.ready - cycle_;
+    stats_.mshr_merge_num++;
+    if (m.prefetch) stats_.prefetch_late++;
+    m.prefetch = false;
+    return;
+  }
+}
+
+// Cycles a miss at cycle_ + time waits until an MSHR frees up
+int Cache::MSHRWait(int time) {
+  if (mshr_.empty()) return 0;
+  uint64_t now = cycle_ + time, free_at = MSHRFreeAt();
+  if (free_at <= now) return 0;
+  stats_.mshr_stall_time += free_at - now;
+  return free_at - now;
+}
+
+void Cache::MSHRAllocate(uint64_t block, uint64_t ready, bool prefetch) {
+  MSHR *entry = &mshr_[0];
+  for (MSHR &m : mshr_)
+    if (m.ready < entry->ready) entry = &m;
+  *entry = MSHR{block, ready, prefetch};
 }
 
@@ -3,8 +3,44 @@
 
 #include <stdint.h>
 #include <string.h>
-#include <map>
+#include <deque>
+#include <string>
+#include <vector>
 #include "storage.h"
+#include "prefetch.h"
+#include "bypass.h"
+
+enum ReplacementKind {
+  kReplLRU = 0,
+  kReplPLRU,      // Tree pseudo-LRU, power-of-two associativity up to 64
+  kReplNRU,       // Not recently used bit per way, associativity up to 64
+  kReplSRRIP,     // Static re-reference interval prediction, 2-bit RRPV
+  kReplBRRIP,     // Bimodal RRIP, most fills predicted distant
+  kReplDIP,       // Set dueling between LRU and bimodal insertion
+  kReplRandom
+};
+
+// Result of Cache::Probe()
+enum ProbeResult {
+  kProbeMiss = 0,   // Not cached
+  kProbeClean,
+  kProbeDirty       // Written back to the lower level
+};
+
+// "lru", "plru", "nru", "srrip", "brrip", "dip" or "random", -1 when unknown
+int ParseReplacement(const std::string &name);
+const char *ReplacementName(int kind);
+
+const unsigned kBimodalInterval = 32;   // 1 in 32 bimodal fills is inserted near
+const int kDipPselMax = 1023;
+
+// Replacement state shared by all sets of a cache
+typedef struct ReplacementState_ {
+  int kind;
+  uint64_t rng;     // Random victims
+  unsigned fills;   // Bimodal insertion throttle (BRRIP, DIP)
+  int psel;         // DIP policy selector, high favours bimodal insertion
+} ReplacementState;
 
 typedef struct CacheConfig_ {
   int size;
@@ -12,81 +48,204 @@ typedef struct CacheConfig_ {
   int set_num; // Number of cache sets
   int write_through; // 0|1 for back|through
   int write_allocate; // 0|1 for no-alc|alc
-  CacheConfig_() {}
+  int prefetcher; // PrefetchKind
+  int prefetch_degree; // Blocks prefetched per trigger
+  int bypass; // BypassKind
+  int replacement; // ReplacementKind
+  int mshrs; // Outstanding misses, 0 for a blocking cache
+  CacheConfig_() : prefetcher(kPrefetchNone), prefetch_degree(1), bypass(kBypassNone),
+                   replacement(kReplLRU), mshrs(0) {}
   CacheConfig_(int size, int associativity, int set_num, bool write_back) : 
-      size(size), associativity(associativity), set_num(set_num) {
+      size(size), associativity(associativity), set_num(set_num),
+      prefetcher(kPrefetchNone), prefetch_degree(1), bypass(kBypassNone),
+      replacement(kReplLRU), mshrs(0) {
         write_through = !write_back;
         write_allocate = write_back;
     }
 } CacheConfig;
 
-class CacheLine {
-public:
-  CacheLine() {}
-  void init(int block_size) { data = new char[block_size]; sz = block_size; dirty = false; valid = false; }
-  ~CacheLine() { delete[] data; }
-  bool isValid() const { return valid; }
-  bool isDirty() const { return dirty; }
-  size_t getTag() const { return tag; }
-  char *getContent() const { return data; }
-  void place(size_t tag, char *content) { this->tag = tag; memcpy(data, content, sz); valid = true; dirty = false; }
-  void write(size_t offset, size_t bytes, char *content);
-  void read(size_t offset, size_t bytes, char *content) { memcpy(content, data+offset, bytes); }
-  CacheLine *prev = nullptr, *next = nullptr;
-private:
-  bool valid = false, dirty = false;
-  size_t sz = 0, tag = 0;
-  char *data;
-};
-
 class CacheSet;
 class Cache: public Storage {
  public:
   Cache() {}
-  ~Cache() {}
+  ~Cache();
 
   // Sets & Gets
   void SetConfig(CacheConfig cc);
   void GetConfig(CacheConfig &cc);
   void SetLower(Storage *ll) { lower_ = ll; }
+  // Tag-only caches keep no line data, takes effect on the next SetConfig
+  void SetTagOnly(bool tag_only) { tag_only_ = tag_only; }
   // Main access process
   void HandleRequest(uint64_t addr, int bytes, int read,
                      char *content, int &hit, int &time);
   void flush();
+  // Drops all lines without writing them back
+  void invalidate();
+  // Coherence: writes back the dirty lines holding [addr, addr + bytes) and
+  // drops them if invalidate, or keeps them clean. Not counted as accesses.
+  ProbeResult Probe(uint64_t addr, uint64_t bytes, bool invalidate);
+  uint64_t PageSize() { return lower_->PageSize(); }
+  bool Backed(uint64_t addr) { return lower_->Backed(addr); }
+  bool HasPrefetcher() const { return prefetcher_ != nullptr; }
+  bool HasBypass() const { return bypass_ != nullptr; }
+  bool HasMSHRs() const { return !mshr_.empty(); }
+  // Line state (tags, dirty bits and replacement state, not the data) for
+  // checkpoints. LoadState() fails unless the configuration is the same and
+  // leaves the data of a data cache zero until RefillData().
+  void SaveState(std::vector<char> &out) const;
+  bool LoadState(const std::vector<char> &in);
+  // Calls f(block address, block bytes, data) to fill every valid line of a
+  // data cache
+  template<class F> void RefillData(F f);
+  // Calls f(block address, block bytes, data) for every dirty line of a
+  // data cache
+  template<class F> void ForEachDirty(F f) const;
+  // The prefetcher or bypass policy needs SetPC()
+  bool UsesPC() const {
+    return (prefetcher_ && prefetcher_->UsesPC()) || (bypass_ && bypass_->UsesPC());
+  }
 
  private:
-  // Bypassing
-  bool BypassDecision();
-  // Prefetching
-  bool PrefetchDecision();
+  static const size_t kPrefetchQueueSize = 16;
+  static const int kPrefetchIssueWidth = 2;   // Queued prefetches issued per request
+
+  // Bypassing: true to send a miss in set s to the lower level without
+  // allocating. Also keeps the shadow tags of the cache without bypassing.
+  bool BypassDecision(size_t s, size_t tag, uint64_t addr, int read);
+  void ShadowAccess(size_t s, size_t tag, int read, bool demand = true);
+  // Prefetching: trains the prefetcher, true when prefetches are queued
+  bool PrefetchDecision(uint64_t addr, bool trigger);
+  // Issues queued prefetches, their time is not charged to the request but
+  // a demand hit before the fill completes waits for it
   void PrefetchAlgorithm();
+  // Without MSHRs: a hit on a prefetched line still in flight waits for it
+  // and counts the prefetch late
+  void PrefetchWait(uint64_t block, int &time);
+  // Fetches the block holding addr into set s, returns the way. pc: the
+  // access the block is filled for, 0 for prefetches
+  int Fill(size_t s, size_t tag, uint64_t addr, uint64_t pc, int &time);
+  // MSHRs: a hit on a line still being filled waits for the fill, a miss
+  // waits for a free entry and holds it until its fill completes
+  uint64_t MSHRFreeAt() const;  // Cycle the earliest entry frees up
+  void MSHRMerge(uint64_t block, int &time);
+  int MSHRWait(int time);
+  void MSHRAllocate(uint64_t block, uint64_t ready, bool prefetch);
 
   int tbits, sbits, bbits;
   CacheConfig config_;
   CacheSet *cachesets = nullptr;
+  bool tag_only_ = false;
+  std::vector<char> fill_buf_;  // Block fetched from the lower level
+  Prefetcher *prefetcher_ = nullptr;
+  std::deque<uint64_t> prefetch_queue_;  // Block addresses waiting to be fetched
+  std::vector<uint64_t> prefetch_out_;
+  BypassPolicy *bypass_ = nullptr;
+  CacheSet *shadow_ = nullptr;  // Tags of the same cache without bypassing
+  ReplacementState repl_, shadow_repl_;
+  typedef struct MSHR_ {
+    uint64_t block;
+    uint64_t ready;   // Cycle the fill completes
+    bool prefetch;
+  } MSHR;
+  std::vector<MSHR> mshr_;
+  std::vector<MSHR> prefetch_fills_;  // In-flight prefetches without MSHRs
   Storage *lower_;
   DISALLOW_COPY_AND_ASSIGN(Cache);
 };
 
+// Lines of one set in structure-of-arrays form. Ways are filled in order, so
+// ways [0, n) are valid, except the holes coherence invalidations leave
+// (tag kNoTag), which add() refills first. Replacement state per policy:
+//   LRU, DIP      age counters, 0 is the most recently used way, n - 1 the victim
+//   SRRIP, BRRIP  re-reference prediction values (0..3) in the age array
+//   PLRU          tree bits, node i (from 1) points left when bit i is 0
+//   NRU           referenced bit per way
+//   Random        none
 class CacheSet {
 public:
   CacheSet() {}
-  void init(int associativity, int block_size);
-  bool hit(size_t tag);
-  bool full();
-  void write(size_t tag, size_t offset, size_t bytes, char *content);
-  void read(size_t tag, size_t offset, size_t bytes, char *content);
-  void replace(CacheLine *victim, size_t tag, char *content);
-  void add(size_t tag, char *content);
-  CacheLine* getVictim() { return full() ? end : nullptr; }
-  ~CacheSet() { delete[] lines; }
+  ~CacheSet();
+  // index: number of the set, picks the DIP leader sets
+  void init(int associativity, int block_size, bool tag_only,
+            ReplacementState *repl, int index);
+  int find(size_t tag) const;   // Way holding tag, -1 on miss
+  bool full() const { return n == e && !holes; }
+  int getVictim();              // Way to replace when full, -1 otherwise
+  // reference: false for the access that filled the way, which must not
+  // count as a reuse
+  void write(int way, size_t offset, size_t bytes, char *content, bool reference = true);
+  void read(int way, size_t offset, size_t bytes, char *content, bool reference = true);
+  int replace(int victim, size_t tag, char *content);
+  int add(size_t tag, char *content);
+  void invalidate(int way);     // Drops the line, leaving a hole
+  void clean(int way) { dirty[way] = false; }
+  void clear();
+  // Lines from most to least recently used (LRU, DIP), in way order otherwise
+  template<class F> void forEach(F f) const;
+  // Tags and replacement state without the data, load() expects the same
+  // init() and zeroes the data
+  void save(std::vector<char> &out) const;
+  void load(const char *&p);
+
+  // Marks a line filled by a prefetch, takePrefetched() reports and clears it
+  void setPrefetched(int way) { pref[way] = true; }
+  bool takePrefetched(int way) { bool p = pref[way]; pref[way] = false; return p; }
+  bool isDirty(int way) const { return dirty[way]; }
+  size_t getTag(int way) const { return tags[way]; }
+  char *getContent(int way) const { return data ? data + (size_t)way * sz : nullptr; }
 private:
-  friend void Cache::flush();
-  void moveToHead(CacheLine *line);
-  std::map<size_t, int> tagmap;
-  int e = 0;
-  CacheLine *lines;
-  CacheLine *head, *end;
+  enum { kFollower, kLeaderLRU, kLeaderBIP };
+  static const size_t kNoTag = ~(size_t)0;   // Tags are at most 64 - sbits - bbits wide
+  void place(int way, size_t tag, char *content);
+  void touch(int way);
+  void insert(int way);   // Replacement state of a newly filled way
+  void ageLRU(int way);
+  int e = 0, n = 0, holes = 0;
+  int kind = kReplLRU, leader = kFollower;
+  ReplacementState *repl = nullptr;
+  size_t sz = 0;
+  size_t *tags = nullptr;     // Padded to a multiple of 4 ways for the vector compare
+  uint32_t *age = nullptr;
+  uint64_t bits = 0;          // PLRU tree / NRU referenced bits
+  bool *dirty = nullptr;
+  bool *pref = nullptr;        // Prefetched and not referenced since
+  char *data = nullptr;        // nullptr for tag-only sets
 };
 
+template<class F> void CacheSet::forEach(F f) const {
+  if (kind != kReplLRU && kind != kReplDIP) {
+    for (int i = 0; i < n; i++)
+      if (tags[i] != kNoTag) f(i);
+    return;
+  }
+  std::vector<int> order(n);
+  for (int i = 0; i < n; i++) order[age[i]] = i;
+  for (int i = 0; i < n; i++)
+    if (tags[order[i]] != kNoTag) f(order[i]);
+}
+
+template<class F> void Cache::ForEachDirty(F f) const {
+  if (tag_only_) return;
+  for (int i = 0; i < config_.set_num; i++) {
+    const CacheSet &set = cachesets[i];
+    set.forEach([&](int way) {
+      if (set.isDirty(way))
+        f((set.getTag(way) << (sbits + bbits)) | ((uint64_t)i << bbits), (size_t)1 << bbits,
+          (const char *)set.getContent(way));
+    });
+  }
+}
+
+template<class F> void Cache::RefillData(F f) {
+  if (tag_only_) return;
+  for (int i = 0; i < config_.set_num; i++) {
+    const CacheSet &set = cachesets[i];
+    set.forEach([&](int way) {
+      f((set.getTag(way) << (sbits + bbits)) | ((uint64_t)i << bbits), (size_t)1 << bbits,
+        set.getContent(way));
+    });
+  }
+}
+
 #endif //CACHE_CACHE_H_ 
@@ -0,0 +1,104 @@
+#include "coherence.h"
+#include <assert.h>
+#include <algorithm>
+
+static const char *kCoherenceNames[] = { "none", "mesi" };
+
+int ParseCoherence(const std::string &name) {
+  for (int i = 0; i < (int)(sizeof(kCoherenceNames) / sizeof(kCoherenceNames[0])); i++)
+    if (name == kCoherenceNames[i]) return i;
+  return -1;
+}
+
+void Directory::SetConfig(int cores, Cache **first, Cache **last, int block_size) {
+  assert(cores <= kMaxCores);
+  cores_ = cores;
+  for (int i = 0; i < cores; i++) {
+    first_[i] = first[i];
+    last_[i] = last[i];
+  }
+  bbits_ = __builtin_ctz(block_size);
+  wbits_ = bbits_ > 9 ? bbits_ - 6 : 3;   // 8-byte words up to 512-byte blocks
+  Reset();
+}
+
+int Directory::Access(int core, uint64_t addr, int bytes, int read) {
+  int time = 0;
+  uint64_t end = addr + bytes;
+  while (addr < end) {
+    uint64_t block = (addr >> bbits_) << bbits_;
+    uint64_t stop = std::min<uint64_t>(end, block + (1ULL << bbits_));
+    int first = (addr - block) >> wbits_, last = (stop - 1 - block) >> wbits_;
+    uint64_t words = (last == 63 ? ~0ULL : (1ULL << (last + 1)) - 1) & ~((1ULL << first) - 1);
+    time += AccessBlock(core, blocks_[block], block, words, read);
+    addr = stop;
+  }
+  stats_.coherence_time += time;
+  return time;
+}
+
+int Directory::AccessBlock(int core, Block &b, uint64_t block, uint64_t words, int read) {
+  uint32_t me = 1u << core;
+  int time = 0;
+  if (read) {
+    if (b.sharers & me) return 0;   // Cached, or evicted: an ordinary miss
+    Miss(core, b, words);
+    if (b.owner >= 0 && Probe(b.owner, block, false) != kProbeMiss) {
+      time += remote_.bus_latency + remote_.hit_latency;
+      stats_.downgrade_num++;
+    } else if (b.owner >= 0) {
+      b.sharers &= ~(1u << b.owner);
+    }
+    b.owner = -1;
+    b.sharers |= me;
+    if (b.sharers == me) b.owner = core;    // Exclusive
+    return time;
+  }
+  if (b.owner != core) {    // Needs an exclusive copy
+    bool upgrade = b.sharers & me;
+    if (upgrade) {
+      time += shared_.bus_latency + shared_.hit_latency;
+      stats_.upgrade_num++;
+    } else {
+      Miss(core, b, words);
+    }
+    bool invalidated = false;
+    for (int i = 0; i < cores_; i++) {
+      if (i == core || !(b.sharers >> i & 1)) continue;
+      if (Probe(i, block, true) == kProbeMiss) continue;
+      invalidated = true;
+      b.lost |= 1u << i;
+      b.written[i] = 0;
+      b.stats.invalidation_num++;
+      stats_.invalidation_num++;
+    }
+    if (invalidated) time += remote_.bus_latency + remote_.hit_latency;
+    b.sharers = me;
+    b.owner = core;
+  }
+  for (int i = 0; i < cores_; i++)
+    if (b.lost >> i & 1) b.written[i] |= words;
+  return time;
+}
+
+// A miss of core in its private caches, sorted out when it lost the block
+// to another core's write
+void Directory::Miss(int core, Block &b, uint64_t words) {
+  uint32_t me = 1u << core;
+  if (!(b.lost & me)) return;
+  b.lost &= ~me;
+  stats_.coherence_miss_num++;
+  b.stats.coherence_miss_num++;
+  if (!(b.written[core] & words)) {
+    stats_.false_sharing_num++;
+    b.stats.false_sharing_num++;
+  }
+}
+
+// The first level writes back into the last, which writes back to the
+// shared level
+ProbeResult Directory::Probe(int core, uint64_t block, bool invalidate) {
+  ProbeResult first = first_[core]->Probe(block, 1ULL << bbits_, invalidate);
+  ProbeResult last = last_[core]->Probe(block, 1ULL << bbits_, invalidate);
+  return std::max(first, last);
+}
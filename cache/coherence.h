@@ -0,0 +1,96 @@
+#ifndef CACHE_COHERENCE_H_
+#define CACHE_COHERENCE_H_
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include "storage.h"
+#include "cache.h"
+
+enum CoherenceKind {
+  kCoherenceNone = 0,
+  kCoherenceMESI    // Directory at the shared level
+};
+
+// "none" or "mesi", -1 when unknown
+int ParseCoherence(const std::string &name);
+
+// Coherence stats of all cores
+typedef struct CoherenceStats_ {
+  size_t invalidation_num; // Remote copies dropped for a write
+  size_t upgrade_num; // Writes to blocks held shared
+  size_t downgrade_num; // Remote exclusive/modified copies read by another core
+  size_t coherence_miss_num; // Misses on blocks lost to another core's write
+  size_t false_sharing_num; // Coherence misses on words the other cores did not write
+  size_t coherence_time; // In CPU cycles
+} CoherenceStats;
+
+// Per-block counters for the false sharing report
+typedef struct CoherenceBlockStats_ {
+  uint32_t invalidation_num;
+  uint32_t coherence_miss_num;
+  uint32_t false_sharing_num;
+} CoherenceBlockStats;
+
+// MESI directory in front of the private caches of every core. Each request
+// of a core goes through Access() before its first private level, and the
+// directory keeps per coherence block which cores may hold a copy and which
+// one holds it exclusive (E) or modified (M). Private caches evict silently,
+// so every core the directory acts on is probed first and only copies still
+// cached are charged. Costs use the latencies of the shared level (the
+// directory lookup) and of a remote core's last private level (invalidating
+// or flushing its copy).
+//
+// A coherence miss is a miss on a block the core lost to another core's
+// write. It is a false sharing miss when none of the words it accesses were
+// written by other cores since.
+class Directory {
+ public:
+  static const int kMaxCores = 16;
+
+  Directory() : cores_(0), bbits_(0), wbits_(0) { ClearStats(); }
+  // Cores with their first and last private levels, coherence blocks are
+  // block_size bytes (the last private level's)
+  void SetConfig(int cores, Cache **first, Cache **last, int block_size);
+  void SetLatency(StorageLatency shared, StorageLatency remote) {
+    shared_ = shared;
+    remote_ = remote;
+  }
+  // Coherence actions before core's private caches serve the request,
+  // returns their cycles
+  int Access(int core, uint64_t addr, int bytes, int read);
+  // Forgets every copy, when the private caches were emptied
+  void Reset() { blocks_.clear(); }
+  void ClearStats() { stats_ = CoherenceStats(); }
+  void GetStats(CoherenceStats &cs) const { cs = stats_; }
+  int BlockSize() const { return 1 << bbits_; }
+  // Calls f(block address, stats) for every block with coherence activity
+  template<class F> void ForEachBlock(F f) const;
+
+ private:
+  struct Block {
+    uint32_t sharers = 0;   // Cores that may hold a copy
+    int owner = -1;         // Core holding it E or M, -1 when shared or uncached
+    uint32_t lost = 0;      // Cores whose copy a write of another core dropped
+    uint64_t written[kMaxCores] = {};   // Words written since each lost core lost it
+    CoherenceBlockStats stats = {};
+  };
+  int AccessBlock(int core, Block &b, uint64_t block, uint64_t words, int read);
+  void Miss(int core, Block &b, uint64_t words);
+  ProbeResult Probe(int core, uint64_t block, bool invalidate);
+
+  int cores_;
+  Cache *first_[kMaxCores], *last_[kMaxCores];
+  int bbits_, wbits_;   // Block and word size (log2), 64 words at most
+  StorageLatency shared_, remote_;
+  std::unordered_map<uint64_t, Block> blocks_;
+  CoherenceStats stats_;
+};
+
+template<class F> void Directory::ForEachBlock(F f) const {
+  for (auto &b : blocks_)
+    if (b.second.stats.invalidation_num || b.second.stats.coherence_miss_num)
+      f(b.first, b.second.stats);
+}
+
+#endif //CACHE_COHERENCE_H_
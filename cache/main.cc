@@ -1,20 +1,263 @@
 #include "cache.h"
 #include "memory.h"
+#include "stackdist.h"
+#include "tracefile.h"
 #include <argparse.h>
 #include <iostream>
+#include <iomanip>
 #include <fstream>
 #include <string.h>
+#include <sstream>
+#include <vector>
+#include <thread>
+#include <atomic>
 using namespace std;
 
 const double cpu_freq_GHz = 2.0;
 
+void SetupL1(Cache &l1, Memory &m) {
+  l1.SetLower(&m);
+
+  StorageStats s = {};
+  m.SetStats(s);
+  l1.SetStats(s);
+
+  StorageLatency ml;
+  ml.bus_latency = 6;
+  ml.hit_latency = 100;
+  m.SetLatency(ml);
+
+  StorageLatency ll;
+  ll.bus_latency = 3;
+  ll.hit_latency = 10;
+  l1.SetLatency(ll);
+}
+
+// "a,b,c" or "lo:hi" for powers of two from lo to hi, or a mix of both
+vector<size_t> ParseList(const string &arg) {
+  vector<size_t> res;
+  stringstream ss(arg);
+  string item;
+  while (getline(ss, item, ',')) {
+    size_t colon = item.find(':');
+    if (colon == string::npos) {
+      res.push_back(stoul(item, 0, 0));
+      continue;
+    }
+    size_t lo = stoul(item.substr(0, colon), 0, 0), hi = stoul(item.substr(colon + 1), 0, 0);
+    for (size_t v = lo; v && v <= hi; v <<= 1) res.push_back(v);
+  }
+  return res;
+}
+
+// Prints the prefetch stats of a cache with a prefetcher
+void PrintPrefetchStats(const char *name, const StorageStats &s) {
+  cout << name << " prefetches issued: " << s.prefetch_num << endl;
+  cout << "  Accuracy: " << fixed << setprecision(2)
+       << (s.prefetch_num ? 100 * (double)s.prefetch_useful / s.prefetch_num : 0) << "% ("
+       << s.prefetch_useful << " useful)" << endl;
+  cout << "  Coverage: " << fixed << setprecision(2)
+       << (s.prefetch_useful + s.miss_num ? 100 * (double)s.prefetch_useful / (s.prefetch_useful + s.miss_num) : 0)
+       << "%" << endl;
+  cout << "  Late: " << s.prefetch_late << endl;
+}
+
+// Bypass count and what the miss rate would be without bypassing
+void PrintBypassStats(const char *name, const StorageStats &s) {
+  cout << name << " bypass count: " << s.bypass_num << endl;
+  cout << "  Miss rate without bypass: " << fixed << setprecision(2)
+       << (s.access_counter ? 100 * (double)s.shadow_miss_num / s.access_counter : 0) << "% ("
+       << s.shadow_miss_num << " misses)" << endl;
+}
+
+struct SweepPoint {
+  CacheConfig cc;
+  size_t block_size;
+  size_t total_time;
+  StorageStats l1, mem;
+};
+
+// Simulates every combination of the size, block size, associativity,
+// policy, replacement and prefetcher lists on a thread pool. The trace is
+// read once and shared. Replacement and prefetch columns are only added
+// when those lists are given.
+int SweepMode(TraceReader &reader, const string &sizes, const string &blocks,
+              const string &assocs, const string &policies, const string &replacements,
+              const string &prefetchers, int degree, int mshrs, int jobs) {
+  vector<TraceRecord> trace;
+  TraceRecord r;
+  trace.reserve(reader.Records());
+  while (reader.Next(r))
+    trace.push_back(r);
+
+  vector<SweepPoint> points;
+  stringstream ss(policies);
+  string policy;
+  vector<bool> writeback;
+  while (getline(ss, policy, ',')) {
+    if (policy != "wb" && policy != "wt") {
+      cout << "Unknown policy: " << policy << " (options: wb, wt)" << endl;
+      return -1;
+    }
+    writeback.push_back(policy == "wb");
+  }
+  vector<int> repls;
+  stringstream rs(replacements.empty() ? "lru" : replacements);
+  while (getline(rs, policy, ',')) {
+    int kind = ParseReplacement(policy);
+    if (kind < 0) {
+      cout << "Unknown replacement policy: " << policy
+           << " (options: lru, plru, nru, srrip, brrip, dip, random)" << endl;
+      return -1;
+    }
+    repls.push_back(kind);
+  }
+  vector<int> kinds;
+  stringstream ps(prefetchers.empty() ? "none" : prefetchers);
+  while (getline(ps, policy, ',')) {
+    int kind = ParsePrefetcher(policy);
+    if (kind < 0) {
+      cout << "Unknown prefetcher: " << policy << " (options: none, next_line, stride, stream)" << endl;
+      return -1;
+    }
+    kinds.push_back(kind);
+  }
+  for (size_t size : ParseList(sizes))
+    for (size_t block_size : ParseList(blocks))
+      for (size_t assoc : ParseList(assocs))
+        for (bool wb : writeback)
+          for (int repl : repls)
+            for (int kind : kinds) {
+              if (block_size * assoc > size) continue;
+              SweepPoint p;
+              p.cc = CacheConfig(size, assoc, size / (block_size * assoc), wb);
+              p.cc.replacement = repl;
+              p.cc.prefetcher = kind;
+              p.cc.prefetch_degree = degree;
+              p.cc.mshrs = mshrs;
+              p.block_size = block_size;
+              points.push_back(p);
+            }
+
+  atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i; (i = next++) < points.size(); ) {
+      SweepPoint &p = points[i];
+      Memory m;
+      Cache l1;
+      SetupL1(l1, m);
+      l1.SetTagOnly(true);    // Trace has no data
+      l1.SetConfig(p.cc);
+      int hit, time;
+      p.total_time = 0;
+      for (auto &a : trace) {
+        l1.SetPC(a.op == kTraceFetch ? 0 : a.pc);
+        l1.SetCycle(p.total_time);
+        l1.HandleRequest(a.addr, 0, a.op != kTraceWrite ? 1 : 0, nullptr, hit, time);
+        p.total_time += time;
+      }
+      l1.GetStats(p.l1);
+      m.GetStats(p.mem);
+    }
+  };
+  if (jobs <= 0) jobs = max(1u, thread::hardware_concurrency());
+  vector<thread> pool;
+  for (int i = 0; i < jobs; i++) pool.push_back(thread(worker));
+  for (auto &t : pool) t.join();
+
+  cout << "size,block_size,associativity,sets,policy,accesses,misses,miss_rate,"
+          "replaces,fetches,access_time,memory_accesses";
+  if (!replacements.empty()) cout << ",replacement";
+  if (!prefetchers.empty()) cout << ",prefetcher,prefetches,useful,late";
+  cout << endl;
+  for (auto &p : points) {
+    cout << p.cc.size << "," << p.block_size << "," << p.cc.associativity << ","
+         << p.cc.set_num << "," << (p.cc.write_through ? "wt" : "wb") << ","
+         << p.l1.access_counter << "," << p.l1.miss_num << ","
+         << fixed << setprecision(4)
+         << (p.l1.access_counter ? 100 * (double)p.l1.miss_num / p.l1.access_counter : 0) << ","
+         << p.l1.replace_num << "," << p.l1.fetch_num << ","
+         << p.total_time << "," << p.mem.access_counter;
+    if (!replacements.empty()) cout << "," << ReplacementName(p.cc.replacement);
+    if (!prefetchers.empty())
+      cout << "," << PrefetcherName(p.cc.prefetcher) << "," << p.l1.prefetch_num << ","
+           << p.l1.prefetch_useful << "," << p.l1.prefetch_late;
+    cout << endl;
+  }
+  return 0;
+}
+
+// Rewrites a text or binary trace in the binary format
+int ConvertMode(TraceReader &reader, const string &out) {
+  TraceWriter writer;
+  if (!writer.Open(out.c_str(), 0)) {
+    cout << "Can't open " << out << " for writing" << endl;
+    return -1;
+  }
+  TraceRecord r;
+  while (reader.Next(r)) writer.Write(r);
+  writer.Close();
+  cout << "Converted " << writer.Records() << " records to " << out << " ("
+       << writer.Bytes() << " bytes)" << endl;
+  return 0;
+}
+
+// Stats of every power-of-two cache up to max_size and max_assoc from one
+// pass over the trace, write back/write allocate only
+int StackDistanceMode(TraceReader &reader, size_t block_size, size_t max_size,
+                      size_t max_assoc, bool csv) {
+  size_t max_sets = max_size / block_size;
+  StackDistance sd(block_size, max_sets, max_assoc);
+  TraceRecord r;
+  while (reader.Next(r))
+    sd.Access(r.addr);
+
+  if (csv) cout << "size,sets,associativity,accesses,misses,miss_rate,replaces,fetches" << endl;
+  else {
+    cout << "Stack distance analysis (Write Back/Write Alloc, LRU)\n"
+            "  Block size: " << block_size << "\n"
+            "  Access count: " << sd.Accesses() << "\n" << endl;
+    cout << setw(10) << "Size" << setw(8) << "Sets" << setw(7) << "Assoc"
+         << setw(12) << "Misses" << setw(11) << "Miss rate" << setw(12) << "Replaces" << endl;
+  }
+  for (size_t size = block_size; size <= max_size; size <<= 1) {
+    for (size_t assoc = 1; assoc <= max_assoc && assoc * block_size <= size; assoc <<= 1) {
+      size_t sets = size / (block_size * assoc);
+      size_t misses = sd.Misses(sets, assoc);
+      double rate = sd.Accesses() ? 100 * (double)misses / sd.Accesses() : 0;
+      if (csv)
+        cout << size << "," << sets << "," << assoc << "," << sd.Accesses() << ","
+             << misses << "," << fixed << setprecision(4) << rate << ","
+             << sd.Replaces(sets, assoc) << "," << misses << endl;
+      else
+        cout << setw(10) << size << setw(8) << sets << setw(7) << assoc
+             << setw(12) << misses << setw(10) << fixed << setprecision(2) << rate << "%"
+             << setw(12) << sd.Replaces(sets, assoc) << endl;
+    }
+  }
+  return 0;
+}
+
 int main(int argc, const char **argv) {
   argparse::ArgumentParser program("Cache Simulator");
   program.add_argument().names({"-f", "--file"}).description("The trace file").required(true);
-  program.add_argument().names({"--size"}).description("Cache Size").required(true);
-  program.add_argument().names({"-B", "--blocksize"}).description("Cache block size").required(true);
-  program.add_argument().names({"-E", "--associativity"}).description("Cache associativity").required(true);
+  program.add_argument().names({"--size"}).description("Cache Size");
+  program.add_argument().names({"-B", "--blocksize"}).description("Cache block size");
+  program.add_argument().names({"-E", "--associativity"}).description("Cache associativity");
   program.add_argument().names({"--wb", "--writeback"}).description("Use Writeback/Writealloc policy");
+  program.add_argument().names({"--stack"}).description("Stack distance mode: all sizes up to --size and associativities up to -E in one pass");
+  program.add_argument().names({"--csv"}).description("CSV output for stack distance mode");
+  program.add_argument().names({"--sweep"}).description("Sweep mode: --size, -B, -E take lists (a,b,c) or power-of-two ranges (lo:hi), CSV output");
+  program.add_argument().names({"--policy"}).description("Write policies to sweep: wb, wt or wb,wt");
+  program.add_argument().names({"--replacement"}).description("Replacement policy: lru, plru, nru, srrip, brrip, dip or random; a list in sweep mode");
+  program.add_argument().names({"--prefetch"}).description("L1 prefetcher: none, next_line, stride (needs PCs in the trace) or stream; a list in sweep mode");
+  program.add_argument().names({"--degree"}).description("Blocks prefetched per trigger, default 1");
+  program.add_argument().names({"--mshrs"}).description("L1 MSHRs, outstanding misses and prefetches; default 0, a blocking cache");
+  program.add_argument().names({"--bypass"}).description("L1 bypass policy: none, pc_signature (needs PCs in the trace) or streaming");
+  program.add_argument().names({"-j", "--jobs"}).description("Sweep threads, default one per core");
+  program.add_argument().names({"--convert"}).description("Write the trace to this file in the binary format and exit");
+  program.add_argument().names({"--stream"}).description("Read binary traces chunk by chunk instead of mapping them");
+  program.add_argument().names({"--skip"}).description("Skip this many records at the start of the trace");
   program.enable_help();
 
   auto err = program.parse(argc, argv);
@@ -28,24 +271,53 @@ int main(int argc, const char **argv) {
     return 0;
   }
 
+  TraceReader reader;
+  if (!reader.Open(program.get<string>("file").c_str(), program.exists("stream"))) {
+    cout << "Can't open trace " << program.get<string>("file") << endl;
+    return -1;
+  }
+  if (program.exists("skip")) {
+    size_t skip = program.get<size_t>("skip");
+    TraceRecord r;
+    if (!reader.Seek(skip))
+      for (size_t i = 0; i < skip && reader.Next(r); i++) ;
+  }
+  if (program.exists("convert"))
+    return ConvertMode(reader, program.get<string>("convert"));
+  if (!program.exists("size") || !program.exists("B") || !program.exists("E")) {
+    cout << "--size, -B and -E are required" << endl;
+    program.print_help();
+    return -1;
+  }
+
+  string replacement = program.exists("replacement") ? program.get<string>("replacement") : "";
+  if (program.exists("stack")) {
+    if (!replacement.empty() && replacement != "lru") {
+      cout << "Stack distance mode models LRU only" << endl;
+      return -1;
+    }
+    return StackDistanceMode(reader, program.get<size_t>("B"),
+                             program.get<size_t>("size"), program.get<size_t>("E"),
+                             program.exists("csv"));
+  }
+  int degree = program.exists("degree") ? program.get<int>("degree") : 1;
+  int mshrs = program.exists("mshrs") ? program.get<int>("mshrs") : 0;
+  if (mshrs < 0) {
+    cout << "--mshrs must not be negative" << endl;
+    return -1;
+  }
+  if (program.exists("sweep"))
+    return SweepMode(reader, program.get<string>("size"),
+                     program.get<string>("B"), program.get<string>("E"),
+                     program.exists("policy") ? program.get<string>("policy")
+                                              : program.exists("wb") ? "wb" : "wt",
+                     replacement, program.exists("prefetch") ? program.get<string>("prefetch") : "",
+                     degree, mshrs, program.exists("jobs") ? program.get<int>("jobs") : 0);
+
   Memory m;
   Cache l1;
-  l1.SetLower(&m);
-
   StorageStats s;
-  s.access_time = 0;
-  m.SetStats(s);
-  l1.SetStats(s);
-
-  StorageLatency ml;
-  ml.bus_latency = 6;
-  ml.hit_latency = 100;
-  m.SetLatency(ml);
-
-  StorageLatency ll;
-  ll.bus_latency = 3;
-  ll.hit_latency = 10;
-  l1.SetLatency(ll);
+  SetupL1(l1, m);
 
   size_t block_size = program.get<size_t>("B");
   size_t associativity = program.get<size_t>("E");
@@ -53,23 +325,58 @@ int main(int argc, const char **argv) {
   bool writeback = program.exists("writeback");
 
   CacheConfig cc(cache_size, associativity, cache_size / (block_size * associativity), writeback);
+  if (!replacement.empty()) {
+    cc.replacement = ParseReplacement(replacement);
+    if (cc.replacement < 0) {
+      cout << "Unknown replacement policy: " << replacement
+           << " (options: lru, plru, nru, srrip, brrip, dip, random)" << endl;
+      return -1;
+    }
+  }
+  if (program.exists("prefetch")) {
+    cc.prefetcher = ParsePrefetcher(program.get<string>("prefetch"));
+    if (cc.prefetcher < 0) {
+      cout << "Unknown prefetcher: " << program.get<string>("prefetch")
+           << " (options: none, next_line, stride, stream)" << endl;
+      return -1;
+    }
+    cc.prefetch_degree = degree;
+  }
+  if (program.exists("bypass")) {
+    cc.bypass = ParseBypass(program.get<string>("bypass"));
+    if (cc.bypass < 0) {
+      cout << "Unknown bypass policy: " << program.get<string>("bypass")
+           << " (options: none, pc_signature, streaming)" << endl;
+      return -1;
+    }
+  }
+  cc.mshrs = mshrs;
   l1.SetConfig(cc);
   cout << "L1 Cache Config:\n"
           "  Cache Size: " << cc.size << "\n"
           "  Set number: " << cc.set_num << "\n"
           "  Associativity: " << cc.associativity << "\n"
-          "  Write Policy: " << (writeback ? "Write Back/Write Alloc\n" : "Write Through / No Write Alloc\n") << endl;
-  ifstream fin(program.get<string>("file").c_str());
-  char ch; 
-  string addr_s;
-  size_t addr;
+          "  Write Policy: " << (writeback ? "Write Back/Write Alloc\n" : "Write Through / No Write Alloc\n");
+  if (cc.replacement != kReplLRU)
+    cout << "  Replacement: " << ReplacementName(cc.replacement) << "\n";
+  if (cc.prefetcher != kPrefetchNone)
+    cout << "  Prefetcher: " << PrefetcherName(cc.prefetcher) << " (degree " << cc.prefetch_degree << ")\n";
+  if (cc.bypass != kBypassNone)
+    cout << "  Bypass: " << BypassName(cc.bypass) << "\n";
+  if (cc.mshrs)
+    cout << "  MSHRs: " << cc.mshrs << "\n";
+  cout << endl;
+  TraceRecord r;
   char content[64];
   int hit, time, read;
   size_t total_time = 0;
-  while (fin >> ch >> addr_s) {
-    addr = stol(addr_s, 0, 0);
-    read = (ch == 'r') ? 1 : 0;
-    l1.HandleRequest(addr, 0, read, content, hit, time);
+  // Each access starts when the previous one completes, so prefetch fills
+  // take time to arrive
+  while (reader.Next(r)) {
+    read = (r.op != kTraceWrite) ? 1 : 0;
+    l1.SetPC(r.op == kTraceFetch ? 0 : r.pc);
+    l1.SetCycle(total_time);
+    l1.HandleRequest(r.addr, 0, read, content, hit, time);
     total_time += time;
   }
   
@@ -85,6 +392,8 @@ int main(int argc, const char **argv) {
   cout << "  Miss rate: " << fixed << setprecision(2) << 100 * (double)s.miss_num / s.access_counter << "%" << endl;
   cout << "L1 Cache replace count: " << s.replace_num << endl; 
   cout << "L1 Cache fetch count: " << s.fetch_num << endl;
+  if (l1.HasPrefetcher()) PrintPrefetchStats("L1 Cache", s);
+  if (l1.HasBypass()) PrintBypassStats("L1 Cache", s);
   cout << endl;
   m.GetStats(s);
   cout << "Memory access time (CPU cycles): " << s.access_time << endl;
@@ -1,14 +1,35 @@
 #include "memory.h"
 #include <assert.h>
 #include <string.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+// Guest physical range reserved for the flat backing (address space only)
+static const size_t kReserveBytes = (size_t)1 << 36;
 
 static size_t ROUND_DOWN(size_t bytes, size_t ALIGN)
 {
   return ((bytes) & ~(ALIGN - 1));
 }
 
+Memory::~Memory() {
+  reset();
+  if (base) munmap(base, kReserveBytes);
+}
+
+void Memory::SetPGSize(size_t pgsize) {
+  reset();
+  this->pgsize = pgsize;
+  if (base == nullptr && pgsize) {
+    void *p = mmap(nullptr, kReserveBytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p != MAP_FAILED) base = (char *)p;
+  }
+}
+
 void Memory::reset()
 {
+  if (base) madvise(base, nextpg, MADV_DONTNEED);
   for (auto &i : pages) 
     free(i.second);
   pages.clear();
@@ -16,34 +37,49 @@ void Memory::reset()
 }
 
 void Memory::free_page(size_t addr) {
+  if (base) {
+    assert(addr < nextpg);
+    madvise(base + addr, pgsize, MADV_DONTNEED);
+    return;
+  }
   assert(pages.find(addr) != pages.end());
   free(pages[addr]);
   pages.erase(addr);
 }
 
 size_t Memory::alloc_page() {
-  void *newpage = malloc(this->pgsize);
   size_t ret = nextpg;
-  pages[nextpg] = newpage;
+  if (base) assert(nextpg + pgsize <= kReserveBytes);
+  else pages[nextpg] = calloc(1, this->pgsize);
   nextpg += this->pgsize;
   return ret;
 }
 
+char *Memory::GetPage(uint64_t addr) {
+  if (pgsize == 0) return nullptr;
+  if (base) return addr < nextpg ? base + ROUND_DOWN(addr, pgsize) : nullptr;
+  auto it = pages.find(ROUND_DOWN(addr, pgsize));
+  return it == pages.end() ? nullptr : (char *)it->second;
+}
+
 void Memory::HandleRequest(uint64_t addr, int bytes, int read,
                           char *content, int &hit, int &time) {
   hit = 1;
   time = latency_.hit_latency + latency_.bus_latency;
   stats_.access_time += time;
   stats_.access_counter++;
+  if (!timing_only) Access(addr, bytes, read, content);
+}
+
+void Memory::Access(uint64_t addr, int bytes, int read, char *content) {
   if (pgsize == 0) return;  // Simple simulation, no data
 
-  size_t page_start = ROUND_DOWN(addr, pgsize);
-  assert(pages.find(page_start) != pages.end());
-  void *page = pages[page_start];
-  if (read) memcpy(content, (char *)page + addr - page_start, bytes);
+  char *page = GetPage(addr);
+  assert(page != nullptr);
+  size_t offset = addr - ROUND_DOWN(addr, pgsize);
+  if (read) memcpy(content, page + offset, bytes);
   else {
-    if (content) memcpy((char *)page + addr - page_start, content, bytes);
-    else memset((char *)page + addr - page_start, 0, bytes);
+    if (content) memcpy(page + offset, content, bytes);
+    else memset(page + offset, 0, bytes);
   }
 }
-
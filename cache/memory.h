@@ -5,22 +5,35 @@
 #include <map>
 #include "storage.h"
 
+// Physical pages are handed out sequentially from one flat mmap reservation,
+// so lookups are pointer arithmetic and the kernel zero-fills pages lazily.
+// Falls back to one malloc per page when the reservation fails.
 class Memory: public Storage {
  public:
-  Memory() : pgsize(0), nextpg(0) { pages.clear(); }
-  ~Memory() {}
-  void SetPGSize(size_t pgsize) { this->pgsize = pgsize; pages.clear(); }
+  Memory() : pgsize(0), nextpg(0), base(nullptr), timing_only(false) { pages.clear(); }
+  ~Memory();
+  void SetPGSize(size_t pgsize);
+  // Requests only count time and stats, data goes through Access()
+  void SetTimingOnly(bool timing_only) { this->timing_only = timing_only; }
   void free_page(size_t addr);
   void reset();
   size_t alloc_page();
+  // Host address of the page holding addr, nullptr if not allocated
+  char *GetPage(uint64_t addr);
 
   // Main access process
   void HandleRequest(uint64_t addr, int bytes, int read,
                      char *content, int &hit, int &time);
+  uint64_t PageSize() { return pgsize; }
+  bool Backed(uint64_t addr) { return pgsize == 0 || GetPage(addr) != nullptr; }
+  // Data only, no latency or stats (functional simulation)
+  void Access(uint64_t addr, int bytes, int read, char *content);
 
  private:
   // Memory implement
   size_t pgsize, nextpg;
+  char *base;  // Flat backing, nullptr when using pages
+  bool timing_only;
   std::map<size_t, void *> pages;
   DISALLOW_COPY_AND_ASSIGN(Memory);
 };
@@ -0,0 +1,100 @@
+#include "prefetch.h"
+
+static const char *kNames[] = { "none", "next_line", "stride", "stream" };
+
+int ParsePrefetcher(const std::string &name) {
+  for (int i = 0; i < (int)(sizeof(kNames) / sizeof(kNames[0])); i++)
+    if (name == kNames[i]) return i;
+  return -1;
+}
+
+const char *PrefetcherName(int kind) {
+  return kNames[kind];
+}
+
+Prefetcher *Prefetcher::Create(int kind, int block_size, int degree) {
+  if (degree < 1) degree = 1;
+  switch (kind) {
+    case kPrefetchNextLine: return new NextLinePrefetcher(block_size, degree);
+    case kPrefetchStride: return new StridePrefetcher(block_size, degree);
+    case kPrefetchStream: return new StreamPrefetcher(block_size, degree);
+    default: return nullptr;
+  }
+}
+
+void NextLinePrefetcher::Train(uint64_t addr, uint64_t pc, bool trigger,
+                               std::vector<uint64_t> &out) {
+  if (!trigger) return;
+  uint64_t block = addr & ~(uint64_t)(block_size_ - 1);
+  for (int i = 1; i <= degree_; i++)
+    out.push_back(block + (uint64_t)i * block_size_);
+}
+
+StridePrefetcher::StridePrefetcher(int block_size, int degree)
+    : block_size_(block_size), degree_(degree), table_(kEntries) {
+  for (auto &e : table_) e.pc = 0;
+}
+
+void StridePrefetcher::Train(uint64_t addr, uint64_t pc, bool trigger,
+                             std::vector<uint64_t> &out) {
+  if (pc == 0) return;
+  Entry &e = table_[(pc >> 2) & (kEntries - 1)];
+  if (e.pc != pc) {
+    e.pc = pc;
+    e.last_addr = addr;
+    e.stride = 0;
+    e.conf = 0;
+    return;
+  }
+  int64_t stride = addr - e.last_addr;
+  if (stride == 0) return;    // Same location again, nothing to learn
+  if (stride == e.stride) {
+    if (e.conf < 3) e.conf++;
+  } else {
+    if (e.conf > 0) e.conf--;
+    if (e.conf == 0) e.stride = stride;
+  }
+  e.last_addr = addr;
+  if (e.conf < 2) return;
+  uint64_t mask = ~(uint64_t)(block_size_ - 1), block = addr & mask;
+  for (int i = 1; i <= degree_; i++) {
+    uint64_t target = (addr + i * e.stride) & mask;
+    if (target != block && (out.empty() || out.back() != target)) out.push_back(target);
+  }
+}
+
+StreamPrefetcher::StreamPrefetcher(int block_size, int degree)
+    : bbits_(__builtin_ctz(block_size)), degree_(degree), clock_(0), streams_(kStreams) {
+  for (auto &s : streams_) s.valid = false;
+}
+
+void StreamPrefetcher::Train(uint64_t addr, uint64_t pc, bool trigger,
+                             std::vector<uint64_t> &out) {
+  if (!trigger) return;
+  int64_t block = addr >> bbits_;
+  Stream *hit = nullptr, *victim = &streams_[0];
+  for (auto &s : streams_) {
+    if (victim->valid && (!s.valid || s.lru < victim->lru)) victim = &s;
+    if (!s.valid) continue;
+    int64_t d = block - s.last;
+    if (d == 0 || d > kWindow || d < -kWindow) continue;
+    if (s.dir == 0 || (d > 0) == (s.dir > 0)) {
+      hit = &s;
+      break;
+    }
+  }
+  if (hit == nullptr) {   // New stream, direction unknown yet
+    victim->valid = true;
+    victim->last = block;
+    victim->dir = 0;
+    victim->lru = ++clock_;
+    return;
+  }
+  if (hit->dir == 0) hit->dir = block > hit->last ? 1 : -1;
+  hit->last = block;
+  hit->lru = ++clock_;
+  for (int i = 1; i <= degree_; i++) {
+    int64_t target = block + i * hit->dir;
+    if (target >= 0) out.push_back((uint64_t)target << bbits_);
+  }
+}
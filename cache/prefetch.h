@@ -0,0 +1,85 @@
+#ifndef CACHE_PREFETCH_H_
+#define CACHE_PREFETCH_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+enum PrefetchKind {
+  kPrefetchNone = 0,
+  kPrefetchNextLine,    // The next blocks after a trigger
+  kPrefetchStride,      // Per-PC constant strides
+  kPrefetchStream       // Ascending/descending block streams
+};
+
+// "none", "next_line", "stride" or "stream", -1 when unknown
+int ParsePrefetcher(const std::string &name);
+const char *PrefetcherName(int kind);
+
+// Hardware prefetcher of one cache level. It watches the demand accesses of
+// its cache and proposes block addresses, which the cache queues and fetches
+// from the lower level in the background.
+class Prefetcher {
+ public:
+  virtual ~Prefetcher() {}
+  // addr: demand address, pc: load/store making it (0 when unknown),
+  // trigger: a miss, or the first hit on a prefetched block
+  virtual void Train(uint64_t addr, uint64_t pc, bool trigger,
+                     std::vector<uint64_t> &out) = 0;
+  virtual bool UsesPC() const { return false; }
+  // nullptr for kPrefetchNone. degree: blocks proposed per trigger
+  static Prefetcher *Create(int kind, int block_size, int degree);
+};
+
+class NextLinePrefetcher : public Prefetcher {
+ public:
+  NextLinePrefetcher(int block_size, int degree)
+      : block_size_(block_size), degree_(degree) {}
+  void Train(uint64_t addr, uint64_t pc, bool trigger, std::vector<uint64_t> &out);
+
+ private:
+  int block_size_, degree_;
+};
+
+// Reference prediction table indexed by PC. An entry predicts once the same
+// stride was seen twice in a row.
+class StridePrefetcher : public Prefetcher {
+ public:
+  StridePrefetcher(int block_size, int degree);
+  void Train(uint64_t addr, uint64_t pc, bool trigger, std::vector<uint64_t> &out);
+  bool UsesPC() const { return true; }
+
+ private:
+  static const int kEntries = 256;
+  struct Entry {
+    uint64_t pc, last_addr;
+    int64_t stride;
+    int conf;   // 0..3
+  };
+  int block_size_, degree_;
+  std::vector<Entry> table_;
+};
+
+// Tracks up to kStreams block streams. A stream is allocated on a trigger
+// that belongs to none, gets its direction from the next trigger within
+// kWindow blocks and then keeps degree blocks ahead of the accesses.
+class StreamPrefetcher : public Prefetcher {
+ public:
+  StreamPrefetcher(int block_size, int degree);
+  void Train(uint64_t addr, uint64_t pc, bool trigger, std::vector<uint64_t> &out);
+
+ private:
+  static const int kStreams = 8;
+  static const int64_t kWindow = 16;
+  struct Stream {
+    int64_t last;     // Last block of the stream accessed
+    int dir;          // +1, -1, 0 while training
+    uint64_t lru;
+    bool valid;
+  };
+  int bbits_, degree_;
+  uint64_t clock_;
+  std::vector<Stream> streams_;
+};
+
+#endif //CACHE_PREFETCH_H_
@@ -0,0 +1,68 @@
+#include "stackdist.h"
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+
+static int LOG2(size_t x) {
+  int n = 0;
+  while ((size_t)1 << (n + 1) <= x) n++;
+  return n;
+}
+
+StackDistance::StackDistance(int block_size, int max_sets, int max_assoc)
+    : bbits_(LOG2(block_size)), max_assoc_(max_assoc), accesses_(0) {
+  for (int sets = 1; sets <= max_sets; sets <<= 1) {
+    Level l;
+    l.sets = sets;
+    l.stacks.assign((size_t)sets * max_assoc, 0);
+    l.depth.assign(sets, 0);
+    l.hist.assign(max_assoc, 0);
+    l.distinct.assign(sets, 0);
+    levels_.push_back(l);
+  }
+}
+
+void StackDistance::Access(uint64_t addr) {
+  uint64_t block = addr >> bbits_;
+  bool first = seen_.insert(block).second;
+  accesses_++;
+  for (auto &l : levels_) {
+    size_t s = block & (l.sets - 1);
+    uint64_t *stack = &l.stacks[s * max_assoc_];
+    int &depth = l.depth[s];
+    int d = 0;
+    if (!first)
+      while (d < depth && stack[d] != block) d++;
+    if (!first && d < depth) {
+      l.hist[d]++;
+    } else {    // Deeper than the largest associativity, a miss everywhere
+      if (first) l.distinct[s]++;
+      if (depth < max_assoc_) depth++;
+      d = depth - 1;
+    }
+    memmove(stack + 1, stack, d * sizeof(uint64_t));
+    stack[0] = block;
+  }
+}
+
+const StackDistance::Level &StackDistance::GetLevel(int sets) const {
+  size_t i = LOG2(sets);
+  assert(i < levels_.size() && levels_[i].sets == sets);
+  return levels_[i];
+}
+
+size_t StackDistance::Misses(int sets, int assoc) const {
+  assert(assoc <= max_assoc_);
+  const Level &l = GetLevel(sets);
+  size_t hits = 0;
+  for (int d = 0; d < assoc; d++) hits += l.hist[d];
+  return accesses_ - hits;
+}
+
+// Misses into a set that already holds assoc blocks evict one
+size_t StackDistance::Replaces(int sets, int assoc) const {
+  const Level &l = GetLevel(sets);
+  size_t fills = 0;
+  for (size_t n : l.distinct) fills += std::min(n, (size_t)assoc);
+  return Misses(sets, assoc) - fills;
+}
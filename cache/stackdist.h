@@ -0,0 +1,41 @@
+#ifndef CACHE_STACKDIST_H_
+#define CACHE_STACKDIST_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <unordered_set>
+
+// One-pass LRU stack distance (Mattson) analysis for one block size.
+// Every power-of-two set count keeps per-set LRU stacks truncated at the
+// largest associativity, so a single pass over a trace gives the stats of
+// all (sets, associativity) pairs. Matches Cache with write back/write
+// allocate, where reads and writes update LRU the same way.
+class StackDistance {
+ public:
+  StackDistance(int block_size, int max_sets, int max_assoc);
+
+  void Access(uint64_t addr);
+
+  // What a Cache of this geometry would report
+  size_t Accesses() const { return accesses_; }
+  size_t Misses(int sets, int assoc) const;
+  size_t Replaces(int sets, int assoc) const;
+
+ private:
+  struct Level {    // One set count
+    int sets;
+    std::vector<uint64_t> stacks;   // sets * max_assoc_ blocks, MRU first
+    std::vector<int> depth;         // Valid entries per stack
+    std::vector<size_t> hist;       // hist[d]: accesses at stack distance d
+    std::vector<size_t> distinct;   // Different blocks seen per set
+  };
+  const Level &GetLevel(int sets) const;
+
+  int bbits_, max_assoc_;
+  size_t accesses_;
+  std::vector<Level> levels_;
+  std::unordered_set<uint64_t> seen_;
+};
+
+#endif //CACHE_STACKDIST_H_
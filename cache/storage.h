@@ -17,6 +17,12 @@ typedef struct StorageStats_ {
   size_t replace_num; // Evict old lines
   size_t fetch_num; // Fetch lower layer
   size_t prefetch_num; // Prefetch
+  size_t prefetch_useful; // Prefetched lines later hit by a demand access
+  size_t prefetch_late; // Demand accesses to blocks still queued or in flight for prefetch
+  size_t bypass_num; // Misses sent to the lower layer without allocating
+  size_t shadow_miss_num; // Misses of the same cache without bypassing
+  size_t mshr_merge_num; // Hits on lines whose fill is still in flight
+  size_t mshr_stall_time; // Cycles misses waited for a free MSHR
 } StorageStats;
 
 // Storage basic config
@@ -37,6 +43,12 @@ class Storage {
   void GetStats(StorageStats &ss) { ss = stats_; }
   void SetLatency(StorageLatency sl) { latency_ = sl; }
   void GetLatency(StorageLatency &sl) { sl = latency_; }
+  // PC of the load/store behind the following requests, 0 for instruction
+  // fetches or when unknown
+  void SetPC(uint64_t pc) { pc_ = pc; }
+  // CPU cycle the following requests are issued at, only non-blocking
+  // caches look at it
+  void SetCycle(uint64_t cycle) { cycle_ = cycle; }
 
   // Main access process
   // [in]  addr: access address
@@ -47,10 +59,16 @@ class Storage {
   // [out] time: total access time
   virtual void HandleRequest(uint64_t addr, int bytes, int read,
                              char *content, int &hit, int &time) = 0;
+  // Physical page size of the memory below, 0 when it has no pages
+  virtual uint64_t PageSize() { return 0; }
+  // Whether memory backs the block at addr, so that a prefetch may fetch it
+  virtual bool Backed(uint64_t /*addr*/) { return true; }
 
  protected:
   StorageStats stats_;
   StorageLatency latency_;
+  uint64_t pc_ = 0;
+  uint64_t cycle_ = 0;
 };
 
 #endif //CACHE_STORAGE_H_ 
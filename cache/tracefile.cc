@@ -0,0 +1,275 @@
+#include "tracefile.h"
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char kMagic[8] = { 'R', 'V', 'T', 'R', 'A', 'C', 'E', 0 };
+static const size_t kHeaderBytes = 40;
+static const size_t kChunkHeaderBytes = 8;
+static const size_t kIndexEntryBytes = 16;
+
+static void PutVarint(std::vector<uint8_t> &buf, uint64_t v) {
+  while (v >= 0x80) {
+    buf.push_back((v & 0x7f) | 0x80);
+    v >>= 7;
+  }
+  buf.push_back(v);
+}
+
+// False when the varint runs past end (truncated trace)
+static bool GetVarint(const uint8_t *&p, const uint8_t *end, uint64_t &v) {
+  v = 0;
+  for (int shift = 0; p < end && shift < 64; shift += 7) {
+    uint8_t b = *p++;
+    v |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) return true;
+  }
+  return false;
+}
+
+static uint64_t ZigZag(uint64_t delta) { return (delta << 1) ^ (uint64_t)((int64_t)delta >> 63); }
+static uint64_t UnZigZag(uint64_t v) { return (v >> 1) ^ (~(v & 1) + 1); }
+
+template<class T> static void Put(uint8_t *p, T v) { memcpy(p, &v, sizeof(T)); }
+template<class T> static T Get(const uint8_t *p) { T v; memcpy(&v, p, sizeof(T)); return v; }
+
+bool TraceWriter::Open(const char *path, uint32_t flags) {
+  Close();
+  out_ = fopen(path, "wb");
+  if (out_ == nullptr) return false;
+  flags_ = flags;
+  records_ = chunks_ = 0;
+  chunk_records_ = 0;
+  last_addr_ = last_pc_ = 0;
+  chunk_.clear();
+  index_.clear();
+  uint8_t header[kHeaderBytes] = {};  // Filled in by Close()
+  fwrite(header, 1, kHeaderBytes, out_);
+  bytes_ = kHeaderBytes;
+  return true;
+}
+
+void TraceWriter::Write(const TraceRecord &r) {
+  chunk_.push_back(r.op);
+  PutVarint(chunk_, r.size);
+  PutVarint(chunk_, ZigZag(r.addr - last_addr_));
+  last_addr_ = r.addr;
+  if (flags_ & kTraceHasPC) {
+    PutVarint(chunk_, ZigZag(r.pc - last_pc_));
+    last_pc_ = r.pc;
+  }
+  records_++;
+  if (++chunk_records_ == kTraceChunkRecords) FlushChunk();
+}
+
+void TraceWriter::FlushChunk() {
+  if (chunk_records_ == 0) return;
+  uint8_t header[kChunkHeaderBytes], entry[kIndexEntryBytes];
+  Put<uint32_t>(header, chunk_.size());
+  Put<uint32_t>(header + 4, chunk_records_);
+  Put<uint64_t>(entry, bytes_);
+  Put<uint32_t>(entry + 8, chunk_.size());
+  Put<uint32_t>(entry + 12, chunk_records_);
+  index_.insert(index_.end(), entry, entry + kIndexEntryBytes);
+  fwrite(header, 1, kChunkHeaderBytes, out_);
+  fwrite(chunk_.data(), 1, chunk_.size(), out_);
+  bytes_ += kChunkHeaderBytes + chunk_.size();
+  chunks_++;
+  chunk_.clear();
+  chunk_records_ = 0;
+  last_addr_ = last_pc_ = 0;
+}
+
+void TraceWriter::Close() {
+  if (out_ == nullptr) return;
+  FlushChunk();
+  uint64_t index_offset = bytes_;
+  fwrite(index_.data(), 1, index_.size(), out_);
+  bytes_ += index_.size();
+
+  uint8_t header[kHeaderBytes];
+  memcpy(header, kMagic, 8);
+  Put<uint32_t>(header + 8, kTraceVersion);
+  Put<uint32_t>(header + 12, flags_);
+  Put<uint64_t>(header + 16, records_);
+  Put<uint64_t>(header + 24, chunks_);
+  Put<uint64_t>(header + 32, index_offset);
+  fseek(out_, 0, SEEK_SET);
+  fwrite(header, 1, kHeaderBytes, out_);
+  fclose(out_);
+  out_ = nullptr;
+}
+
+bool TraceReader::Open(const char *path, bool stream) {
+  Close();
+  uint8_t header[kHeaderBytes];
+  in_ = fopen(path, "rb");
+  if (in_ == nullptr) return false;
+  size_t probed = fread(header, 1, kHeaderBytes, in_);
+  binary_ = probed == kHeaderBytes && memcmp(header, kMagic, 8) == 0;
+  if (!binary_) {   // Text trace, read on from in_ after the probed bytes
+    probe_.assign((const char *)header, probed);
+    probe_pos_ = 0;
+    return true;
+  }
+  if (Get<uint32_t>(header + 8) != kTraceVersion) {
+    fprintf(stderr, "%s: unsupported trace version %u\n", path, Get<uint32_t>(header + 8));
+    Close();
+    return false;
+  }
+  flags_ = Get<uint32_t>(header + 12);
+  records_ = Get<uint64_t>(header + 16);
+  chunks_ = Get<uint64_t>(header + 24);
+  index_offset_ = Get<uint64_t>(header + 32);
+  next_chunk_ = 0;
+  left_ = 0;
+
+  struct stat st;
+  stream_ = stream || fstat(fileno(in_), &st) != 0 || !S_ISREG(st.st_mode);
+  if (stream_) return true;
+  map_size_ = st.st_size;
+  void *p = mmap(nullptr, map_size_, PROT_READ, MAP_PRIVATE, fileno(in_), 0);
+  fclose(in_);
+  in_ = nullptr;
+  if (p == MAP_FAILED) return false;
+  map_ = (const uint8_t *)p;
+  if (!CheckIndex()) {
+    fprintf(stderr, "%s: truncated or malformed trace index\n", path);
+    Close();
+    return false;
+  }
+  madvise(p, map_size_, MADV_SEQUENTIAL);
+  pos_ = kHeaderBytes;
+  released_ = 0;
+  return true;
+}
+
+// True if the index lies in the mapping and every entry names a whole chunk
+// between the header and the index, so Seek() can follow it
+bool TraceReader::CheckIndex() const {
+  if (index_offset_ < kHeaderBytes || index_offset_ > map_size_ ||
+      chunks_ > (map_size_ - index_offset_) / kIndexEntryBytes)
+    return false;
+  const uint8_t *index = map_ + index_offset_;
+  uint64_t records = 0;
+  for (uint64_t i = 0; i < chunks_; i++) {
+    const uint8_t *e = index + i * kIndexEntryBytes;
+    uint64_t offset = Get<uint64_t>(e);
+    uint32_t bytes = Get<uint32_t>(e + 8), n = Get<uint32_t>(e + 12);
+    if (offset < kHeaderBytes || offset > index_offset_ - kChunkHeaderBytes ||
+        bytes > index_offset_ - kChunkHeaderBytes - offset ||
+        Get<uint32_t>(map_ + offset) != bytes || Get<uint32_t>(map_ + offset + 4) != n)
+      return false;
+    records += n;
+  }
+  return records == records_;
+}
+
+void TraceReader::Close() {
+  if (map_) munmap((void *)map_, map_size_);
+  if (in_) fclose(in_);
+  probe_.clear();
+  map_ = nullptr;
+  in_ = nullptr;
+  binary_ = false;
+  left_ = 0;
+}
+
+bool TraceReader::NextChunk() {
+  if (next_chunk_ >= chunks_) return false;
+  uint32_t bytes;
+  if (stream_) {
+    uint8_t header[kChunkHeaderBytes];
+    if (fread(header, 1, kChunkHeaderBytes, in_) != kChunkHeaderBytes) return false;
+    bytes = Get<uint32_t>(header);
+    left_ = Get<uint32_t>(header + 4);
+    buf_.resize(bytes);
+    if (fread(buf_.data(), 1, bytes, in_) != bytes) return false;
+    p_ = buf_.data();
+  } else {
+    // Give back pages of chunks already read, so long traces stream through
+    // a bounded amount of memory
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t done = pos_ & ~(page - 1);
+    if (done > released_) {
+      madvise((void *)(map_ + released_), done - released_, MADV_DONTNEED);
+      released_ = done;
+    }
+    if (pos_ + kChunkHeaderBytes > map_size_) return false;
+    bytes = Get<uint32_t>(map_ + pos_);
+    left_ = Get<uint32_t>(map_ + pos_ + 4);
+    p_ = map_ + pos_ + kChunkHeaderBytes;
+    pos_ += kChunkHeaderBytes + bytes;
+    if (pos_ > map_size_) return false;
+  }
+  end_ = p_ + bytes;
+  next_chunk_++;
+  last_addr_ = last_pc_ = 0;
+  return true;
+}
+
+int TraceReader::TextChar() {
+  if (probe_pos_ < probe_.size()) return (unsigned char)probe_[probe_pos_++];
+  return getc(in_);
+}
+
+// Skips whitespace, then reads up to max characters of the next token
+bool TraceReader::TextToken(std::string &tok, size_t max) {
+  int c;
+  tok.clear();
+  while ((c = TextChar()) != EOF && isspace(c)) {}
+  while (c != EOF && !isspace(c)) {
+    tok += (char)c;
+    if (tok.size() == max) break;
+    c = TextChar();
+  }
+  return !tok.empty();
+}
+
+bool TraceReader::Next(TraceRecord &r) {
+  if (!binary_) {
+    std::string op_s, addr_s;
+    if (!TextToken(op_s, 1) || !TextToken(addr_s)) return false;
+    r.addr = stoul(addr_s, 0, 0);
+    r.op = (op_s[0] == 'r') ? kTraceRead : kTraceWrite;
+    r.size = 0;
+    r.pc = 0;
+    return true;
+  }
+  while (left_ == 0)
+    if (!NextChunk()) return false;
+  if (p_ >= end_) return false;   // Truncated chunk
+  r.op = *p_++;
+  uint64_t size, addr, pc = 0;
+  if (!GetVarint(p_, end_, size) || !GetVarint(p_, end_, addr) ||
+      ((flags_ & kTraceHasPC) && !GetVarint(p_, end_, pc)))
+    return false;
+  r.size = size;
+  r.addr = last_addr_ += UnZigZag(addr);
+  r.pc = (flags_ & kTraceHasPC) ? (last_pc_ += UnZigZag(pc)) : 0;
+  left_--;
+  return true;
+}
+
+bool TraceReader::Seek(uint64_t n) {
+  if (!binary_ || stream_ || n > records_) return false;
+  const uint8_t *index = map_ + index_offset_;
+  uint64_t first = 0, i = 0;
+  for (; i < chunks_; i++) {
+    uint32_t records = Get<uint32_t>(index + i * kIndexEntryBytes + 12);
+    if (first + records > n) break;
+    first += records;
+  }
+  left_ = 0;
+  next_chunk_ = i;
+  if (i == chunks_) return true;    // At the end
+  pos_ = Get<uint64_t>(index + i * kIndexEntryBytes);
+  released_ = 0;
+  NextChunk();
+  TraceRecord r;
+  for (; first < n; first++) Next(r);
+  return true;
+}
@@ -0,0 +1,96 @@
+#ifndef CACHE_TRACEFILE_H_
+#define CACHE_TRACEFILE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "storage.h"
+
+// Binary trace format, version 1 (little endian):
+//   header   magic "RVTRACE\0", u32 version, u32 flags, u64 records,
+//            u64 chunks, u64 index offset
+//   chunks   u32 bytes, u32 records, then the records
+//   index    per chunk: u64 offset, u32 bytes, u32 records
+// A record is its op byte, the access size as a varint and the address
+// (plus the PC with kTraceHasPC) as zigzag varint deltas from the previous
+// record of the same chunk, so every chunk decodes on its own.
+
+enum TraceOp { kTraceRead = 0, kTraceWrite = 1, kTraceFetch = 2 };
+
+const uint32_t kTraceVersion = 1;
+const uint32_t kTraceHasPC = 1;             // Header flag
+const uint32_t kTraceChunkRecords = 1 << 16;
+
+typedef struct TraceRecord_ {
+  uint64_t addr;
+  uint64_t pc;      // 0 when the trace has no PCs
+  uint32_t size;    // 0 when unknown (text traces)
+  uint8_t op;
+} TraceRecord;
+
+class TraceWriter {
+ public:
+  TraceWriter() : out_(nullptr) {}
+  ~TraceWriter() { Close(); }
+  bool Open(const char *path, uint32_t flags);
+  void Write(const TraceRecord &r);
+  // Writes the last chunk, the index and the final header
+  void Close();
+  uint64_t Records() const { return records_; }
+  uint64_t Bytes() const { return bytes_; }
+
+ private:
+  void FlushChunk();
+  FILE *out_;
+  uint32_t flags_;
+  uint64_t records_, bytes_;
+  std::vector<uint8_t> chunk_;
+  uint32_t chunk_records_;
+  uint64_t last_addr_, last_pc_;
+  std::vector<uint8_t> index_;
+  uint64_t chunks_;
+  DISALLOW_COPY_AND_ASSIGN(TraceWriter);
+};
+
+// Reads binary traces (mmap, or chunk by chunk with stream) and both text
+// layouts ("r 0x122e80" and "r\t8740864")
+class TraceReader {
+ public:
+  TraceReader() {}
+  ~TraceReader() { Close(); }
+  // stream: read chunks with stdio instead of mapping the whole file
+  bool Open(const char *path, bool stream = false);
+  bool Next(TraceRecord &r);
+  // Positions the reader at record n, binary traces only
+  bool Seek(uint64_t n);
+  void Close();
+  bool IsBinary() const { return binary_; }
+  uint64_t Records() const { return records_; }   // 0 for text traces
+
+ private:
+  bool NextChunk();
+  bool CheckIndex() const;
+  int TextChar();
+  bool TextToken(std::string &tok, size_t max = SIZE_MAX);
+  bool binary_ = false, stream_ = false;
+  uint32_t flags_ = 0;
+  uint64_t records_ = 0, chunks_ = 0, index_offset_ = 0;
+  // mmap mode
+  const uint8_t *map_ = nullptr;
+  size_t map_size_ = 0, pos_ = 0, released_ = 0;
+  uint64_t next_chunk_ = 0;
+  // stream mode
+  FILE *in_ = nullptr;
+  std::vector<uint8_t> buf_;
+  // Current chunk
+  const uint8_t *p_ = nullptr, *end_ = nullptr;
+  uint32_t left_ = 0;
+  uint64_t last_addr_ = 0, last_pc_ = 0;
+  // Text traces read from in_, after the bytes the binary header probe took
+  std::string probe_;
+  size_t probe_pos_ = 0;
+};
+
+#endif //CACHE_TRACEFILE_H_
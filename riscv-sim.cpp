@@ -14,8 +14,31 @@ int main(int argc, const char** argv)
 #else
     argparse::ArgumentParser program("RISCV Simulator (pipeline)");
 #endif
-    program.add_argument().names({"-p", "--program"}).description("The ELF program to run.").required(true);
-    program.add_argument().names({"-c", "--config"}).description("Config file (JSON)").required(true);
+    program.add_argument().names({"-p", "--program"}).description("The ELF program to run. (Required without --manifest)");
+    program.add_argument().names({"-c", "--config"}).description("Config file (JSON) (Required without --manifest)");
+    program.add_argument().names({"-f", "--fast"}).description("Functional mode: no cache model or memory timing");
+    program.add_argument().names({"-t", "--trace"}).description("Write memory accesses to this file (cache-sim binary trace)");
+    program.add_argument().names({"-b", "--batch"}).description("Run the program to completion without the shell, exit with its exit code");
+    program.add_argument().names({"--max-insts"}).description("Batch mode: stop after this many instructions");
+    program.add_argument().names({"--max-cycles"}).description("Batch mode: stop after this many CPU cycles");
+    program.add_argument().names({"--json"}).description("Batch mode: print the summary as JSON");
+    program.add_argument().names({"--sample"}).description("Batch mode: sampled simulation, measure a detail window every this many instructions and fast-forward the rest, which empties the caches");
+    program.add_argument().names({"--warmup"}).description("Sampling/SimPoint: instructions simulated before each detail window or point, long enough to refill the caches (default 10000)");
+    program.add_argument().names({"--detail"}).description("Sampling: instructions measured per window (default 1000)");
+#ifndef PIPE
+    program.add_argument().names({"--bbv"}).description("Batch mode: write the basic block vectors of the program to this file");
+    program.add_argument().names({"--simpoint"}).description("Batch mode: pick simulation points from this BBV file and checkpoint them");
+    program.add_argument().names({"--clusters"}).description("SimPoint: maximum number of simulation points (default 10)");
+#endif
+    program.add_argument().names({"--interval"}).description("BBV/SimPoint: instructions per interval (default 100000)");
+    program.add_argument().names({"--simrun"}).description("Batch mode: simulate the points of this .simpoints file and weight the results");
+    program.add_argument().names({"-r", "--restore"}).description("Start runs from this checkpoint instead of the ELF entry point");
+    program.add_argument().names({"-s", "--save"}).description("Batch mode: save a checkpoint to this file where the run stops");
+    program.add_argument().names({"--savecaches"}).description("Include the cache state in the checkpoint of --save");
+    program.add_argument().names({"-q", "--quiet"}).description("Don't print the ELF loading messages and configuration");
+    program.add_argument().names({"--manifest"}).description("Run the jobs of this JSON manifest in worker processes, in place of -p/-c");
+    program.add_argument().names({"-j", "--jobs"}).description("Manifest: jobs run at once (default: one per CPU)");
+    program.add_argument().names({"--results"}).description("Manifest: append the results to this file (default <manifest>.results)");
     program.enable_help();
 
     auto err = program.parse(argc, argv);
@@ -30,10 +53,27 @@ int main(int argc, const char** argv)
         return 0;
     }
 
+    if (program.exists("manifest")) {
+        string manifest = program.get<string>("manifest");
+        int workers = program.exists("jobs") ? program.get<int>("jobs") : thread::hardware_concurrency();
+        string results = program.exists("results") ? program.get<string>("results") : manifest + ".results";
+        return run_manifest(manifest, workers, results);
+    }
+    for (const char *arg : {"p", "c"})
+        if (!program.exists(arg)) {
+            cout << "Required argument not found: -" << arg << endl;
+            program.print_help();
+            return -1;
+        }
+
     // Create elfio reader
     ELFIO::elfio reader;
     Config config;
     config.load(program.get<string>("c").c_str());
+    if (program.exists("fast")) config.fast_mode = true;
+    if (int err = check_config(config, cout)) return err;
+    bool quiet = program.exists("quiet");
+    ostream info(quiet ? nullptr : cout.rdbuf());
 
     // Load ELF data
     if (!reader.load(program.get<string>("p").c_str())) {
@@ -42,33 +82,39 @@ int main(int argc, const char** argv)
     }
 
     // Check ELF file properties
-    cout << "Checking file class : ";
-    if ( reader.get_class() == ELFCLASS32 ) {
-        cout << "ELF32" << endl;
-        cout << "Not a 64-bit ELF format file, abort!" << endl;
-        return -3;        
-    }
-    else
-        cout << "ELF64, OK!" << endl;
-
-    cout << "Checking ELF file encoding : ";
-    if ( reader.get_encoding() == ELFDATA2LSB )
-        cout << "Little endian, OK!" << endl;
-    else {
-        cout << "Big endian" << endl;
-        cout << "ELF is not little endian encoded, abort!" << endl;
-        return -4;
-    }
-
-    cout << "Checking ELF machine type : ";
-    if ( reader.get_machine() == EM_RISCV )
-        cout << "RISC-V, OK!" << endl;
-    else {
-        cout << "Not a RISC-V ELF file, abort!" << endl;
-        return -5;
-    }
+    if (int err = check_elf(reader, info, cout)) return err;
 
     RISCV_proc simulator(reader, config);
+    if (program.exists("trace")) simulator.set_trace_file(program.get<string>("trace"));
+    simulator.set_quiet(quiet);
+    if (program.exists("restore")) simulator.set_restore_file(program.get<string>("restore"));
+    if (program.exists("save")) simulator.set_save_file(program.get<string>("save"), program.exists("savecaches"));
+    if (program.exists("batch")) {
+        size_t max_insts = program.exists("max-insts") ? program.get<size_t>("max-insts") : 0;
+        size_t max_cycles = program.exists("max-cycles") ? program.get<size_t>("max-cycles") : 0;
+        size_t warmup = program.exists("warmup") ? program.get<size_t>("warmup") : 10000;
+#ifndef PIPE
+        size_t interval = program.exists("interval") ? program.get<size_t>("interval") : 100000;
+        if (program.exists("bbv"))
+            return simulator.run_bbv(program.get<string>("bbv"), interval);
+        if (program.exists("simpoint")) {
+            int clusters = program.exists("clusters") ? program.get<int>("clusters") : 10;
+            if (clusters < 1) {
+                cout << "--clusters must be at least 1" << endl;
+                return -1;
+            }
+            return simulator.run_simpoint(program.get<string>("simpoint"), interval, warmup, clusters);
+        }
+#endif
+        if (program.exists("simrun"))
+            return simulator.run_simpoints(program.get<string>("simrun"), program.exists("json"));
+        if (program.exists("sample")) {
+            size_t detail = program.exists("detail") ? program.get<size_t>("detail") : 1000;
+            return simulator.run_sampled(program.get<size_t>("sample"), warmup, detail, max_insts,
+                                         program.exists("json"));
+        }
+        return simulator.run_batch(max_insts, max_cycles, program.exists("json"));
+    }
     simulator.start();
     
     return 0;
@@ -0,0 +1,209 @@
+#include <riscv_proc.hpp>
+#include <math.h>
+using namespace std;
+
+// Branch direction predictors:
+//   always, never, btfnt, ftbnt    static, from the sign of the offset
+//   bimodal      2-bit counters indexed by PC
+//   gshare       2-bit counters indexed by PC xor global history
+//   tournament   bimodal and gshare, a per-PC chooser picks one
+//   tage         bimodal base with tagged tables of geometric history
+//                lengths, the longest matching one predicts (TAGE without
+//                the alternate-prediction and loop refinements)
+// The global history is updated when branches resolve, so the branches
+// still in flight are missing from the history a prediction uses. A branch
+// carries the history it was predicted with down the pipeline and trains
+// the entries that prediction read.
+
+#ifdef PIPE
+#define TAGE_U_RESET    (1 << 18)   // Branches between aging the useful counters
+
+static const char *kinds[] = {
+    "never", "always", "btfnt", "ftbnt", "bimodal", "gshare", "tournament", "tage"
+};
+
+// The low len bits of h XOR-folded into bits bits
+static uint64_t fold(uint64_t h, int len, int bits)
+{
+    if (len < 64) h &= (1ULL << len) - 1;
+    uint64_t f = 0;
+    for (; h; h >>= bits) f ^= h & ((1ULL << bits) - 1);
+    return f;
+}
+
+static void train(uint8_t &ctr, bool taken)
+{
+    if (taken && ctr < 3) ctr++;
+    else if (!taken && ctr > 0) ctr--;
+}
+
+bool BranchPredictor::init(const Config &config)
+{
+    kind = -1;
+    for (int i = 0; i < (int)(sizeof(kinds) / sizeof(kinds[0])); i++)
+        if (config.branch_prediction == kinds[i]) kind = i;
+    table_bits = min(max((int)config.predictor.table_bits, 1), 24);
+    history_bits = min(max((int)config.predictor.history_bits, 1), 64);
+    tage_bits = min(max((int)config.predictor.tage_table_bits, 1), 24);
+    tag_bits = min(max((int)config.predictor.tage_tag_bits, 2), 16);
+    history = 0;
+    updates = branches = mispredicts = 0;
+    bimodal.assign(1 << table_bits, 2);     // Weakly taken
+    gshare.clear();
+    chooser.clear();
+    tage.clear();
+    lengths.clear();
+    if (kind == BP_GSHARE || kind == BP_TOURNAMENT) gshare.assign(1 << table_bits, 2);
+    if (kind == BP_TOURNAMENT) chooser.assign(1 << table_bits, 1);  // Weakly bimodal
+    if (kind == BP_TAGE) {
+        int n = max((int)config.predictor.tage_tables, 1);
+        double lo = max((int)config.predictor.tage_min_history, 1);
+        double hi = min(max((double)config.predictor.tage_max_history, lo), 64.0);
+        for (int t = 0; t < n; t++)
+            lengths.push_back((int)(lo * pow(hi / lo, n > 1 ? (double)t / (n - 1) : 0) + 0.5));
+        tage.assign(n, vector<TageEntry>(1 << tage_bits));
+    }
+    if (kind >= 0) return true;
+    kind = BP_NEVER;
+    return false;
+}
+
+const char *BranchPredictor::name() const
+{
+    return kinds[kind];
+}
+
+size_t BranchPredictor::bimodal_index(REG pc) const
+{
+    return (pc >> 2) & ((1 << table_bits) - 1);
+}
+
+size_t BranchPredictor::gshare_index(REG pc, uint64_t hist) const
+{
+    return ((pc >> 2) ^ fold(hist, history_bits, table_bits)) & ((1 << table_bits) - 1);
+}
+
+size_t BranchPredictor::tage_index(REG pc, uint64_t hist, int t) const
+{
+    return ((pc >> 2) ^ (pc >> (2 + tage_bits)) ^ fold(hist, lengths[t], tage_bits)) &
+           ((1 << tage_bits) - 1);
+}
+
+// Never 0, the tag of empty entries
+uint16_t BranchPredictor::tage_tag(REG pc, uint64_t hist, int t) const
+{
+    uint16_t tag = ((pc >> 2) ^ fold(hist, lengths[t], tag_bits) ^ (fold(hist, lengths[t], tag_bits - 1) << 1)) &
+                   ((1 << tag_bits) - 1);
+    return tag ? tag : 1;
+}
+
+int BranchPredictor::tage_lookup(REG pc, uint64_t hist, int &alt) const
+{
+    int provider = alt = -1;
+    for (int t = tage.size() - 1; t >= 0; t--)
+        if (tage[t][tage_index(pc, hist, t)].tag == tage_tag(pc, hist, t)) {
+            if (provider < 0) provider = t;
+            else {
+                alt = t;
+                break;
+            }
+        }
+    return provider;
+}
+
+bool BranchPredictor::tage_predict(REG pc, uint64_t hist) const
+{
+    int alt, provider = tage_lookup(pc, hist, alt);
+    if (provider < 0) return bimodal[bimodal_index(pc)] >= 2;
+    return tage[provider][tage_index(pc, hist, provider)].ctr >= 0;
+}
+
+void BranchPredictor::tage_update(REG pc, uint64_t hist, bool taken)
+{
+    int alt, provider = tage_lookup(pc, hist, alt);
+    uint8_t &base = bimodal[bimodal_index(pc)];
+    bool alt_pred = alt >= 0 ? tage[alt][tage_index(pc, hist, alt)].ctr >= 0 : base >= 2;
+    bool pred = alt_pred;
+    if (provider >= 0) {
+        TageEntry &e = tage[provider][tage_index(pc, hist, provider)];
+        pred = e.ctr >= 0;
+        if (pred != alt_pred) {     // Useful when it beats the shorter history
+            if (pred == taken && e.u < 3) e.u++;
+            else if (pred != taken && e.u > 0) e.u--;
+        }
+        if (taken && e.ctr < 3) e.ctr++;
+        else if (!taken && e.ctr > -4) e.ctr--;
+    } else {
+        train(base, taken);
+    }
+    // A misprediction takes an entry in a table with a longer history
+    if (pred != taken && provider + 1 < (int)tage.size()) {
+        bool allocated = false;
+        for (int t = provider + 1; t < (int)tage.size() && !allocated; t++) {
+            TageEntry &e = tage[t][tage_index(pc, hist, t)];
+            if (e.u) continue;
+            e.tag = tage_tag(pc, hist, t);
+            e.ctr = taken ? 0 : -1;
+            allocated = true;
+        }
+        if (!allocated)
+            for (int t = provider + 1; t < (int)tage.size(); t++) {
+                TageEntry &e = tage[t][tage_index(pc, hist, t)];
+                if (e.u) e.u--;
+            }
+    }
+    if (++updates % TAGE_U_RESET == 0)
+        for (auto &table : tage)
+            for (auto &e : table) e.u >>= 1;
+}
+
+bool BranchPredictor::predict(REG pc, int imm) const
+{
+    switch (kind) {
+    case BP_ALWAYS:
+        return true;
+    case BP_BTFNT:
+        return imm < 0;
+    case BP_FTBNT:
+        return imm > 0;
+    case BP_BIMODAL:
+        return bimodal[bimodal_index(pc)] >= 2;
+    case BP_GSHARE:
+        return gshare[gshare_index(pc, history)] >= 2;
+    case BP_TOURNAMENT:
+        if (chooser[bimodal_index(pc)] >= 2) return gshare[gshare_index(pc, history)] >= 2;
+        return bimodal[bimodal_index(pc)] >= 2;
+    case BP_TAGE:
+        return tage_predict(pc, history);
+    }
+    return false;
+}
+
+void BranchPredictor::update(REG pc, uint64_t hist, bool taken, bool predicted)
+{
+    branches++;
+    if (taken != predicted) mispredicts++;
+    switch (kind) {
+    case BP_BIMODAL:
+        train(bimodal[bimodal_index(pc)], taken);
+        break;
+    case BP_GSHARE:
+        train(gshare[gshare_index(pc, hist)], taken);
+        break;
+    case BP_TOURNAMENT: {
+        uint8_t &local = bimodal[bimodal_index(pc)], &global = gshare[gshare_index(pc, hist)];
+        bool local_right = (local >= 2) == taken, global_right = (global >= 2) == taken;
+        if (local_right != global_right) train(chooser[bimodal_index(pc)], global_right);
+        train(local, taken);
+        train(global, taken);
+    }   break;
+    case BP_TAGE:
+        tage_update(pc, hist, taken);
+        break;
+    default:
+        return;     // Static, no history
+    }
+    history = (history << 1) | taken;
+}
+
+#endif
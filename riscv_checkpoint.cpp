@@ -0,0 +1,244 @@
+#include <riscv_proc.hpp>
+#include <fstream>
+#include <algorithm>
+#include <cereal/archives/binary.hpp>
+#include <cereal/types/string.hpp>
+#include <cereal/types/vector.hpp>
+#include <cereal/types/common.hpp>
+using namespace std;
+
+// Checkpoints: a cereal binary archive of
+//   header     magic, version, program hash, whether it holds pipeline
+//              registers (riscv-sim-pipe)
+//   registers  x0-x31, the next PC, heap, heap_base, instructions executed
+//   memory     every mapped page with its flags and physical address, in
+//              physical order so a restore maps pages back to the same place;
+//              all-zero pages are stored as a flag only
+//   pipeline   F/D/E/M/W registers and controls (riscv-sim-pipe only)
+//   caches     optional tags, dirty bits and replacement state of L1, L2 and L3
+// Pages are saved with the dirty lines of the caches merged in, so memory
+// alone is a consistent image and the data of the cached lines is refilled
+// from it. The program hash covers the entry point and loadable segments of
+// the ELF, a checkpoint of another program is refused. A riscv-sim checkpoint can be restored by
+// riscv-sim-pipe, which starts from an empty pipeline; the reverse would need
+// the in-flight instructions and is refused.
+
+static const string kCheckpointMagic = "RVCKPT";
+static const uint32_t kCheckpointVersion = 4;
+
+// FNV-1a over the entry point and the loadable segments
+static uint64_t program_hash(const ELFIO::elfio &reader)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    auto mix = [&h](const void *p, size_t bytes) {
+        for (size_t i = 0; i < bytes; i++) {
+            h ^= ((const unsigned char *)p)[i];
+            h *= 0x100000001b3ULL;
+        }
+    };
+    uint64_t entry = reader.get_entry();
+    mix(&entry, sizeof(entry));
+    for (auto &seg : reader.segments) {
+        if (seg->get_type() != PT_LOAD) continue;
+        uint64_t range[3] = { seg->get_virtual_address(), seg->get_file_size(), seg->get_memory_size() };
+        mix(range, sizeof(range));
+        if (seg->get_data()) mix(seg->get_data(), seg->get_file_size());
+    }
+    return h;
+}
+
+void CachedStorage::SaveCaches(vector<char> state[3]) const
+{
+    L1[0].SaveState(state[0]); L2[0].SaveState(state[1]); L3.SaveState(state[2]);
+}
+
+bool CachedStorage::LoadCaches(const vector<char> state[3])
+{
+    if (!L1[0].LoadState(state[0]) || !L2[0].LoadState(state[1]) || !L3.LoadState(state[2]))
+        return false;
+    // Memory holds the newest copy of every line
+    auto refill = [this](uint64_t addr, size_t bytes, char *data) {
+        char *page = memory.GetPage(addr);
+        if (page) memcpy(data, page + (addr - PAGE(addr)), bytes);
+    };
+    L1[0].RefillData(refill); L2[0].RefillData(refill); L3.RefillData(refill);
+    return true;
+}
+
+bool RISCV_proc::save_checkpoint(const string &path, bool caches)
+{
+    if (!harts.empty()) {
+        out << "Checkpoints hold a single hart, set harts to 1" << endl;
+        return false;
+    }
+    ofstream file(path, ios::binary);
+    if (!file) {
+        out << "Cannot open checkpoint file " << path << endl;
+        return false;
+    }
+#ifdef PIPE
+    bool pipe = true;
+    REG pc = reg_W.PC;
+#else
+    bool pipe = false;
+    REG pc = reg_F.PC;
+#endif
+    cereal::BinaryOutputArchive ar(file);
+    ar(kCheckpointMagic, kCheckpointVersion, program_hash(elf_reader), pipe);
+    ar(cereal::binary_data(reg_ulong, sizeof(reg_ulong)), pc, heap, heap_base, inst_count, flag_finished);
+
+    vector<pair<size_t, size_t> > pages;    // paddr, vpage
+    for (auto &p : pg_table)
+        if (PG_ALLOC(p.second)) pages.push_back(make_pair(p.second.paddr, p.first));
+    sort(pages.begin(), pages.end());
+    // Dirty lines by page, the order within a page (L3 first) is kept so
+    // the most recent copy is merged last
+    struct Line { size_t addr, bytes; const char *data; };
+    vector<Line> lines;
+    if (!storage.IsFast())
+        storage.ForEachDirty([&](uint64_t addr, size_t bytes, const char *data) {
+            lines.push_back(Line{addr, bytes, data});
+        });
+    stable_sort(lines.begin(), lines.end(),
+                [](const Line &a, const Line &b) { return PAGE(a.addr) < PAGE(b.addr); });
+
+    static const char zeros[PGSIZE] = {};
+    char buf[PGSIZE];
+    auto line = lines.begin();
+    ar((size_t)pages.size());
+    for (auto &p : pages) {
+        memcpy(buf, storage.HostPage(p.first), PGSIZE);
+        for (; line != lines.end() && PAGE(line->addr) <= p.first; ++line)
+            if (PAGE(line->addr) == p.first) memcpy(buf + (line->addr - p.first), line->data, line->bytes);
+        bool zero = memcmp(buf, zeros, PGSIZE) == 0;
+        ar(p.second, pg_table[p.second].flags, p.first, zero);
+        if (!zero) ar(cereal::binary_data(buf, PGSIZE));
+    }
+#ifdef PIPE
+    ar(cereal::binary_data(&reg_F, sizeof(reg_F)), cereal::binary_data(&reg_D, sizeof(reg_D)),
+       cereal::binary_data(&reg_E, sizeof(reg_E)), cereal::binary_data(&reg_M, sizeof(reg_M)),
+       cereal::binary_data(&reg_W, sizeof(reg_W)));
+    ar(ctrl_F, ctrl_D, ctrl_E, ctrl_M, ctrl_W, mispred);
+#endif
+    caches = caches && !storage.IsFast();
+    ar(caches);
+    if (caches) {
+        vector<char> state[3];
+        storage.SaveCaches(state);
+        ar(state[0], state[1], state[2]);
+    }
+    out << "Checkpoint saved to " << path << " (" << dec << pages.size() << " pages";
+    if (caches) out << ", caches";
+    out << ", " << file.tellp() << " bytes)" << endl;
+    return true;
+}
+
+bool RISCV_proc::restore_checkpoint(const string &path)
+{
+    if (!harts.empty()) {
+        out << "Checkpoints hold a single hart, set harts to 1" << endl;
+        return false;
+    }
+    ifstream file(path, ios::binary);
+    if (!file) {
+        out << "Cannot open checkpoint file " << path << endl;
+        return false;
+    }
+    try {
+        cereal::BinaryInputArchive ar(file);
+        string magic;
+        uint32_t version;
+        uint64_t program;
+        bool pipe;
+        ar(magic, version);
+        if (magic != kCheckpointMagic || version != kCheckpointVersion) {
+            out << path << " is not a checkpoint of this simulator version" << endl;
+            return false;
+        }
+        ar(program, pipe);
+        if (program != program_hash(elf_reader)) {
+            out << path << " was saved from a different program" << endl;
+            return false;
+        }
+#ifndef PIPE
+        if (pipe) {
+            out << path << " holds pipeline state, restore it with riscv-sim-pipe" << endl;
+            return false;
+        }
+#endif
+        REG pc;
+        size_t insts;
+        clear_regs();
+        ar(cereal::binary_data(reg_ulong, sizeof(reg_ulong)), pc, heap, heap_base, insts, flag_finished);
+
+        clear_pg_table();
+        reset_cache();
+        size_t npages;
+        ar(npages);
+        for (size_t i = 0; i < npages; i++) {
+            size_t vpage, paddr;
+            uint8_t flags;
+            bool zero;
+            ar(vpage, flags, paddr, zero);
+            alloc_page(vpage, flags);
+            if (pg_table[vpage].paddr != paddr) {       // Same physical layout
+                out << path << " does not match the memory layout of this program and config" << endl;
+                return false;
+            }
+            if (!zero) ar(cereal::binary_data(storage.HostPage(paddr), PGSIZE));
+        }
+        reg_F.PC = pc;
+#ifdef PIPE
+        if (pipe) {
+            ar(cereal::binary_data(&reg_F, sizeof(reg_F)), cereal::binary_data(&reg_D, sizeof(reg_D)),
+               cereal::binary_data(&reg_E, sizeof(reg_E)), cereal::binary_data(&reg_M, sizeof(reg_M)),
+               cereal::binary_data(&reg_W, sizeof(reg_W)));
+            ar(ctrl_F, ctrl_D, ctrl_E, ctrl_M, ctrl_W, mispred);
+        }
+#endif
+        bool caches;
+        ar(caches);
+        if (caches) {
+            vector<char> state[3];
+            ar(state[0], state[1], state[2]);
+            if (!storage.LoadCaches(state)) {
+                out << "Cache configuration differs from the checkpoint, caches start cold" << endl;
+                reset_cache();
+            }
+        }
+        pipe_cycle_count = inst_count = 0;
+        decode_hit = decode_miss = 0;
+        tlb_hit = tlb_miss = 0;
+#ifdef PIPE
+        if (!pipe) {    // Fill the empty pipeline, as at program start
+            set_pipe_control();
+            execute(1);
+        }
+#endif
+        info << "Restored checkpoint " << path << " at " << dec << insts << " instructions, next inst.: <0x"
+             << dec2hex(pc) << ">" << endl;
+    } catch (cereal::Exception &e) {
+        out << "Corrupt checkpoint " << path << ": " << e.what() << endl;
+        return false;
+    }
+    return true;
+}
+
+// "save [-c] <file>": -c also saves the cache state. "restore <file>"
+void RISCV_proc::checkpoint_command(const string &cmd)
+{
+    stringstream ss(cmd);
+    string op, arg, path;
+    bool caches = false;
+    ss >> op;
+    while (ss >> arg) {
+        if (arg == "-c") caches = true;
+        else path = arg;
+    }
+    if (path.empty() || (op != "save" && op != "restore") || (caches && op == "restore")) {
+        out << "Usage: save [-c] <file> | restore <file>" << endl;
+        return;
+    }
+    if (op == "save") save_checkpoint(path, caches);
+    else restore_checkpoint(path);
+}
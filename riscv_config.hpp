@@ -10,6 +10,25 @@
 extern std::string dec2hex(size_t i);
 #define CEREAL_HEX_NVP(T)   ::cereal::make_nvp(#T, "0x" + dec2hex(T))
 #define CEREAL_HEX_STR(T)   ::cereal::make_nvp(#T, T##_s)
+#define CEREAL_OPT_NVP(ar, T)   config_optional(ar, #T, T)
+
+// Keys added after the original config format: a config file without them
+// loads with the defaults below, which behave as before they existed
+template<class Archive, class T>
+inline void config_optional(Archive &ar, const char *name, T &value)
+{
+    ar(::cereal::make_nvp(name, value));
+}
+
+template<class T>
+inline void config_optional(cereal::JSONInputArchive &ar, const char *name, T &value)
+{
+    try {
+        ar(::cereal::make_nvp(name, value));
+    } catch (cereal::RapidJSONException &) {
+        throw;                          // Present with the wrong type
+    } catch (cereal::Exception &) {}    // Not found, the archive is unchanged
+}
 
 class Config {
 public:
@@ -18,8 +37,27 @@ public:
     size_t max_memory_addr;                     // Max reachable address for RV64 program
     size_t heap_base, heap_max;                 // Heap address and size (max address)
     std::string entry_symbol;                   // Not used when set_entry_symbol is false
+    bool fast_mode = false;                     // Functional memory, no cache model or memory cycles
+    size_t harts = 1;                           // Harts running the program, each with private L1/L2
+    size_t quantum = 1000;                      // Instructions a hart runs before the scheduler switches
 #ifdef PIPE
-    std::string branch_prediction;              // Options: always, never, btfnt, ftbnt
+    std::string branch_prediction;              // Options: always, never, btfnt, ftbnt,
+                                                // bimodal, gshare, tournament, tage
+    struct {
+        size_t table_bits = 12;                 // log2 counters of bimodal/gshare/chooser tables
+        size_t history_bits = 12;               // Global history of gshare and tournament
+        size_t tage_tables = 4, tage_table_bits = 10, tage_tag_bits = 9;
+        size_t tage_min_history = 4, tage_max_history = 64;    // Geometric series, 64 at most
+        template<class Archive>
+        void serialize(Archive & archive) {
+            CEREAL_OPT_NVP(archive, table_bits); CEREAL_OPT_NVP(archive, history_bits);
+            CEREAL_OPT_NVP(archive, tage_tables); CEREAL_OPT_NVP(archive, tage_table_bits);
+            CEREAL_OPT_NVP(archive, tage_tag_bits);
+            CEREAL_OPT_NVP(archive, tage_min_history); CEREAL_OPT_NVP(archive, tage_max_history);
+        }
+    } predictor;
+#else
+    std::string engine = "stage";               // Options: stage, threaded, jit
 #endif
     struct {
         size_t mul, mulw, div, divw, ecall;
@@ -41,19 +79,30 @@ public:
         struct {
             size_t size, associativity, block_size;
             bool writeback;
+            std::string replacement = "lru";    // Options: lru, plru, nru, srrip, brrip, dip, random
+            std::string prefetcher = "none";    // Options: none, next_line, stride, stream
+            int prefetch_degree = 1;            // Blocks prefetched per trigger
+            std::string bypass = "none";        // Options: none, pc_signature, streaming
+            int mshrs = 0;                      // Outstanding misses, 0 for a blocking cache
             template<class Archive>
             void serialize(Archive & archive) {
                 archive(
                     CEREAL_NVP(size), CEREAL_NVP(associativity), 
                     CEREAL_NVP(block_size), CEREAL_NVP(writeback)
                 ); 
+                CEREAL_OPT_NVP(archive, replacement);
+                CEREAL_OPT_NVP(archive, prefetcher); CEREAL_OPT_NVP(archive, prefetch_degree);
+                CEREAL_OPT_NVP(archive, bypass); CEREAL_OPT_NVP(archive, mshrs);
             }
         } l1, l2, l3;
+        bool tag_only = false;                  // No line data in caches, timing and stats only
+        std::string coherence = "none";         // Between the harts' caches: "none" or "mesi"
         template<class Archive>
         void serialize(Archive & archive) {
             archive(
                 CEREAL_NVP(l1), CEREAL_NVP(l2), CEREAL_NVP(l3)
             ); 
+            CEREAL_OPT_NVP(archive, tag_only); CEREAL_OPT_NVP(archive, coherence);
         }
     } cache;
 
@@ -64,12 +113,25 @@ public:
             CEREAL_NVP(set_entry_symbol), CEREAL_NVP(set_entry_addr), 
             CEREAL_HEX_NVP(entry_addr), CEREAL_HEX_NVP(max_memory_addr),
             CEREAL_HEX_NVP(heap_base), CEREAL_HEX_NVP(heap_max),
-            CEREAL_NVP(entry_symbol), 
+            CEREAL_NVP(entry_symbol),
 #ifdef PIPE
             CEREAL_NVP(branch_prediction),
 #endif
             CEREAL_NVP(latency), CEREAL_NVP(cache)
         ); 
+        optional_keys(archive);
+    }
+
+    template<class Archive>
+    void optional_keys(Archive & archive)
+    {
+        CEREAL_OPT_NVP(archive, fast_mode);
+        CEREAL_OPT_NVP(archive, harts); CEREAL_OPT_NVP(archive, quantum);
+#ifdef PIPE
+        CEREAL_OPT_NVP(archive, predictor);
+#else
+        CEREAL_OPT_NVP(archive, engine);
+#endif
     }
 
     void save(const char *filename)
@@ -80,9 +142,12 @@ public:
             CEREAL_NVP(set_entry_symbol), CEREAL_NVP(set_entry_addr), 
             CEREAL_HEX_NVP(entry_addr), CEREAL_HEX_NVP(max_memory_addr),
             CEREAL_HEX_NVP(heap_base), CEREAL_HEX_NVP(heap_max),
-            CEREAL_NVP(entry_symbol), 
+            CEREAL_NVP(entry_symbol), CEREAL_NVP(fast_mode),
+            CEREAL_NVP(harts), CEREAL_NVP(quantum),
 #ifdef PIPE
-            CEREAL_NVP(branch_prediction),
+            CEREAL_NVP(branch_prediction), CEREAL_NVP(predictor),
+#else
+            CEREAL_NVP(engine),
 #endif
             CEREAL_NVP(latency), CEREAL_NVP(cache)
         ); 
@@ -98,12 +163,13 @@ public:
             CEREAL_NVP(set_entry_symbol), CEREAL_NVP(set_entry_addr),
             CEREAL_HEX_STR(entry_addr), CEREAL_HEX_STR(max_memory_addr),
             CEREAL_HEX_STR(heap_base), CEREAL_HEX_STR(heap_max),
-            CEREAL_NVP(entry_symbol), 
+            CEREAL_NVP(entry_symbol),
 #ifdef PIPE
             CEREAL_NVP(branch_prediction),
 #endif
             CEREAL_NVP(latency), CEREAL_NVP(cache)
         );
+        optional_keys(ar);
         entry_addr = std::stol(entry_addr_s, 0, 0);
         max_memory_addr = std::stol(max_memory_addr_s, 0, 0);
         heap_base = std::stol(heap_base_s, 0, 0);
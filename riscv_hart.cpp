@@ -0,0 +1,322 @@
+#include <riscv_proc.hpp>
+#include <iomanip>
+#include <algorithm>
+using namespace std;
+
+// Multiple harts. All harts run the loaded program from its entry point in
+// the same address space; hart i starts with tp = i and its stack i *
+// HART_STACK below hart 0's, and can ask for its number with SYS_HART_ID.
+// Only one hart is in the processor registers at a time. execute() runs the
+// hart that is furthest behind in cycles for up to config.quantum
+// instructions, then picks again, so the order is deterministic and the
+// harts' clocks stay within about a quantum of each other. Ties go to the
+// lowest hart number, giving round-robin for harts that progress equally.
+// The program ends when every hart has exited; its exit code is hart 0's.
+
+static double miss_rate(const StorageStats &s)
+{
+    return s.access_counter ? 100 * (double)s.miss_num / s.access_counter : 0;
+}
+
+// Starts every hart at the entry point, in place of the single hart warm-up
+void RISCV_proc::start_harts()
+{
+    harts.clear();
+    hart = 0;
+    storage.SetHart(0);
+    if (config.harts <= 1) {
+#ifdef PIPE
+        // Warmup
+        set_pipe_control();
+        execute_hart(1);
+#endif
+        return;
+    }
+    harts.resize(config.harts);
+    REG sp = reg_ulong[R_SP];
+    for (size_t h = 0; h < harts.size(); h++) {
+        hart = h;
+        storage.SetHart(h);
+        clear_regs();
+        reg_F.PC = entry_addr;
+        reg_ulong[R_SP] = sp - h * HART_STACK;
+        reg_ulong[R_TP] = h;
+        alloc_page(reg_ulong[R_SP], PTE_W);
+        pipe_cycle_count = 0;
+#ifdef PIPE
+        memset(reg_ready, 0, sizeof(reg_ready));
+        load_stall_cycles = 0;
+        set_pipe_control();
+        execute_hart(1);
+#endif
+        save_hart();
+    }
+    load_hart(0);
+}
+
+void RISCV_proc::save_hart()
+{
+    HART_CONTEXT &c = harts[hart];
+    memcpy(c.regs, reg_ulong, sizeof(reg_ulong));
+    c.F = reg_F; c.D = reg_D; c.E = reg_E; c.M = reg_M; c.W = reg_W;
+#ifdef PIPE
+    c.ctrl_F = ctrl_F; c.ctrl_D = ctrl_D; c.ctrl_E = ctrl_E; c.ctrl_M = ctrl_M; c.ctrl_W = ctrl_W;
+    c.mispred = mispred;
+    memcpy(c.reg_ready, reg_ready, sizeof(reg_ready));
+    c.load_stall_cycles = load_stall_cycles;
+#endif
+    c.cycles = pipe_cycle_count;
+}
+
+void RISCV_proc::load_hart(size_t h)
+{
+    HART_CONTEXT &c = harts[h];
+    memcpy(reg_ulong, c.regs, sizeof(reg_ulong));
+    reg_F = c.F; reg_D = c.D; reg_E = c.E; reg_M = c.M; reg_W = c.W;
+#ifdef PIPE
+    ctrl_F = c.ctrl_F; ctrl_D = c.ctrl_D; ctrl_E = c.ctrl_E; ctrl_M = c.ctrl_M; ctrl_W = c.ctrl_W;
+    mispred = c.mispred;
+    memcpy(reg_ready, c.reg_ready, sizeof(reg_ready));
+    load_stall_cycles = c.load_stall_cycles;
+#endif
+    pipe_cycle_count = c.cycles;
+    flag_finished = c.finished;
+    hart = h;
+    storage.SetHart(h);
+}
+
+// The runnable hart with the fewest cycles, -1 when all have exited or wait
+int RISCV_proc::pick_hart()
+{
+    save_hart();
+    int next = -1;
+    for (size_t h = 0; h < harts.size(); h++)
+        if (!harts[h].finished && !harts[h].waiting && (next < 0 || harts[h].cycles < harts[next].cycles))
+            next = h;
+    return next;
+}
+
+// Lets the harts waiting at a barrier continue from the cycle the last one
+// arrived. Harts that have exited don't take part. False when none waits.
+bool RISCV_proc::release_barrier()
+{
+    size_t cycles = 0;
+    bool waiting = false;
+    for (auto &c : harts)
+        if (c.waiting) {
+            cycles = max(cycles, c.cycles);
+            waiting = true;
+        }
+    for (auto &c : harts)
+        if (c.waiting) {
+            c.barrier_cycles += cycles - c.cycles;
+            c.cycles = cycles;
+            c.waiting = false;
+        }
+    return waiting;
+}
+
+void RISCV_proc::execute(size_t steps)
+{
+    if (harts.empty()) {
+        execute_hart(steps);
+        return;
+    }
+    size_t end = inst_count + steps;
+    while (!steps || inst_count < end) {
+        int next = pick_hart();
+        if (next < 0 && release_barrier()) next = pick_hart();
+        if (next < 0) break;    // All harts exited
+        if (curbp) next = hart; // Stopped at a breakpoint, which only this hart may pass
+        load_hart(next);
+        size_t n = config.quantum;
+        if (steps) n = min(n, end - inst_count);
+        size_t start = inst_count;
+        execute_hart(n);
+        HART_CONTEXT &c = harts[hart];
+        c.insts += inst_count - start;
+        if (flag_barrier) {
+            flag_barrier = flag_finished = false;
+            c.waiting = true;
+        }
+        else if (flag_finished) c.finished = true;
+        // A breakpoint or an unexecutable PC stops this hart short, leave
+        // it in the registers for the caller
+        else if (inst_count - start < n) return;
+    }
+    // Leave a hart that can run in the registers, or hart 0 when all exited
+    if (harts[hart].finished || harts[hart].waiting) {
+        int next = pick_hart();
+        if (next < 0 && release_barrier()) next = pick_hart();
+        load_hart(next < 0 ? 0 : next);
+    }
+}
+
+// Elapsed time: the cycles of the hart that has run the longest
+size_t RISCV_proc::elapsed_cycles()
+{
+    if (harts.empty()) return pipe_cycle_count;
+    save_hart();
+    size_t cycles = 0;
+    for (auto &c : harts) cycles = max(cycles, c.cycles);
+    return cycles;
+}
+
+void RISCV_proc::hart_summary()
+{
+#ifdef PIPE
+    size_t cycles = elapsed_cycles();
+#else
+    save_hart();
+#endif
+    out << "Harts: " << dec << harts.size() << endl;
+    for (size_t h = 0; h < harts.size(); h++) {
+        const HART_CONTEXT &c = harts[h];
+        StorageStats s[2];
+        storage.GetHartStats(h, s);
+        out << "   Hart " << h << ": " << c.insts << " instructions";
+#ifdef PIPE
+        out << ", " << c.cycles << " cycles, CPI " << fixed << setprecision(3)
+             << (c.insts ? (double)c.cycles / c.insts : 0);
+#endif
+        out << ", L1 miss " << fixed << setprecision(2) << miss_rate(s[0])
+             << "%, L2 miss " << miss_rate(s[1]) << "%";
+        if (c.barrier_cycles) out << ", barrier wait " << c.barrier_cycles << " cycles";
+#ifdef PIPE
+        if (nonblocking) out << ", load-use stall " << c.load_stall_cycles << " cycles";
+#endif
+        if (c.finished) out << ", exit code " << (SREG)c.regs[R_A5];
+        out << endl;
+    }
+#ifdef PIPE
+    if (cycles)
+        out << "   Aggregate IPC: " << fixed << setprecision(3) << (double)inst_count / cycles << endl;
+#endif
+    out << endl;
+}
+
+void RISCV_proc::hart_summary_json()
+{
+    save_hart();
+    out << "  \"harts\": [" << endl;
+    for (size_t h = 0; h < harts.size(); h++) {
+        const HART_CONTEXT &c = harts[h];
+        StorageStats s[2];
+        storage.GetHartStats(h, s);
+        out << "    {\"instructions\": " << dec << c.insts << ", \"cycles\": " << c.cycles
+             << ", \"barrier_cycles\": " << c.barrier_cycles;
+#ifdef PIPE
+        if (nonblocking) out << ", \"load_stall_cycles\": " << c.load_stall_cycles;
+#endif
+        out << ", \"l1_miss_count\": " << s[0].miss_num << ", \"l1_access_count\": " << s[0].access_counter
+             << ", \"l2_miss_count\": " << s[1].miss_num << ", \"l2_access_count\": " << s[1].access_counter
+             << ", \"finished\": " << (c.finished ? "true" : "false");
+        if (c.finished) out << ", \"exit_code\": " << (SREG)c.regs[R_A5];
+        out << "}" << (h + 1 < harts.size() ? "," : "") << endl;
+    }
+    out << "  ]," << endl;
+}
+
+#define SHARING_TOP_BLOCKS  10      // Blocks listed in the false sharing report
+
+// Blocks that took coherence misses by virtual address, the most false
+// sharing first
+vector<pair<REG, CoherenceBlockStats> > RISCV_proc::sharing_blocks()
+{
+    vector<pair<REG, CoherenceBlockStats> > blocks;
+    const Directory *dir = storage.GetDirectory();
+    if (!dir) return blocks;
+    unordered_map<size_t, size_t> vpages;   // Physical page -> virtual
+    for (auto &p : pg_table)
+        if (PG_ALLOC(p.second)) vpages[p.second.paddr] = p.first;
+    dir->ForEachBlock([&](uint64_t block, const CoherenceBlockStats &s) {
+        auto it = vpages.find(PAGE(block));
+        if (s.coherence_miss_num && it != vpages.end())
+            blocks.push_back(make_pair(it->second + block - PAGE(block), s));
+    });
+    sort(blocks.begin(), blocks.end(), [](const pair<REG, CoherenceBlockStats> &a,
+                                          const pair<REG, CoherenceBlockStats> &b) {
+        if (a.second.false_sharing_num != b.second.false_sharing_num)
+            return a.second.false_sharing_num > b.second.false_sharing_num;
+        if (a.second.coherence_miss_num != b.second.coherence_miss_num)
+            return a.second.coherence_miss_num > b.second.coherence_miss_num;
+        return a.first < b.first;
+    });
+    return blocks;
+}
+
+// Symbols overlapping [addr, addr + size), comma separated. Symbols without
+// a size count from their address up to the next one; with none in the
+// block, the nearest one before it names the block as symbol+offset.
+string RISCV_proc::block_symbols(REG addr, size_t size)
+{
+    string names;
+    const ELF_SYMBOL *before = nullptr;
+    for (auto &sym : symtab) {
+        if (sym.name.empty() || sym.type == STT_FILE || sym.type == STT_SECTION || !sym.value)
+            continue;
+        bool inside = sym.value >= addr && sym.value < addr + size;
+        if (inside || (sym.value < addr && sym.value + sym.size > addr)) {
+            if (names.find(sym.name) == string::npos) names += (names.empty() ? "" : ",") + sym.name;
+        } else if (sym.value < addr && !sym.size && (!before || sym.value > before->value)) {
+            before = &sym;
+        }
+    }
+    if (!names.empty()) return names;
+    if (addr >= config.heap_base && addr < config.heap_max) return "[heap]";
+    if (addr >= config.heap_max) return "[stack]";
+    if (before) return before->name + "+0x" + dec2hex(addr - before->value);
+    return "?";
+}
+
+static void add_block_stats(CoherenceBlockStats &sum, const CoherenceBlockStats &s)
+{
+    sum.invalidation_num += s.invalidation_num;
+    sum.coherence_miss_num += s.coherence_miss_num;
+    sum.false_sharing_num += s.false_sharing_num;
+}
+
+void RISCV_proc::sharing_summary()
+{
+    vector<pair<REG, CoherenceBlockStats> > blocks = sharing_blocks();
+    if (blocks.empty()) return;
+    size_t block_size = storage.GetDirectory()->BlockSize();
+    map<string, CoherenceBlockStats> symbols;
+    out << "Coherence misses by block (" << dec << blocks.size() << " blocks";
+    if (blocks.size() > SHARING_TOP_BLOCKS) out << ", top " << SHARING_TOP_BLOCKS;
+    out << "):" << endl;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        string names = block_symbols(blocks[i].first, block_size);
+        const CoherenceBlockStats &s = blocks[i].second;
+        if (i < SHARING_TOP_BLOCKS)
+            out << "   0x" << dec2hex(blocks[i].first) << " <" << names << ">: " << dec
+                 << s.coherence_miss_num << " coherence misses, " << s.false_sharing_num
+                 << " false sharing, " << s.invalidation_num << " invalidations" << endl;
+        stringstream ss(names);
+        string name;
+        while (getline(ss, name, ','))
+            add_block_stats(symbols[name], s);
+    }
+    out << "Coherence misses by symbol:" << endl;
+    for (auto &sym : symbols)
+        out << "   " << sym.first << ": " << sym.second.coherence_miss_num << " coherence misses, "
+             << sym.second.false_sharing_num << " false sharing, " << sym.second.invalidation_num
+             << " invalidations" << endl;
+    out << endl;
+}
+
+void RISCV_proc::sharing_summary_json()
+{
+    vector<pair<REG, CoherenceBlockStats> > blocks = sharing_blocks();
+    size_t block_size = storage.GetDirectory() ? storage.GetDirectory()->BlockSize() : 0;
+    out << "  \"coherence_blocks\": [";
+    for (size_t i = 0; i < blocks.size(); i++) {
+        const CoherenceBlockStats &s = blocks[i].second;
+        out << (i ? "," : "") << endl << "    {\"addr\": " << dec << blocks[i].first
+             << ", \"symbols\": \"" << block_symbols(blocks[i].first, block_size)
+             << "\", \"coherence_miss_count\": " << s.coherence_miss_num
+             << ", \"false_sharing_count\": " << s.false_sharing_num
+             << ", \"invalidation_count\": " << s.invalidation_num << "}";
+    }
+    out << (blocks.empty() ? "" : "\n  ") << "]," << endl;
+}
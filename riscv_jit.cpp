@@ -0,0 +1,282 @@
+#include <riscv_proc.hpp>
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <vector>
+#include <stdint.h>
+#include <sys/mman.h>
+using namespace std;
+
+// Dynamic binary translation of hot blocks to x86-64.
+// A TB_BLOCK interpreted JIT_THRESHOLD times by the threaded engine is compiled
+// into the code cache. Compiled code keeps guest registers in reg_ulong
+// (addressed through rbx) and computes ALU ops, branches and jumps natively.
+// Loads, stores, multi-cycle ALU ops, ecall and the rare insts that need the
+// SEQ stages call back into the static jit_* helpers, so memory still goes
+// through read_memory/write_memory and syscalls through writeback().
+
+#ifndef PIPE
+
+void RISCV_proc::set_engine(const string& cmd)
+{
+    stringstream ss(cmd.substr(1, cmd.size()));
+    string name;
+    ss >> name;
+    if (name == "stage") engine = ENGINE_STAGE;
+    else if (name == "threaded") engine = ENGINE_THREADED;
+    else if (name == "jit") engine = ENGINE_JIT;
+    else if (!name.empty()) {
+        out << "Unknown engine: " << name << " (options: stage, threaded, jit)" << endl;
+        return;
+    }
+    const char *names[] = { "stage", "threaded", "jit" };
+    out << "Execution engine: " << names[engine] << endl;
+}
+
+void RISCV_proc::jit_load(RISCV_proc *proc, TB_OP *op)
+{
+    size_t addr = *op->rs1 + op->imm;
+    switch (op->kind) {
+    case TB_LB:  *op->rd = REG(SREG(proc->memread<char>(addr))); break;
+    case TB_LH:  *op->rd = REG(SREG(proc->memread<short>(addr))); break;
+    case TB_LW:  *op->rd = REG(SREG(proc->memread<int>(addr))); break;
+    case TB_LD:  *op->rd = REG(SREG(proc->memread<int64_t>(addr))); break;
+    case TB_LBU: *op->rd = REG(proc->memread<uint8_t>(addr)); break;
+    case TB_LHU: *op->rd = REG(proc->memread<uint16_t>(addr)); break;
+    case TB_LWU: *op->rd = REG(proc->memread<uint32_t>(addr)); break;
+    }
+}
+
+// Returns nonzero if the store hit translated code and the block must be left
+int RISCV_proc::jit_store(RISCV_proc *proc, TB_OP *op)
+{
+    size_t addr = *op->rs1 + op->imm;
+    switch (op->kind) {
+    case TB_SB: proc->memwrite(addr, char(*op->rs2 & 0xff)); break;
+    case TB_SH: proc->memwrite(addr, short(*op->rs2 & 0xffff)); break;
+    case TB_SW: proc->memwrite(addr, int(*op->rs2 & 0xffffffff)); break;
+    case TB_SD: proc->memwrite(addr, SREG(*op->rs2)); break;
+    }
+    return proc->tb_flush;
+}
+
+void RISCV_proc::jit_alu(RISCV_proc *proc, TB_OP *op)
+{
+    *op->rd = alu_calc(*op->rs1, *op->rs2, op->alu_func);
+    proc->pipe_cycle_count += proc->alu_stall(op->alu_func);
+}
+
+void RISCV_proc::jit_ecall(RISCV_proc *proc, TB_OP *)
+{
+    proc->tb_ecall();
+}
+
+REG RISCV_proc::jit_stage(RISCV_proc *proc, TB_OP *op)
+{
+    proc->tb_stage(op);
+    return proc->reg_F.PC;
+}
+
+#if defined(__x86_64__)
+// Minimal x86-64 encoder, temporaries are rax and rcx
+namespace {
+struct X86Code {
+    vector<uint8_t> buf;
+    const REG *regs;        // Guest register file, based at rbx
+
+    void emit(std::initializer_list<uint8_t> bytes) { buf.insert(buf.end(), bytes); }
+    void imm32(uint32_t x) { for (int i = 0; i < 4; i++) buf.push_back((x >> (8 * i)) & 0xff); }
+    void imm64(uint64_t x) { for (int i = 0; i < 8; i++) buf.push_back((x >> (8 * i)) & 0xff); }
+
+    // Register index of a guest operand, -1 if it is not in the register file
+    int reg_idx(const REG *r) { return (r >= regs && r < regs + 32) ? r - regs : -1; }
+
+    // mov rax|rcx, operand
+    void load(int x86reg, const REG *src) {
+        int idx = reg_idx(src);
+        if (idx < 0) { mov_imm(x86reg, *src); return; }
+        emit({ 0x48, 0x8b, uint8_t(0x83 | (x86reg << 3)) });
+        imm32(idx * sizeof(REG));
+    }
+    // mov operand, rax|rcx (writes to zero go to tb_sink and are dropped)
+    void store(int x86reg, const REG *dst) {
+        int idx = reg_idx(dst);
+        if (idx <= 0) return;
+        emit({ 0x48, 0x89, uint8_t(0x83 | (x86reg << 3)) });
+        imm32(idx * sizeof(REG));
+    }
+    void mov_imm(int x86reg, uint64_t x) { emit({ 0x48, uint8_t(0xb8 + x86reg) }); imm64(x); }
+
+    void prologue() {
+        emit({ 0x53, 0x55, 0x41, 0x54 });   // push rbx; push rbp; push r12
+        emit({ 0x48, 0x89, 0xfb });         // mov rbx, rdi
+        emit({ 0x48, 0x89, 0xf5 });         // mov rbp, rsi
+        emit({ 0x49, 0x89, 0xd4 });         // mov r12, rdx
+    }
+    // *done = n; return rax
+    void leave(size_t n) {
+        emit({ 0x49, 0xc7, 0x04, 0x24 }); imm32(n);
+        emit({ 0x41, 0x5c, 0x5d, 0x5b, 0xc3 });
+    }
+    // *done = n; return pc
+    void leave(size_t n, REG pc) { mov_imm(0, pc); leave(n); }
+    static const size_t LEAVE_PC_SIZE = 23;
+
+    // rax = helper(proc, op)
+    void call(const void *helper, const TB_OP *op) {
+        emit({ 0x48, 0x89, 0xef });         // mov rdi, rbp
+        emit({ 0x48, 0xbe }); imm64((uint64_t)op);
+        mov_imm(0, (uint64_t)helper);
+        emit({ 0xff, 0xd0 });               // call rax
+    }
+};
+}
+
+bool RISCV_proc::jit_compile(TB_BLOCK *tb)
+{
+    if (jit_cache == nullptr) {
+        void *p = mmap(nullptr, JIT_CACHE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            out << "JIT: cannot map code cache, staying in the interpreter." << endl;
+            engine = ENGINE_THREADED;
+            return false;
+        }
+        jit_cache = (char *)p;
+    }
+
+    X86Code c;
+    c.regs = reg_ulong;
+    c.prologue();
+    for (size_t i = 0; i < tb->ops.size(); i++) {
+        TB_OP *op = &tb->ops[i];
+        switch (op->kind) {
+        case TB_ADD: case TB_SUB: case TB_SLL: case TB_SLT: case TB_SLTU: case TB_XOR:
+        case TB_SRL: case TB_SRA: case TB_OR: case TB_AND: case TB_ADDW: case TB_SUBW:
+            c.load(0, op->rs1);
+            c.load(1, op->rs2);
+            switch (op->kind) {
+            case TB_ADD:  c.emit({ 0x48, 0x01, 0xc8 }); break;  // add rax, rcx
+            case TB_SUB:  c.emit({ 0x48, 0x29, 0xc8 }); break;  // sub rax, rcx
+            case TB_SLL:  c.emit({ 0x48, 0xd3, 0xe0 }); break;  // shl rax, cl
+            case TB_SRL:  c.emit({ 0x48, 0xd3, 0xe8 }); break;  // shr rax, cl
+            case TB_SRA:  c.emit({ 0x48, 0xd3, 0xf8 }); break;  // sar rax, cl
+            case TB_XOR:  c.emit({ 0x48, 0x31, 0xc8 }); break;  // xor rax, rcx
+            case TB_OR:   c.emit({ 0x48, 0x09, 0xc8 }); break;  // or rax, rcx
+            case TB_AND:  c.emit({ 0x48, 0x21, 0xc8 }); break;  // and rax, rcx
+            case TB_SLT:    // cmp rax, rcx; setl al; movzx rax, al
+                c.emit({ 0x48, 0x39, 0xc8, 0x0f, 0x9c, 0xc0, 0x48, 0x0f, 0xb6, 0xc0 }); break;
+            case TB_SLTU:   // cmp rax, rcx; setb al; movzx rax, al
+                c.emit({ 0x48, 0x39, 0xc8, 0x0f, 0x92, 0xc0, 0x48, 0x0f, 0xb6, 0xc0 }); break;
+            case TB_ADDW:   // add eax, ecx; movsxd rax, eax
+                c.emit({ 0x01, 0xc8, 0x48, 0x63, 0xc0 }); break;
+            case TB_SUBW:   // sub eax, ecx; movsxd rax, eax
+                c.emit({ 0x29, 0xc8, 0x48, 0x63, 0xc0 }); break;
+            }
+            c.store(0, op->rd);
+            break;
+        case TB_LI:
+            c.mov_imm(0, op->imm);
+            c.store(0, op->rd);
+            break;
+        case TB_ALU:
+            c.call((const void *)&RISCV_proc::jit_alu, op);
+            break;
+        case TB_LB: case TB_LH: case TB_LW: case TB_LD: case TB_LBU: case TB_LHU: case TB_LWU:
+            c.call((const void *)&RISCV_proc::jit_load, op);
+            break;
+        case TB_SB: case TB_SH: case TB_SW: case TB_SD:
+            c.call((const void *)&RISCV_proc::jit_store, op);
+            c.emit({ 0x85, 0xc0, 0x74, uint8_t(X86Code::LEAVE_PC_SIZE) });     // test eax, eax; jz
+            c.leave(i + 1, op->PC + sizeof(raw_inst_t));
+            break;
+        case TB_BEQ: case TB_BNE: case TB_BLT: case TB_BGE: case TB_BLTU: case TB_BGEU: {
+            // je, jne, jl, jge, jb, jae to the taken exit
+            static const uint8_t jcc[] = { 0x74, 0x75, 0x7c, 0x7d, 0x72, 0x73 };
+            c.load(0, op->rs1);
+            c.load(1, op->rs2);
+            c.emit({ 0x48, 0x39, 0xc8, jcc[op->kind - TB_BEQ], uint8_t(X86Code::LEAVE_PC_SIZE) });
+            c.leave(tb->len, op->PC + sizeof(raw_inst_t));
+            c.leave(tb->len, op->imm);
+        }   break;
+        case TB_JAL:
+            c.mov_imm(0, op->PC + sizeof(raw_inst_t));
+            c.store(0, op->rd);
+            c.leave(tb->len, op->imm);
+            break;
+        case TB_JALR:
+            c.load(0, op->rs1);
+            c.mov_imm(1, op->imm);
+            c.emit({ 0x48, 0x01, 0xc8 });       // add rax, rcx
+            c.mov_imm(1, op->PC + sizeof(raw_inst_t));
+            c.store(1, op->rd);
+            c.leave(tb->len);
+            break;
+        case TB_ECALL:
+            c.call((const void *)&RISCV_proc::jit_ecall, op);
+            c.leave(tb->len, op->PC + sizeof(raw_inst_t));
+            break;
+        case TB_STAGE:
+            c.call((const void *)&RISCV_proc::jit_stage, op);
+            break;
+        case TB_STAGE_JUMP:
+            c.call((const void *)&RISCV_proc::jit_stage, op);
+            c.leave(tb->len);
+            break;
+        case TB_EXIT:
+            c.leave(tb->len, op->PC);
+            break;
+        }
+    }
+
+    size_t size = ROUND_UP(c.buf.size(), 16);
+    if (size > JIT_CACHE_SIZE) return false;
+    if (jit_cache_used + size > JIT_CACHE_SIZE) {
+        // Full: drop every block with the code cache, tb stays interpreted
+        // until it is hot again
+        tb_flush = true;
+        return false;
+    }
+    memcpy(jit_cache + jit_cache_used, c.buf.data(), c.buf.size());
+    tb->native = jit_cache + jit_cache_used;
+    jit_cache_used += size;
+    jit_blocks++;
+    return true;
+}
+#else
+bool RISCV_proc::jit_compile(TB_BLOCK *tb)
+{
+    return false;   // No code generator for this host, blocks stay interpreted
+}
+#endif
+
+// Runs tb and its successors, compiled ones natively, for at most budget instructions
+size_t RISCV_proc::jit_run(TB_BLOCK *tb, size_t budget)
+{
+    size_t n = 0;
+    while (true) {
+        if (tb->native) {
+            size_t done;
+            reg_F.PC = ((JIT_FUNC)tb->native)(reg_ulong, this, &done);
+            n += done;
+            pipe_cycle_count += 5 * done;
+        }
+        else {
+            if (++tb->exec_count == JIT_THRESHOLD) jit_compile(tb);
+            n += tb_run(tb, budget - n, false);
+        }
+        if (flag_finished || tb_flush) return n;
+
+        // Fall-through successors go to next[1], everything else is cached in next[0]
+        int slot = (reg_F.PC == tb->end) ? 1 : 0;
+        TB_BLOCK *nb = tb->next[slot];
+        if (nb == nullptr || nb->PC != reg_F.PC) {
+            if ((nb = tb_lookup(reg_F.PC)) == nullptr) return n;
+            tb->next[slot] = nb;
+        }
+        if (n + nb->len > budget) return n;
+        tb = nb;
+    }
+}
+
+#endif
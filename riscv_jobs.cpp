@@ -0,0 +1,302 @@
+#include <riscv_proc.hpp>
+#include <fstream>
+#include <iomanip>
+#include <chrono>
+#include <cereal/external/rapidjson/document.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+using namespace std;
+
+// Job runner: riscv-sim --manifest jobs.json [-j N] [--results file]
+//
+//   {
+//     "timeout": 600,                              seconds per job, 0: none
+//     "max-insts": 0, "max-cycles": 0, "fast": false
+//     "jobs": [
+//       {"program": "test/add.riscv", "config": "config.json"},
+//       {"name": "qsort-jit", "program": "mytest/myqsort.riscv",
+//        "config": "jit.json", "input": "3\n", "timeout": 60}
+//     ],
+//     "programs": ["test/add.riscv", ...],         every program with
+//     "configs": ["config.json", ...]              every config, after jobs
+//   }
+//
+// The top-level timeout, max-insts, max-cycles and fast are defaults the jobs
+// can override. Each job runs in a worker process of its own, as a batch run
+// with a --json summary, and is killed when it outlives its timeout. Results
+// are appended to the results file as one JSON object per line in the order
+// the jobs finish:
+//
+//   {"job": 0, "name": ..., "program": ..., "config": ..., "seconds": 1.25,
+//    "status": "done", "output": <program output>, "messages": <simulator
+//    messages>, "summary": <the --json summary>}
+//
+// with status "error" (and "error": <why>) when the job could not start,
+// "timeout" or "crashed" instead of "done".
+
+struct Job {
+    string name, program, config, input;
+    size_t max_insts, max_cycles;
+    double timeout;
+    bool fast;
+};
+
+struct Worker {
+    pid_t pid;
+    int fd;                 // Read end of the pipe the job's result comes through
+    size_t job;
+    string result;
+    chrono::steady_clock::time_point start;
+};
+
+static string json_string(const string &s)
+{
+    stringstream ss;
+    ss << '"';
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') ss << '\\' << c;
+        else if (c == '\n') ss << "\\n";
+        else if (c == '\t') ss << "\\t";
+        else if (c < 0x20) ss << "\\u" << hex << setw(4) << setfill('0') << (int)c << dec;
+        else ss << c;
+    }
+    ss << '"';
+    return ss.str();
+}
+
+static string base_name(const string &path)
+{
+    size_t slash = path.find_last_of('/');
+    return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+// Fills in the fields of job present in v, false when v is not an object
+static bool read_job(const rapidjson::Value &v, Job &job)
+{
+    if (!v.IsObject()) return false;
+    if (v.HasMember("name") && v["name"].IsString()) job.name = v["name"].GetString();
+    if (v.HasMember("program") && v["program"].IsString()) job.program = v["program"].GetString();
+    if (v.HasMember("config") && v["config"].IsString()) job.config = v["config"].GetString();
+    if (v.HasMember("input") && v["input"].IsString()) job.input = v["input"].GetString();
+    if (v.HasMember("max-insts") && v["max-insts"].IsUint64()) job.max_insts = v["max-insts"].GetUint64();
+    if (v.HasMember("max-cycles") && v["max-cycles"].IsUint64()) job.max_cycles = v["max-cycles"].GetUint64();
+    if (v.HasMember("timeout") && v["timeout"].IsNumber()) job.timeout = v["timeout"].GetDouble();
+    if (v.HasMember("fast") && v["fast"].IsBool()) job.fast = v["fast"].GetBool();
+    return true;
+}
+
+static bool read_manifest(const string &path, vector<Job> &jobs)
+{
+    ifstream file(path);
+    stringstream text;
+    text << file.rdbuf();
+    rapidjson::Document doc;
+    if (!file || doc.Parse(text.str().c_str()).HasParseError() || !doc.IsObject()) {
+        cout << "Cannot read manifest " << path << endl;
+        return false;
+    }
+    Job defaults = { "", "", "", "", 0, 0, 0, false };
+    read_job(doc, defaults);
+    defaults.name = defaults.program = defaults.config = "";
+    if (doc.HasMember("jobs") && doc["jobs"].IsArray())
+        for (auto &v : doc["jobs"].GetArray()) {
+            Job job = defaults;
+            if (!read_job(v, job)) continue;
+            jobs.push_back(job);
+        }
+    if (doc.HasMember("programs") && doc["programs"].IsArray() &&
+        doc.HasMember("configs") && doc["configs"].IsArray())
+        for (auto &p : doc["programs"].GetArray())
+            for (auto &c : doc["configs"].GetArray()) {
+                if (!p.IsString() || !c.IsString()) continue;
+                Job job = defaults;
+                job.program = p.GetString();
+                job.config = c.GetString();
+                jobs.push_back(job);
+            }
+    for (size_t i = 0; i < jobs.size(); i++) {
+        if (jobs[i].program.empty() || jobs[i].config.empty()) {
+            cout << "Manifest job " << i << " needs a program and a config" << endl;
+            return false;
+        }
+        if (jobs[i].name.empty()) jobs[i].name = base_name(jobs[i].program) + ":" + base_name(jobs[i].config);
+    }
+    return true;
+}
+
+// The members of the job's result line after its status, run in the worker.
+// The simulator is given its own streams, so it prints nothing here.
+static string run_job(const Job &job)
+{
+    ostringstream report, console;
+    istringstream input(job.input);
+    Config config;
+    if (!ifstream(job.config))
+        return "\"error\", \"error\": " + json_string("cannot open config " + job.config);
+    try {
+        config.load(job.config.c_str());
+    } catch (exception &e) {
+        return "\"error\", \"error\": " + json_string("cannot load config " + job.config + ": " + e.what());
+    }
+    if (job.fast) config.fast_mode = true;
+    ELFIO::elfio reader;
+    ostream quiet(nullptr);
+    if (check_config(config, report) || !reader.load(job.program) || check_elf(reader, quiet, report)) {
+        string why = report.str();
+        if (why.empty()) why = "cannot load ELF file " + job.program;
+        else why.pop_back();
+        return "\"error\", \"error\": " + json_string(why);
+    }
+    {
+        RISCV_proc simulator(reader, config, input, report);
+        simulator.set_quiet(true);
+        simulator.set_console(console.rdbuf());
+        simulator.run_batch(job.max_insts, job.max_cycles, true);
+    }
+    // The summary starts with a "{" line, messages come before it
+    string text = report.str(), messages, summary;
+    size_t at = text.rfind("\n{\n");
+    if (at != string::npos) at++;
+    else if (text.compare(0, 2, "{\n") == 0) at = 0;
+    if (at != string::npos) {
+        messages = text.substr(0, at);
+        for (size_t i = at; i < text.size(); i++) {
+            if (text[i] == '\n') {
+                while (i + 1 < text.size() && text[i + 1] == ' ') i++;
+            } else {
+                summary += text[i];
+            }
+        }
+    } else {
+        messages = text;
+        summary = "null";
+    }
+    return "\"done\", \"output\": " + json_string(console.str()) + ", \"messages\": " +
+           json_string(messages) + ", \"summary\": " + summary;
+}
+
+static bool start_worker(const vector<Job> &jobs, size_t j, Worker &w)
+{
+    int fds[2];
+    if (pipe(fds) < 0) return false;
+    cout.flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        string result = run_job(jobs[j]);
+        for (size_t done = 0; done < result.size(); ) {
+            ssize_t n = write(fds[1], result.data() + done, result.size() - done);
+            if (n <= 0) break;
+            done += n;
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    w.pid = pid;
+    w.fd = fds[0];
+    w.job = j;
+    w.result.clear();
+    w.start = chrono::steady_clock::now();
+    return true;
+}
+
+int run_manifest(const string &path, int workers, const string &results)
+{
+    vector<Job> jobs;
+    if (!read_manifest(path, jobs)) return -1;
+    ofstream out(results, ios::app);
+    if (!out) {
+        cout << "Cannot open results file " << results << endl;
+        return -1;
+    }
+    if (workers < 1) workers = 1;
+    cout << "Running " << jobs.size() << " jobs in up to " << workers << " workers, results in "
+         << results << endl;
+
+    map<string, size_t> counts;
+    vector<Worker> running;
+    size_t next = 0, finished = 0;
+    // Writes the result line of a worker that has stopped
+    auto report = [&](Worker &w, const string &status) {
+        const Job &job = jobs[w.job];
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - w.start).count();
+        string s = status.empty() ? w.result : "\"" + status + "\"";
+        out << "{\"job\": " << w.job << ", \"name\": " << json_string(job.name)
+            << ", \"program\": " << json_string(job.program) << ", \"config\": " << json_string(job.config)
+            << ", \"seconds\": " << fixed << setprecision(3) << seconds << ", \"status\": " << s << "}" << endl;
+        string shown = status.empty() ? w.result.substr(1, w.result.find('"', 1) - 1) : status;
+        counts[shown]++;
+        cout << "[" << ++finished << "/" << jobs.size() << "] " << job.name << ": " << shown
+             << " (" << fixed << setprecision(2) << seconds << " s)" << endl;
+    };
+
+    while (next < jobs.size() || !running.empty()) {
+        while (next < jobs.size() && (int)running.size() < workers) {
+            Worker w;
+            if (!start_worker(jobs, next, w)) {
+                if (running.empty()) {
+                    cout << "Cannot start a worker process" << endl;
+                    return -1;
+                }
+                break;
+            }
+            running.push_back(w);
+            next++;
+        }
+        // Wait for output or the closest timeout
+        auto now = chrono::steady_clock::now();
+        int wait = 1000;
+        vector<pollfd> fds;
+        for (auto &w : running) {
+            fds.push_back({w.fd, POLLIN, 0});
+            double timeout = jobs[w.job].timeout;
+            if (timeout > 0) {
+                double left = timeout - chrono::duration<double>(now - w.start).count();
+                wait = min(wait, max(0, (int)(left * 1000) + 1));
+            }
+        }
+        poll(fds.data(), fds.size(), wait);
+
+        now = chrono::steady_clock::now();
+        for (size_t i = 0; i < running.size(); ) {
+            Worker &w = running[i];
+            bool stopped = false;
+            if (fds[i].revents) {
+                char buf[4096];
+                ssize_t n = read(w.fd, buf, sizeof(buf));
+                if (n > 0) w.result.append(buf, n);
+                else stopped = true;    // Result complete
+            }
+            double timeout = jobs[w.job].timeout;
+            if (stopped) {
+                int status = 0;
+                waitpid(w.pid, &status, 0);
+                report(w, WIFSIGNALED(status) || w.result.empty() ? "crashed" : "");
+            } else if (timeout > 0 && chrono::duration<double>(now - w.start).count() >= timeout) {
+                kill(w.pid, SIGKILL);
+                waitpid(w.pid, nullptr, 0);
+                report(w, "timeout");
+                stopped = true;
+            }
+            if (stopped) {
+                close(w.fd);
+                running.erase(running.begin() + i);
+                fds.erase(fds.begin() + i);
+            } else {
+                i++;
+            }
+        }
+    }
+
+    cout << "Jobs: " << jobs.size();
+    for (auto &c : counts) cout << ", " << c.second << " " << c.first;
+    cout << endl;
+    return counts["done"] == jobs.size() ? 0 : 1;
+}
@@ -5,11 +5,32 @@
 #include <sstream>
 #include <string>
 #include <assert.h>
+#include <sys/mman.h>
 #define GET_CACHE_CFG(config, name) CacheConfig(config.cache.name.size, \
                                                 config.cache.name.associativity, \
                                                 config.cache.name.size / \
                                                 (config.cache.name.block_size * config.cache.name.associativity), \
                                                 config.cache.name.writeback)
+// Unknown policy names are reported on os and fall back to the default
+#define SET_CACHE_POLICIES(cc, config, name, os) do { \
+    cc.prefetcher = ParsePrefetcher(config.cache.name.prefetcher); \
+    if (cc.prefetcher < 0) { \
+        os << "Unknown " #name " prefetcher " << config.cache.name.prefetcher << ", using none" << endl; \
+        cc.prefetcher = kPrefetchNone; \
+    } \
+    cc.prefetch_degree = config.cache.name.prefetch_degree; \
+    cc.bypass = ParseBypass(config.cache.name.bypass); \
+    if (cc.bypass < 0) { \
+        os << "Unknown " #name " bypass policy " << config.cache.name.bypass << ", using none" << endl; \
+        cc.bypass = kBypassNone; \
+    } \
+    cc.replacement = ParseReplacement(config.cache.name.replacement); \
+    if (cc.replacement < 0) { \
+        os << "Unknown " #name " replacement policy " << config.cache.name.replacement << ", using lru" << endl; \
+        cc.replacement = kReplLRU; \
+    } \
+    cc.mshrs = config.cache.name.mshrs; \
+} while (0)
 #define GET_CACHE_LATENCY(config, name) StorageLatency(config.latency.name##_hit, config.latency.name##_bus)
 using namespace std;
 
@@ -176,6 +197,7 @@ ostream & operator << (ostream &os, const RISCV_inst &inst)
     default:
         os << "unimp";
     }
+    return os;
 }
 
 ELF_SYMBOL::ELF_SYMBOL(uint8_t bind, uint8_t type, uint8_t other,
@@ -186,38 +208,108 @@ ELF_SYMBOL::ELF_SYMBOL(uint8_t bind, uint8_t type, uint8_t other,
 
 void CachedStorage::ClearStats()
 {
-    StorageStats stats;
-    stats.access_time = 0;
-    L1.SetStats(stats);
-    L2.SetStats(stats);
+    StorageStats stats = {};
+    for (int i = 0; i < MAX_HARTS; i++) {
+        L1[i].SetStats(stats);
+        L2[i].SetStats(stats);
+    }
     L3.SetStats(stats);
     memory.SetStats(stats);
+    directory.ClearStats();
+    fast_accesses = 0;
+}
+
+static void AddStats(StorageStats &sum, const StorageStats &s)
+{
+    sum.access_counter += s.access_counter;
+    sum.miss_num += s.miss_num;
+    sum.access_time += s.access_time;
+    sum.replace_num += s.replace_num;
+    sum.fetch_num += s.fetch_num;
+    sum.prefetch_num += s.prefetch_num;
+    sum.prefetch_useful += s.prefetch_useful;
+    sum.prefetch_late += s.prefetch_late;
+    sum.bypass_num += s.bypass_num;
+    sum.shadow_miss_num += s.shadow_miss_num;
+    sum.mshr_merge_num += s.mshr_merge_num;
+    sum.mshr_stall_time += s.mshr_stall_time;
+}
+
+void CachedStorage::GetStats(StorageStats stats[3])
+{
+    L1[0].GetStats(stats[0]); L2[0].GetStats(stats[1]); L3.GetStats(stats[2]);
+    for (int i = 1; i < harts; i++) {
+        StorageStats s[2];
+        GetHartStats(i, s);
+        AddStats(stats[0], s[0]);
+        AddStats(stats[1], s[1]);
+    }
+}
+
+void CachedStorage::GetHartStats(int h, StorageStats stats[2])
+{
+    L1[h].GetStats(stats[0]); L2[h].GetStats(stats[1]);
+}
+
+// Takes effect with the following SetConfig
+void CachedStorage::SetTagOnly(bool tag_only)
+{
+    this->tag_only = tag_only;
+    for (int i = 0; i < MAX_HARTS; i++) {
+        L1[i].SetTagOnly(tag_only); L2[i].SetTagOnly(tag_only);
+    }
+    L3.SetTagOnly(tag_only);
+    memory.SetTimingOnly(tag_only);
 }
 
 void CachedStorage::SetConfig(CacheConfig cc1, CacheConfig cc2, CacheConfig cc3)
 {
-    L1.SetConfig(cc1); L2.SetConfig(cc2); L3.SetConfig(cc3);
+    for (int i = 0; i < harts; i++) {
+        L1[i].SetConfig(cc1); L2[i].SetConfig(cc2);
+    }
+    L3.SetConfig(cc3);
+    if (coherent && harts > 1) {
+        Cache *first[MAX_HARTS], *last[MAX_HARTS];
+        for (int i = 0; i < harts; i++) {
+            first[i] = &L1[i];
+            last[i] = &L2[i];
+        }
+        directory.SetConfig(harts, first, last, cc2.size / (cc2.associativity * cc2.set_num));
+    }
 }
 
 void CachedStorage::SetLatency(StorageLatency ltc1, StorageLatency ltc2, StorageLatency ltc3, StorageLatency ltcm)
 {
-    L1.SetLatency(ltc1); L2.SetLatency(ltc2); L3.SetLatency(ltc3); memory.SetLatency(ltcm);
+    for (int i = 0; i < MAX_HARTS; i++) {
+        L1[i].SetLatency(ltc1); L2[i].SetLatency(ltc2);
+    }
+    L3.SetLatency(ltc3); memory.SetLatency(ltcm);
+    // Directory lookups at the L3, remote copies in another hart's L2
+    directory.SetLatency(ltc3, ltc2);
 }
 
 void CachedStorage::HandleRequest(size_t addr, int bytes, int read, char *content, int &time)
 {
+    if (fast) {
+        memory.Access(addr, bytes, read, content);
+        fast_accesses++;
+        time = 0;
+        return;
+    }
     CacheConfig cc;
-    L1.GetConfig(cc);
+    L1[hart].GetConfig(cc);
     size_t block_size = cc.size / (cc.associativity * cc.set_num);
     size_t start = addr, end = addr + bytes;
     time = 0;
+    if (tag_only) memory.Access(addr, bytes, read, content);    // Caches only add timing
+    if (coherent && harts > 1) time += directory.Access(hart, addr, bytes, read);
     while (addr < end) {
         size_t block_bytes = min(ROUND_DOWN(addr, block_size) + block_size - addr, end - addr);
         int _hit, _time;
-        if (content) 
-            L1.HandleRequest(addr, block_bytes, read, content + addr - start, _hit, _time);
+        if (content && !tag_only) 
+            L1[hart].HandleRequest(addr, block_bytes, read, content + addr - start, _hit, _time);
         else
-            L1.HandleRequest(addr, block_bytes, read, nullptr, _hit, _time);
+            L1[hart].HandleRequest(addr, block_bytes, read, nullptr, _hit, _time);
         time += _time;
         addr += block_bytes;
     }
@@ -225,40 +317,125 @@ void CachedStorage::HandleRequest(size_t addr, int bytes, int read, char *conten
 
 void CachedStorage::flush()
 {
-    L1.flush(); L2.flush(); L3.flush();
+    for (int i = 0; i < harts; i++) {
+        L1[i].flush(); L2[i].flush();
+    }
+    L3.flush();
+}
+
+// Entering fast mode writes dirty lines back and empties the caches, so memory
+// holds the only copy of the data and timed mode later restarts from cold caches
+void CachedStorage::SetFast(bool fast)
+{
+    if (fast && !this->fast) {
+        flush();
+        for (int i = 0; i < harts; i++) {
+            L1[i].invalidate(); L2[i].invalidate();
+        }
+        L3.invalidate();
+        directory.Reset();
+    }
+    this->fast = fast;
 }
 
-void CachedStorage::StatsInfo(const StorageStats &s, bool ismem=true)
+void CachedStorage::StatsInfo(ostream &out, const StorageStats &s, bool ismem, const Cache *cache)
 {
-    cout << "   Access time (CPU cycles): " << dec << s.access_time << endl;
-    // cout << "L1 Cache access time (Nanoseconds): " << fixed << setprecision(2) 
+    out << "   Access time (CPU cycles): " << dec << s.access_time << endl;
+    // out << "L1 Cache access time (Nanoseconds): " << fixed << setprecision(2) 
     //      << (double)s.access_time / cpu_freq_GHz << endl;
-    cout << "   Access count: " << s.access_counter << endl;
+    out << "   Access count: " << s.access_counter << endl;
     if (ismem) {
-        cout << "   Miss count: " << s.miss_num << endl;
-        cout << "    - Miss rate: " << fixed << setprecision(2) 
-             << 100 * (double)s.miss_num / s.access_counter << "%" << endl;
-        cout << "   Replace count: " << s.replace_num << endl; 
-        cout << "   Fetch count: " << s.fetch_num << endl;
-    }
-    cout << endl;
-}
-
-void CachedStorage::PrintStats()
-{
-    StorageStats stats;
-    L1.GetStats(stats);
-    cout << "L1 Cache:" << endl;
-    StatsInfo(stats);
-    L2.GetStats(stats);
-    cout << "L2 Cache:" << endl;
-    StatsInfo(stats);
-    L3.GetStats(stats);
-    cout << "L3 Cache:" << endl;
-    StatsInfo(stats);
+        out << "   Miss count: " << s.miss_num << endl;
+        out << "    - Miss rate: " << fixed << setprecision(2) 
+             << (s.access_counter ? 100 * (double)s.miss_num / s.access_counter : 0) << "%" << endl;
+        out << "   Replace count: " << s.replace_num << endl; 
+        out << "   Fetch count: " << s.fetch_num << endl;
+    }
+    if (cache && cache->HasPrefetcher()) {
+        // Coverage: share of the would-be misses a useful prefetch removed
+        out << "   Prefetches issued: " << s.prefetch_num << endl;
+        out << "    - Accuracy: " << fixed << setprecision(2)
+             << (s.prefetch_num ? 100 * (double)s.prefetch_useful / s.prefetch_num : 0) << "%" << endl;
+        out << "    - Coverage: " << fixed << setprecision(2)
+             << (s.prefetch_useful + s.miss_num ? 100 * (double)s.prefetch_useful / (s.prefetch_useful + s.miss_num) : 0) << "%" << endl;
+        out << "    - Late: " << s.prefetch_late << endl;
+    }
+    if (cache && cache->HasBypass()) {
+        out << "   Bypass count: " << s.bypass_num << endl;
+        out << "    - Miss rate without bypass: " << fixed << setprecision(2)
+             << (s.access_counter ? 100 * (double)s.shadow_miss_num / s.access_counter : 0) << "%" << endl;
+    }
+    if (cache && cache->HasMSHRs()) {
+        out << "   MSHR merges: " << s.mshr_merge_num << endl;
+        out << "   MSHR full stall cycles: " << s.mshr_stall_time << endl;
+    }
+    out << endl;
+}
+
+void CachedStorage::PrintStats(ostream &out)
+{
+    StorageStats stats, levels[3];
+    GetStats(levels);
+    out << (harts > 1 ? "L1 Cache (all harts):" : "L1 Cache:") << endl;
+    StatsInfo(out, levels[0], true, &L1[0]);
+    out << (harts > 1 ? "L2 Cache (all harts):" : "L2 Cache:") << endl;
+    StatsInfo(out, levels[1], true, &L2[0]);
+    out << "L3 Cache:" << endl;
+    StatsInfo(out, levels[2], true, &L3);
     memory.GetStats(stats);
-    cout << "memory:" << endl;
-    StatsInfo(stats, false);
+    out << "memory:" << endl;
+    StatsInfo(out, stats, false);
+    if (GetDirectory()) {
+        CoherenceStats cs;
+        directory.GetStats(cs);
+        out << "Coherence (MESI directory):" << endl;
+        out << "   Invalidations: " << dec << cs.invalidation_num << endl;
+        out << "   Upgrades: " << cs.upgrade_num << endl;
+        out << "   Downgrades: " << cs.downgrade_num << endl;
+        out << "   Coherence misses: " << cs.coherence_miss_num << " (false sharing: "
+             << cs.false_sharing_num << ")" << endl;
+        out << "   Coherence time (CPU cycles): " << cs.coherence_time << endl << endl;
+    }
+    if (fast_accesses)
+        out << "Fast mode (not modeled) accesses: " << dec << fast_accesses << endl << endl;
+}
+
+static void StatsJSON(ostream &out, const char *name, const StorageStats &s, bool ismem)
+{
+    out << "    \"" << name << "\": {\"access_count\": " << s.access_counter
+        << ", \"access_time\": " << s.access_time;
+    if (ismem)
+        out << ", \"miss_count\": " << s.miss_num << ", \"replace_count\": " << s.replace_num
+            << ", \"fetch_count\": " << s.fetch_num << ", \"prefetch_count\": " << s.prefetch_num
+            << ", \"bypass_count\": " << s.bypass_num;
+    out << "}";
+}
+
+void CachedStorage::PrintStatsJSON(ostream &out)
+{
+    StorageStats stats, levels[3];
+    GetStats(levels);
+    out << "  \"storage\": {" << endl;
+    StatsJSON(out, "l1", levels[0], true);
+    out << "," << endl;
+    StatsJSON(out, "l2", levels[1], true);
+    out << "," << endl;
+    StatsJSON(out, "l3", levels[2], true);
+    out << "," << endl;
+    memory.GetStats(stats);
+    StatsJSON(out, "memory", stats, false);
+    out << "," << endl;
+    if (GetDirectory()) {
+        CoherenceStats cs;
+        directory.GetStats(cs);
+        out << "    \"coherence\": {\"invalidation_count\": " << cs.invalidation_num
+            << ", \"upgrade_count\": " << cs.upgrade_num << ", \"downgrade_count\": " << cs.downgrade_num
+            << ", \"coherence_miss_count\": " << cs.coherence_miss_num
+            << ", \"false_sharing_count\": " << cs.false_sharing_num
+            << ", \"coherence_time\": " << cs.coherence_time << "}," << endl;
+    }
+    out << "    \"fast_access_count\": " << fast_accesses << endl;
+    out << "  }";
 }
 
 bool RISCV_proc::get_symbol(const string &symbol, ELF_SYMBOL** psym) 
@@ -272,24 +449,63 @@ bool RISCV_proc::get_symbol(const string &symbol, ELF_SYMBOL** psym)
     return false;
 }
 
+int check_elf(const ELFIO::elfio &reader, ostream &info, ostream &out)
+{
+    info << "Checking file class : ";
+    if ( reader.get_class() == ELFCLASS32 ) {
+        info << "ELF32" << endl;
+        out << "Not a 64-bit ELF format file, abort!" << endl;
+        return -3;        
+    }
+    else
+        info << "ELF64, OK!" << endl;
+
+    info << "Checking ELF file encoding : ";
+    if ( reader.get_encoding() == ELFDATA2LSB )
+        info << "Little endian, OK!" << endl;
+    else {
+        info << "Big endian" << endl;
+        out << "ELF is not little endian encoded, abort!" << endl;
+        return -4;
+    }
+
+    info << "Checking ELF machine type : ";
+    if ( reader.get_machine() == EM_RISCV )
+        info << "RISC-V, OK!" << endl;
+    else {
+        out << "Not a RISC-V ELF file, abort!" << endl;
+        return -5;
+    }
+    return 0;
+}
+
+int check_config(const Config &config, ostream &out)
+{
+    if (config.harts < 1 || config.harts > MAX_HARTS || config.quantum < 1) {
+        out << "Config error: harts must be 1 to " << MAX_HARTS << " and quantum at least 1" << endl;
+        return -1;
+    }
+    return 0;
+}
+
 void RISCV_proc::load_prog() 
 {
-    cout << "Loading ELF program into RISC-V simulator memory..." << endl;
+    info << "Loading ELF program into RISC-V simulator memory..." << endl;
     ELFIO::Elf_Half sec_num = elf_reader.sections.size();
     ELFIO::section *psec;
-    cout << "Reading ELF sections : ";
+    info << "Reading ELF sections : ";
 
     for (int i = 0; i < sec_num; i++) {
         psec = elf_reader.sections[i];
-        cout << " [" << i << "] " << psec->get_name() << "\tflags: " << psec->get_flags() << "\t";
-        cout << "Addr: " << hex << "0x" << psec->get_address() << "\tSize: " << dec << psec->get_size() << endl;
+        info << " [" << i << "] " << psec->get_name() << "\tflags: " << psec->get_flags() << "\t";
+        info << "Addr: " << hex << "0x" << psec->get_address() << "\tSize: " << dec << psec->get_size() << endl;
         if (psec->get_name().compare(".text") == 0)
             text_sec = psec;
         if (psec->get_type() == SHT_SYMTAB)
             symtab_sec = psec;
     }
 
-    cout << "Loading .symtab ... ";
+    info << "Loading .symtab ... ";
     const ELFIO::symbol_section_accessor symbols(elf_reader, symtab_sec);
     symtab.clear();
     symtab.reserve(symbols.get_symbols_num());
@@ -303,14 +519,14 @@ void RISCV_proc::load_prog()
                            type, section_index, other);
         symtab.push_back(ELF_SYMBOL(bind, type, other, j, value, size, section_index, name));
     }
-    cout << "Loaded." << endl;
+    info << "Loaded." << endl;
 
     // load_memory();
     bool entry_setted = false;
     if (config.set_entry_symbol || config.set_entry_addr) {
         if (config.set_entry_symbol) entry_setted = set_entry_symbol(config.entry_symbol);
         else entry_setted = set_entry_addr(config.entry_addr);
-        if (!entry_setted) cout << "Entry point cannot be overwrite! Using default." << endl;
+        if (!entry_setted) out << "Entry point cannot be overwrite! Using default." << endl;
     }
     else {
         entry_addr = elf_reader.get_entry();
@@ -322,14 +538,14 @@ void RISCV_proc::load_prog()
             }
         entry_literal += "0x" + dec2hex(entry_addr) + ">";
     }
-    cout << "Entry point setted at " << entry_literal << "." << endl;
+    info << "Entry point setted at " << entry_literal << "." << endl;
 }
 
 void RISCV_proc::load_memory()
 {
     ELFIO::Elf_Half seg_num = elf_reader.segments.size();
     ELFIO::segment *pseg;
-    cout << "Loading ELF segments into user memory space ...";
+    info << "Loading ELF segments into user memory space ...";
     reset_cache();
     for (int i = 0; i < seg_num; i++) {
         pseg = elf_reader.segments[i];
@@ -346,21 +562,21 @@ void RISCV_proc::load_memory()
         }
     }
     storage.flush();
-    cout << "Loaded." << endl;
+    info << "Loaded." << endl;
 }
 
 bool RISCV_proc::set_entry_symbol(const string &symbol) 
 {
     bool setted = false;
     ELF_SYMBOL* psym = NULL;
-    cout << "Finding " << symbol << " in .symtab : ";
+    out << "Finding " << symbol << " in .symtab : ";
 
     if (get_symbol(symbol, &psym)) {
         setted = true;
-        cout << "[" << psym->idx << "] " << psym->name << "\tAddr: 0x" << hex << psym->value;
+        out << "[" << psym->idx << "] " << psym->name << "\tAddr: 0x" << hex << psym->value;
         entry_addr = psym->value;
         entry_offset = psym->value - text_sec->get_address();
-        cout << "\tOffset: 0x" << entry_offset << endl;
+        out << "\tOffset: 0x" << entry_offset << endl;
 
         entry_literal = symbol;
         entry_literal += ", 0x" + dec2hex(entry_addr);
@@ -378,15 +594,41 @@ bool RISCV_proc::set_entry_addr(size_t addr)
     return true;
 }
 
-RISCV_proc::RISCV_proc(const ELFIO::elfio &reader, const Config &config) 
-    : elf_reader(reader), config(config)
+RISCV_proc::RISCV_proc(const ELFIO::elfio &reader, const Config &config, istream &input, ostream &output)
+    : config(config), elf_reader(reader), in(input.rdbuf()), out(output.rdbuf()),
+      console(output.rdbuf()), info(output.rdbuf()), decode_cache(DECODE_CACHE_SIZE)
 {
+    in.tie(&out);   // Prompts show before the shell waits, as with cin
     memset(reg_ulong, 32, sizeof(reg_ulong));
+    storage.SetFast(config.fast_mode);
+    quiet = false;
+    save_caches = false;
+    hart = 0;
+    flag_barrier = false;
+    access_op = -1;
+    tlb_hit = tlb_miss = 0;
+    tb_flush = false;
+#ifdef PIPE
+    nonblocking = posted = false;
+    BranchPredictor bp;
+    if (!bp.init(config))
+        out << "Unknown branch predictor " << config.branch_prediction << ", using never" << endl;
+    bpred.assign(config.harts, bp);
+#else
+    jit_cache = nullptr;
+    jit_cache_used = jit_blocks = 0;
+    if (config.engine == "jit") engine = ENGINE_JIT;
+    else if (config.engine == "threaded") engine = ENGINE_THREADED;
+    else engine = ENGINE_STAGE;
+#endif
 }
 
 RISCV_proc::~RISCV_proc() 
 {
     clear_pg_table();
+#ifndef PIPE
+    if (jit_cache) munmap(jit_cache, JIT_CACHE_SIZE);
+#endif
 }
 
 void RISCV_proc::reset_cache()
@@ -394,6 +636,20 @@ void RISCV_proc::reset_cache()
     CacheConfig cc1 = GET_CACHE_CFG(config, l1);
     CacheConfig cc2 = GET_CACHE_CFG(config, l2);
     CacheConfig cc3 = GET_CACHE_CFG(config, l3);
+    SET_CACHE_POLICIES(cc1, config, l1, out);
+    SET_CACHE_POLICIES(cc2, config, l2, out);
+    SET_CACHE_POLICIES(cc3, config, l3, out);
+    // Private caches hold no coherent copy of shared data, so with several
+    // harts the data stays in memory and the caches only model timing, of
+    // the coherence actions too with the MESI directory
+    storage.SetTagOnly(config.cache.tag_only || config.harts > 1);
+    storage.SetHarts(config.harts);
+    int coherence = ParseCoherence(config.cache.coherence);
+    if (coherence < 0) {
+        out << "Unknown coherence protocol " << config.cache.coherence << ", using none" << endl;
+        coherence = kCoherenceNone;
+    }
+    storage.SetCoherence(coherence == kCoherenceMESI);
     storage.SetConfig(cc1, cc2, cc3);
 
     StorageLatency ltc1 = GET_CACHE_LATENCY(config, l1);
@@ -402,6 +658,33 @@ void RISCV_proc::reset_cache()
     StorageLatency ltcm = GET_CACHE_LATENCY(config, memory);
     storage.SetLatency(ltc1, ltc2, ltc3, ltcm);
     storage.ClearStats();
+#ifdef PIPE
+    nonblocking = config.cache.l1.mshrs > 0;
+    posted = false;
+    memset(reg_ready, 0, sizeof(reg_ready));
+    load_stall_cycles = 0;
+    for (auto &bp : bpred) bp.init(config);     // Cold tables
+#endif
+}
+
+tlb_entry_t& RISCV_proc::tlb_lookup(size_t vaddr)
+{
+    size_t vpage = PAGE(vaddr);
+    tlb_entry_t &e = tlb[TLB_IDX(vaddr)];
+    if (e.vpage == vpage) {
+        tlb_hit++;
+        return e;
+    }
+    tlb_miss++;
+    e.vpage = vpage;
+    e.pte = &pg_table[vpage];
+    e.host = PG_ALLOC((*e.pte)) ? storage.HostPage(e.pte->paddr) : nullptr;
+    return e;
+}
+
+void RISCV_proc::tlb_invalidate()
+{
+    for (auto &e : tlb) e.vpage = TLB_INVALID;
 }
 
 void RISCV_proc::read_memory(char *buf, size_t vaddr, size_t len)
@@ -409,58 +692,92 @@ void RISCV_proc::read_memory(char *buf, size_t vaddr, size_t len)
     size_t curpg, start = vaddr, end = vaddr + len;
     while (vaddr < end) {
         curpg = PAGE(vaddr);
-        pte_t &pte = pg_table[curpg];
-        if (!PG_ALLOC(pte)) cout << dec2hex(vaddr) << endl;
+        tlb_entry_t &e = tlb_lookup(vaddr);
+        pte_t &pte = *e.pte;
+        if (!PG_ALLOC(pte)) out << dec2hex(vaddr) << endl;
         assert(PG_ALLOC(pte));
 
         size_t read_bytes = min(curpg + PGSIZE - vaddr, end - vaddr);
+        if (access_op >= 0 && trace.is_open())
+            trace.record(access_op, pte.paddr + (vaddr - curpg), read_bytes, access_pc);
+        if (e.host && storage.IsFast()) {
+            storage.FastAccess(e.host + (vaddr - curpg), read_bytes, 1, buf + vaddr - start);
+            vaddr += read_bytes;
+            continue;
+        }
         int time;
+        storage.SetPC(access_op == kTraceRead ? access_pc : 0);
+        storage.SetCycle(pipe_cycle_count);
         storage.HandleRequest(pte.paddr + (vaddr - curpg), read_bytes, 1, 
                              buf + vaddr - start, time);
-        pipe_cycle_count += time;
+        memory_time(time);
+        vaddr += read_bytes;
+    }
+}
+
+void RISCV_proc::peek_memory(char *buf, size_t vaddr, size_t len)
+{
+    size_t curpg, start = vaddr, end = vaddr + len;
+    while (vaddr < end) {
+        curpg = PAGE(vaddr);
+        auto pte = pg_table.find(curpg);
+        assert(pte != pg_table.end() && PG_ALLOC(pte->second));
+        size_t read_bytes = min(curpg + PGSIZE - vaddr, end - vaddr);
+        memcpy(buf + vaddr - start, storage.HostPage(pte->second.paddr) + (vaddr - curpg), read_bytes);
         vaddr += read_bytes;
     }
 }
 
-void RISCV_proc::write_memory(char *buf, size_t vaddr, size_t len, uint8_t flags = 0)
+void RISCV_proc::write_memory(char *buf, size_t vaddr, size_t len, uint8_t flags)
 {
     size_t curpg, start = vaddr, end = vaddr + len;
     while (vaddr < end) {
         curpg = PAGE(vaddr);
-        pte_t &pte = pg_table[curpg];
         if (flags) alloc_page(curpg, flags);
-        else assert(PG_ALLOC(pte) && PG_WRITE(pte));
+        tlb_entry_t &e = tlb_lookup(vaddr);
+        pte_t &pte = *e.pte;
+        assert(PG_ALLOC(pte) && (flags || PG_WRITE(pte)));
 
         size_t write_bytes = min(curpg + PGSIZE - vaddr, end - vaddr);
+        if (PG_EXEC(pte)) invalidate_code(vaddr, write_bytes);
+        if (access_op >= 0 && trace.is_open())
+            trace.record(kTraceWrite, pte.paddr + (vaddr - curpg), write_bytes, access_pc);
+        if (e.host && storage.IsFast()) {
+            storage.FastAccess(e.host + (vaddr - curpg), write_bytes, 0, buf ? buf + vaddr - start : nullptr);
+            vaddr += write_bytes;
+            continue;
+        }
         int time;
+        storage.SetPC(access_op == kTraceRead ? access_pc : 0);
+        storage.SetCycle(pipe_cycle_count);
         if (buf) 
             storage.HandleRequest(pte.paddr + (vaddr - curpg), write_bytes, 0, buf + vaddr - start, time);
         else
             storage.HandleRequest(pte.paddr + (vaddr - curpg), write_bytes, 0, nullptr, time);
-        pipe_cycle_count += time;
+        memory_time(time);
         vaddr += write_bytes;
     }
 }
 
+// Charges the cycles of a memory access, posted accesses only note them
+void RISCV_proc::memory_time(int time)
+{
+#ifdef PIPE
+    if (posted) {
+        posted_time += time;
+        return;
+    }
+#endif
+    pipe_cycle_count += time;
+}
+
 void RISCV_proc::alloc_page(size_t vaddr, uint8_t flags)
 {
     pte_t &pte = pg_table[PAGE(vaddr)];
     if (PG_ALLOC(pte)) return;
     pte.paddr = storage.alloc_page();
     pte.flags = (flags | PTE_P);
-}
-
-template<typename T> T RISCV_proc::memread(size_t vaddr)
-{
-    if (!vaddr) return 0;
-    T res;
-    read_memory((char *)&res, vaddr, sizeof(T));
-    return res;
-}
-
-template<typename T> void RISCV_proc::memwrite(size_t vaddr, T val)
-{
-    write_memory((char *)&val, vaddr, sizeof(T));
+    tlb[TLB_IDX(vaddr)].vpage = TLB_INVALID;
 }
 
 string RISCV_proc::read_string(size_t addr)
@@ -474,6 +791,123 @@ string RISCV_proc::read_string(size_t addr)
     return res;
 }
 
+const DECODED_INST& RISCV_proc::decode_inst(size_t PC, raw_inst_t raw_inst)
+{
+    DECODED_INST &d = decode_cache[DECODE_IDX(PC)];
+    if (d.valid && d.PC == PC) {
+        decode_hit++;
+        return d;
+    }
+    decode_miss++;
+
+    RISCV_inst riscv_inst = RISCV_inst(raw_inst);
+    d.valid = true;
+    d.PC = PC;
+    d.type = riscv_inst.type;
+    d.opcode = OPCODE(raw_inst);
+    d.funct3 = FUNCT3(raw_inst);
+    d.rd = d.rs1 = d.rs2 = 0;
+    d.imm = 0;
+    d.alu_func = ALU_ADD;
+    switch (riscv_inst.type) {
+    case IT_R:
+        d.subtype = riscv_inst.subtype.type_r;
+        d.alu_func = (uint8_t)(riscv_inst.subtype.type_r);
+        d.rd = riscv_inst.inst.inst_r.rd;
+        d.rs1 = riscv_inst.inst.inst_r.rs1;
+        d.rs2 = riscv_inst.inst.inst_r.rs2;
+        break;
+    case IT_I: {
+        const I_INST_TYPE &type_i = riscv_inst.subtype.type_i;
+        d.subtype = type_i;
+        d.rd = riscv_inst.inst.inst_i.rd;
+        d.rs1 = riscv_inst.inst.inst_i.rs1;
+        d.imm = riscv_inst.inst.inst_i.imm;
+        if (d.opcode == 0x03) d.alu_func = ALU_ADD;
+        else if (type_i == I_ADDI) d.alu_func = ALU_ADD;
+        else if (type_i == I_SLLI) d.alu_func = ALU_SLL;
+        else if (type_i == I_SLTI) d.alu_func = ALU_SLT;
+        else if (type_i == I_SLTIU) d.alu_func = ALU_SLTU;
+        else if (type_i == I_XORI) d.alu_func = ALU_XOR;
+        else if (type_i == I_SRLI) d.alu_func = ALU_SRL;
+        else if (type_i == I_SRAI) d.alu_func = ALU_SRA;
+        else if (type_i == I_ORI)  d.alu_func = ALU_OR;
+        else if (type_i == I_ANDI) d.alu_func = ALU_AND;
+        else if (type_i == I_ADDIW) d.alu_func = ALU_ADDW;
+        else if (type_i == I_SLLIW) d.alu_func = ALU_SLLW;
+        else if (type_i == I_SRLIW) d.alu_func = ALU_SRLW;
+        else if (type_i == I_SRAIW) d.alu_func = ALU_SRAW;
+        else if (type_i == I_JALR) d.alu_func = ALU_ADD;
+        else if (type_i == I_ECALL) {    // Syscall number in a7, argument in a0
+            d.rs1 = R_A0; d.rs2 = R_A7; 
+            d.alu_func = ALU_NOP; d.rd = R_A5;
+        }
+        else d.alu_func = ALU_NOP;
+    }   break;
+    case IT_S:
+        d.subtype = riscv_inst.subtype.type_s;
+        d.rs1 = riscv_inst.inst.inst_s.rs1;
+        d.rs2 = riscv_inst.inst.inst_s.rs2;
+        d.imm = riscv_inst.inst.inst_s.imm;
+        if (riscv_inst.subtype.type_s == S_UNIMP) d.alu_func = ALU_NOP;
+        break;
+    case IT_SB:
+        d.subtype = riscv_inst.subtype.type_sb;
+        d.rs1 = riscv_inst.inst.inst_sb.rs1;
+        d.rs2 = riscv_inst.inst.inst_sb.rs2;
+        d.imm = riscv_inst.inst.inst_sb.imm;
+        break;
+    case IT_U:
+        d.subtype = riscv_inst.subtype.type_u;
+        d.rd = riscv_inst.inst.inst_u.rd;
+        d.imm = riscv_inst.inst.inst_u.imm;
+        break;
+    case IT_UJ:
+        d.subtype = riscv_inst.subtype.type_uj;
+        d.rd = riscv_inst.inst.inst_uj.rd;
+        d.imm = riscv_inst.inst.inst_uj.imm;
+        break;
+    }
+    return d;
+}
+
+// Drop decoded and translated code covering [vaddr, vaddr + len)
+void RISCV_proc::invalidate_code(size_t vaddr, size_t len)
+{
+    size_t end = vaddr + len;
+    if (!tb_map.empty()) tb_flush = true;
+    if (len >= DECODE_CACHE_SIZE * sizeof(raw_inst_t)) {
+        for (auto &d : decode_cache) d.valid = false;
+        return;
+    }
+    for (size_t pc = ROUND_DOWN(vaddr, sizeof(raw_inst_t)); pc < end; pc += sizeof(raw_inst_t)) {
+        DECODED_INST &d = decode_cache[DECODE_IDX(pc)];
+        if (d.PC == pc) d.valid = false;
+    }
+}
+
+// Extra cycles spent in the multi-cycle ALU units
+size_t RISCV_proc::alu_stall(uint8_t alu_func)
+{
+    if (alu_func >= ALU_MUL && alu_func <= ALU_MULHU)
+        return config.latency.mul - 1;
+    else if (alu_func >= ALU_DIV && alu_func <= ALU_REMU)
+        return config.latency.div - 1;
+    else if (alu_func == ALU_MULW)
+        return config.latency.mulw - 1;
+    else if (alu_func >= ALU_DIVW && alu_func <= ALU_REMUW)
+        return config.latency.divw - 1;
+    return 0;
+}
+
+REG RISCV_proc::read_reg(uint8_t rs)
+{
+#ifdef PIPE
+    if (rs && rs == reg_e.rd) return DATA_FORWARD(reg_e);
+    if (rs && rs == reg_m.rd) return DATA_FORWARD(reg_m);
+#endif
+    return reg_ulong[rs];
+}
 
 void RISCV_proc::fetch()
 {
@@ -538,36 +972,43 @@ void RISCV_proc::writeback()
         pipe_cycle_count += config.latency.ecall;
         switch (reg_W.val) {
         case SYS_PRINT_I:
-            cout << "<stdout> " << dec << (long long) reg_W.res << endl;
+            console << "<stdout> " << dec << (long long) reg_W.res << endl;
             break;
         case SYS_PRINT_C:
-            cout << "<stdout> " << (char) reg_W.res << endl;
+            console << "<stdout> " << (char) reg_W.res << endl;
             break;
         case SYS_PRINT_S: {
+            access_op = kTraceRead;
+#ifdef PIPE
+            access_pc = reg_W.PC;
+#else
+            access_pc = reg_D.PC;
+#endif
             string s = read_string(reg_W.res);
-            cout << "<stdout> " << s << endl;
+            access_op = -1;
+            console << "<stdout> " << s << endl;
         }   break;
         case SYS_READ_I: {
-            long long x;
+            long long x = 0;
             if (inputstream.rdbuf()->in_avail() == 0) {
-                cout << "<stdin> Waiting input: " << endl;
+                console << "<stdin> Waiting input: " << endl;
                 inputstream.clear();
                 inputstream.str();
                 string s;
-                getline(cin, s);
+                getline(in, s);
                 inputstream << s;
             }
             inputstream >> x;
             reg_ulong[reg_W.rd] = REG(x);
         }   break;
         case SYS_READ_C: {
-            char c;
+            char c = 0;
             if (inputstream.rdbuf()->in_avail() == 0) {
-                cout << "<stdin> Waiting input: " << endl;
+                console << "<stdin> Waiting input: " << endl;
                 inputstream.clear();
                 inputstream.str();
                 string s;
-                getline(cin, s);
+                getline(in, s);
                 inputstream << s;
             }
             inputstream >> c;
@@ -591,6 +1032,15 @@ void RISCV_proc::writeback()
         case SYS_HEAP_HI:
             reg_ulong[reg_W.rd] = config.heap_max;
             break;
+        case SYS_HART_ID:
+            reg_ulong[reg_W.rd] = hart;
+            break;
+        case SYS_HARTS:
+            reg_ulong[reg_W.rd] = config.harts;
+            break;
+        case SYS_BARRIER:   // Stops the hart, the scheduler resumes it
+            if (!harts.empty()) flag_finished = flag_barrier = true;
+            break;
         case SYS_EXIT:
             flag_finished = true;
             reg_ulong[reg_W.rd] = reg_W.res;
@@ -604,20 +1054,32 @@ void RISCV_proc::writeback()
 }   
 
 #ifdef PIPE
-REG RISCV_proc::predict_PC(REG thisPC, int imm)
+void RISCV_proc::bpred_totals(size_t &branches, size_t &mispredicts) const
 {
-    if (!config.branch_prediction.compare("always")) {
-        return thisPC + imm;
+    branches = mispredicts = 0;
+    for (auto &bp : bpred) {
+        branches += bp.branches;
+        mispredicts += bp.mispredicts;
     }
-    else if (!config.branch_prediction.compare("ftbnt")) {
-        if (imm > 0) return thisPC + imm;
-        else return thisPC + sizeof(raw_inst_t);
+}
+
+// Stalls the instruction in D until the loads producing its sources (or
+// its destination, so an older load cannot land after it) have completed.
+// System calls read argument registers directly and wait for everything.
+void RISCV_proc::wait_for_loads(const DECODED_INST &inst)
+{
+    size_t ready = 0;
+    if (inst.opcode == 0x73) {
+        for (int r = 0; r < 32; r++) ready = max(ready, reg_ready[r]);
+    } else {
+        if (inst.type != IT_U && inst.type != IT_UJ) ready = max(ready, reg_ready[inst.rs1]);
+        if (inst.type == IT_R || inst.type == IT_S || inst.type == IT_SB) ready = max(ready, reg_ready[inst.rs2]);
+        if (inst.type != IT_S && inst.type != IT_SB) ready = max(ready, reg_ready[inst.rd]);
     }
-    else if (!config.branch_prediction.compare("btfnt")) {
-        if (imm < 0) return thisPC + imm;
-        else return thisPC + sizeof(raw_inst_t);
+    if (ready > pipe_cycle_count) {
+        load_stall_cycles += ready - pipe_cycle_count;
+        pipe_cycle_count = ready;
     }
-    return thisPC + sizeof(raw_inst_t);
 }
 
 void RISCV_proc::clock_tick()
@@ -649,8 +1111,8 @@ void RISCV_proc::set_pipe_control()
         ctrl_D = PCTRL_BUBBLE;
     }
     if (reg_E.opcode == 0x63) {             // BXX
-        if ((reg_E.cond && (predict_PC(reg_E.src1, reg_E.src2) != (SREG)reg_E.src1 + (SREG)reg_E.src2)) || 
-            (!reg_E.cond && (predict_PC(reg_E.src1, reg_E.src2) == (SREG)reg_E.src1 + (SREG)reg_E.src2))) {
+        bpred[hart].update(reg_E.PC, reg_E.history, reg_E.cond, reg_E.taken);
+        if (reg_E.cond != reg_E.taken) {
                 ctrl_E = PCTRL_BUBBLE;
                 ctrl_D = PCTRL_BUBBLE;
                 ctrl_F = PCTRL_NORMAL;
@@ -679,7 +1141,7 @@ PIPE_REG_F RISCV_proc::select_PC()
         result.PC = reg_F.PC + UJ_IMM(reg_f.inst);
         break;
     case 0x63:  // BXX
-        result.PC = predict_PC(reg_F.PC, SB_IMM(reg_f.inst));
+        result.PC = reg_f.taken ? reg_F.PC + SB_IMM(reg_f.inst) : reg_F.PC + sizeof(raw_inst_t);
         break;
     case 0x67:  // JALR
     default:
@@ -689,22 +1151,12 @@ PIPE_REG_F RISCV_proc::select_PC()
     return result;
 }
 
-void RISCV_proc::execute(size_t steps) 
+void RISCV_proc::execute_hart(size_t steps) 
 {
     size_t s = 0;
     do {
+        if (hit_breakpoint(reg_W.PC)) break;
         s++;
-        for (auto &bp : breakpoints) 
-            if (bp.addr == reg_W.PC && bp.activated) {
-                cout << "Breakpoint at " << bp.literal << endl;
-                curbp = &bp; 
-                bp.disable();
-                return;
-            }
-        if (curbp != nullptr) {
-            curbp->enable();
-            curbp = nullptr;
-        }
 
         // Should in fact happen in parallel
         // backward for data-forwarding to work correctly
@@ -727,44 +1179,85 @@ void RISCV_proc::execute(size_t steps)
     inst_count += s;
 }
 #else 
-void RISCV_proc::execute(size_t steps) 
+void RISCV_proc::step()
+{
+    fetch();
+    decode();
+    exec();
+    mem();
+    writeback();
+    pipe_cycle_count += 5;
+}
+
+void RISCV_proc::execute_hart(size_t steps) 
 {
+    // Only the stages fetch through memory and know the PC of data accesses
+    if (engine != ENGINE_STAGE && !trace.is_open() && !storage.UsesPC()) {
+        execute_threaded(steps);
+        return;
+    }
     size_t s = 0;
     do {
+        if (hit_breakpoint(reg_F.PC)) break;
         s++;
-        for (auto &bp : breakpoints) 
-            if (bp.addr == reg_F.PC && bp.activated) {
-                cout << "Breakpoint at " << bp.literal << endl;
-                curbp = &bp; 
-                bp.disable();
-                return;
-            }
-        if (curbp != nullptr) {
-            curbp->enable();
-            curbp = nullptr;
-        }
-        fetch();
-        decode();
-        exec();
-        mem();
-        writeback();
-        pipe_cycle_count += 5;
+        step();
         if (s == steps) break;
     } while (!flag_finished);
     inst_count += s;
 }
 #endif
 
-void RISCV_proc::run_simulator()
+bool Breakpoint::check(const REG *regs)
 {
-    string shell_prompt = "> ";
-    string cmd, tmp;
-    int steps;
+    SREG v = regs[cond_reg];
+    bool holds = true;
+    switch (cond) {
+    case BC_EQ: holds = v == cond_value; break;
+    case BC_NE: holds = v != cond_value; break;
+    case BC_LT: holds = v < cond_value; break;
+    case BC_LE: holds = v <= cond_value; break;
+    case BC_GT: holds = v > cond_value; break;
+    case BC_GE: holds = v >= cond_value; break;
+    case BC_NONE: break;
+    }
+    return holds && ++hits >= hit;
+}
+
+bool RISCV_proc::hit_breakpoint(REG pc)
+{
+    // Resuming from a breakpoint: its instruction runs without checking the
+    // breakpoints there again
+    if (curbp != nullptr && curbp->addr == pc) {
+        curbp->enable();
+        curbp = nullptr;
+        return false;
+    }
+    if (const vector<size_t> *at = breakpoints_at(pc))
+        for (size_t i : *at) {
+            Breakpoint &bp = breakpoints[i];
+            if (!bp.activated || !bp.check(reg_ulong)) continue;
+            out << "Breakpoint at " << bp.literal << endl;
+            curbp = &bp; 
+            bp.disable();
+            return true;
+        }
+    if (curbp != nullptr) {
+        curbp->enable();
+        curbp = nullptr;
+    }
+    return false;
+}
 
+// Loads the program and resets the processor, caches and counters.
+// False when the checkpoint to start from cannot be restored
+bool RISCV_proc::start_run()
+{
     clear_regs();
     inputstream.str("");
     inputstream.clear();
     breakpoints.clear();
+    bp_index.clear();
+    bp_pages.clear();
     curbp = nullptr;
 
     clear_pg_table();
@@ -779,45 +1272,74 @@ void RISCV_proc::run_simulator()
 
     pipe_cycle_count = 0;
     inst_count = 0;
-    flag_finished = flag_break = false;
-    
-    cout << "Started at " << entry_literal << ": ";
-    cout << RISCV_inst(memread<raw_inst_t>(reg_F.PC)) << endl;
-#ifdef PIPE
-    // Warmup
-    set_pipe_control();
-    execute(1);
+    decode_hit = decode_miss = 0;
+    tlb_hit = tlb_miss = 0;
+#ifndef PIPE
+    jit_blocks = 0;
 #endif
+    flag_finished = flag_break = flag_barrier = false;
+    if (!trace_path.empty() && !trace.open(trace_path))   // After loading, so only the program's accesses are traced
+        out << "Cannot open trace file " << trace_path << endl;
+    
+    // Not an access of the program, so it stays out of the caches and trace
+    raw_inst_t first;
+    peek_memory((char *)&first, reg_F.PC, sizeof(first));
+    info << "Started at " << entry_literal << ": " << RISCV_inst(first) << endl;
+    start_harts();
+    return restore_path.empty() || restore_checkpoint(restore_path);
+}
+
+void RISCV_proc::finish_run()
+{
+    if (trace.is_open()) {
+        trace.close();
+        out << "Trace: " << dec << trace.records() << " records written to " << trace_path;
+        out << " (" << trace.bytes() << " bytes)" << endl;
+    }
+}
+
+void RISCV_proc::run_simulator()
+{
+    string shell_prompt = "> ";
+    string cmd, tmp;
+    int steps;
+
+    start_run();
     while (1) {
         if (flag_finished) {
-            cout << "Program exited with code: " << reg_ulong[R_A5] << endl;
+            out << "Program exited with code: " << reg_ulong[R_A5] << endl;
             break;
         }
 #ifdef PIPE
         REG pc = reg_W.PC;
         if (!PG_EXEC(pg_table[PAGE(pc)])) {
-            cout << "Fatal: PC Encountered unexecutable memory address! Execution stopped." << endl;
-            cout << dec2hex(pc) << endl;
+            out << "Fatal: PC Encountered unexecutable memory address! Execution stopped." << endl;
+            out << dec2hex(pc) << endl;
             break;
         }
-        cout << "next inst.: <0x" << dec2hex(pc) << ">\t" << RISCV_inst(memread<raw_inst_t>(pc)) << endl;
+        out << "next inst.: <0x" << dec2hex(pc) << ">\t" << RISCV_inst(memread<raw_inst_t>(pc)) << endl;
 #else
         if (!PG_EXEC(pg_table[PAGE(reg_F.PC)])) {
-            cout << "Fatal: PC Encountered unexecutable memory address! Execution stopped." << endl;
+            out << "Fatal: PC Encountered unexecutable memory address! Execution stopped." << endl;
             break;
         }
-        cout << "next inst.: <0x" << dec2hex(reg_F.PC) << ">\t" << RISCV_inst(memread<raw_inst_t>(reg_F.PC)) << endl;
+        out << "next inst.: <0x" << dec2hex(reg_F.PC) << ">\t" << RISCV_inst(memread<raw_inst_t>(reg_F.PC)) << endl;
 #endif
-        cout << shell_prompt;
+        out << shell_prompt;
 
         tmp = cmd;
-        getline(cin, cmd);
+        if (!getline(in, cmd)) {   // EOF
+            out << endl << "Program killed!" << endl;
+            break;
+        }
         if (trim(cmd).empty()) {
             cmd = tmp;
-            cout << "Repeating command: " << cmd << endl;
+            out << "Repeating command: " << cmd << endl;
         }
             
-        if (cmd[0] == 's') {
+        if (!cmd.compare(0, 4, "save") || !cmd.compare(0, 7, "restore"))
+            checkpoint_command(cmd);
+        else if (cmd[0] == 's') {
             if (cmd[1] >= '0' && cmd[1] <= '9')
                 steps = stoi(cmd.substr(1, cmd.size()));
             else steps = 1;
@@ -825,58 +1347,101 @@ void RISCV_proc::run_simulator()
         }
 #ifdef PIPE
         else if (cmd[0] == 'p') {
-            cout << "Pipeline Status: " << endl;
-            cout << "Fetch: <0x" << dec2hex(reg_F.PC) << ">\t" << RISCV_inst(memread<raw_inst_t>(reg_F.PC)) << endl;
-            cout << "Decode:<0x" << dec2hex(reg_D.PC) << ">\t" << RISCV_inst(memread<raw_inst_t>(reg_D.PC)) << endl;
-            cout << "Exec:  <0x" << dec2hex(reg_E.PC) << ">\t" << RISCV_inst(memread<raw_inst_t>(reg_E.PC)) << endl;
-            cout << "Mem:   <0x" << dec2hex(reg_M.PC) << ">\t" << RISCV_inst(memread<raw_inst_t>(reg_M.PC)) << endl;
-            cout << "WB:    <0x" << dec2hex(reg_W.PC) << ">\t" << RISCV_inst(memread<raw_inst_t>(reg_W.PC)) << endl;
+            out << "Pipeline Status: " << endl;
+            out << "Fetch: <0x" << dec2hex(reg_F.PC) << ">\t" << RISCV_inst(memread<raw_inst_t>(reg_F.PC)) << endl;
+            out << "Decode:<0x" << dec2hex(reg_D.PC) << ">\t" << RISCV_inst(memread<raw_inst_t>(reg_D.PC)) << endl;
+            out << "Exec:  <0x" << dec2hex(reg_E.PC) << ">\t" << RISCV_inst(memread<raw_inst_t>(reg_E.PC)) << endl;
+            out << "Mem:   <0x" << dec2hex(reg_M.PC) << ">\t" << RISCV_inst(memread<raw_inst_t>(reg_M.PC)) << endl;
+            out << "WB:    <0x" << dec2hex(reg_W.PC) << ">\t" << RISCV_inst(memread<raw_inst_t>(reg_W.PC)) << endl;
         }
+#else
+        else if (cmd[0] == 'm') set_engine(cmd);
 #endif
         else if (cmd[0] == 'c') execute(0);
         else if (cmd[0] == 'k') {
-            cout << "Program killed!" << endl;
+            out << "Program killed!" << endl;
             break;
         }
         else if (cmd[0] == 'b') set_breakpoint(cmd);
+        else if (cmd[0] == 'f') set_fast_mode(cmd);
         else if (cmd[0] == 'i') summary();
         else if (cmd[0] == 'd' || cmd[0] == 'e') {
             int bpid;
             try {
                 bpid = stoi(cmd.substr(1, cmd.size()));
-            } catch (invalid_argument) {
-                cout << "Error: Unidentified breakpoint id." << endl;
+            } catch (const logic_error &) {
+                out << "Error: Unidentified breakpoint id." << endl;
                 return;
             }
-            if (bpid <= 0 || bpid > breakpoints.size()) {
-                cout << dec << "No breakpoint with id: " << bpid << endl;
+            if (bpid <= 0 || (size_t)bpid > breakpoints.size()) {
+                out << dec << "No breakpoint with id: " << bpid << endl;
                 return;
             }
             if (cmd[0] == 'e') {
                 breakpoints[bpid-1].enable();
-                cout << "Breakpoint [" << bpid << "] at " << breakpoints[bpid-1].literal;
-                cout << " enabled." << endl;
+                out << "Breakpoint [" << bpid << "] at " << breakpoints[bpid-1].literal;
+                out << " enabled." << endl;
             }
             else if (cmd[0] == 'd') {
                 breakpoints[bpid-1].disable();
                 if (curbp == &breakpoints[bpid-1]) curbp = nullptr;
-                cout << "Breakpoint [" << bpid << "] at " << breakpoints[bpid-1].literal;
-                cout << " disabled." << endl;
+                out << "Breakpoint [" << bpid << "] at " << breakpoints[bpid-1].literal;
+                out << " disabled." << endl;
             }
         }
         else status(cmd);
     }
+    finish_run();
     summary(true);
 }
 
-void RISCV_proc::clear_pg_table() 
+int RISCV_proc::run_batch(size_t max_insts, size_t max_cycles, bool json)
 {
-    pgtb_t::iterator it;
-    for (it = pg_table.begin(); it != pg_table.end(); it++) {
-        if (it->second.flags & PTE_P)
-            storage.free_page(it->second.paddr);
+    const size_t chunk = 1 << 10;   // Instructions between cycle limit checks
+    const char *stop = "exit";
+    load_prog();
+    if (!quiet) print_config();
+    if (!start_run()) return -1;
+    while (!flag_finished) {
+#ifdef PIPE
+        REG pc = reg_W.PC;
+#else
+        REG pc = reg_F.PC;
+#endif
+        if (!PG_EXEC(pg_table[PAGE(pc)])) {
+            out << "Fatal: PC Encountered unexecutable memory address! Execution stopped." << endl;
+            stop = "fatal";
+            break;
+        }
+        if (max_insts && inst_count >= max_insts) {
+            stop = "max_insts";
+            break;
+        }
+        if (max_cycles && elapsed_cycles() >= max_cycles) {
+            stop = "max_cycles";
+            break;
+        }
+        size_t steps = max_insts ? max_insts - inst_count : 0;
+        if (max_cycles && (steps == 0 || steps > chunk)) steps = chunk;
+        execute(steps);
     }
+    if (flag_finished)
+        info << "Program exited with code: " << reg_ulong[R_A5] << endl;
+    if (!save_path.empty()) save_checkpoint(save_path, save_caches);
+    finish_run();
+    if (json) summary_json(stop);
+    else summary(true);
+    if (!strcmp(stop, "fatal")) return -1;
+    return flag_finished ? (int)reg_ulong[R_A5] : 0;
+}
+
+void RISCV_proc::clear_pg_table() 
+{
     pg_table.clear();
+    storage.reset_memory();     // Every physical page belongs to pg_table
+    tlb_invalidate();
+    for (auto &d : decode_cache) d.valid = false;
+    tb_clear();
 }
 
 void RISCV_proc::clear_regs()
@@ -893,55 +1458,167 @@ void RISCV_proc::start()
 {
     load_prog();
     print_config();
-    cout << endl;
-    cout << "Welcome to MarkYu's RISC-V simulator!" << endl;
+    out << endl;
+    out << "Welcome to MarkYu's RISC-V simulator!" << endl;
     shell();
     exit();
 }
 
 void RISCV_proc::print_config()
 {
-    cout << "-----------Simulator configurations------------" << endl;
-    cout << "Memory Heap: \tbase=0x" << dec2hex(config.heap_base) << "\tmax=0x" << dec2hex(config.heap_max) << endl;
-    cout << "Latency Settings (CPU cycles): " << dec << endl;
-    cout << "   Instructions: mul:" << config.latency.mul << "\tmulw:" << config.latency.mulw << 
+    out << "-----------Simulator configurations------------" << endl;
+#ifndef PIPE
+    out << "Execution Engine: " << config.engine << endl;
+#endif
+    out << "Memory Model: " << (config.fast_mode ? "fast (functional)" : "timed") << endl;
+#ifdef PIPE
+    out << "Branch Prediction: " << bpred[0].name();
+    if (bpred[0].kind_of() == BP_BIMODAL)
+        out << " (" << (1 << config.predictor.table_bits) << " entries)";
+    else if (bpred[0].kind_of() == BP_GSHARE || bpred[0].kind_of() == BP_TOURNAMENT)
+        out << " (" << (1 << config.predictor.table_bits) << " entries, " << config.predictor.history_bits
+            << " history bits)";
+    else if (bpred[0].kind_of() == BP_TAGE)
+        out << " (" << config.predictor.tage_tables << " tables of " << (1 << config.predictor.tage_table_bits)
+            << " entries, history " << config.predictor.tage_min_history << "-" << config.predictor.tage_max_history << ")";
+    out << endl;
+#endif
+    if (config.harts > 1)
+        out << "Harts: " << config.harts << "\tQuantum: " << config.quantum << " instructions"
+             << (storage.GetDirectory() ? "\tCoherence: MESI directory" : "") << endl;
+    out << "Memory Heap: \tbase=0x" << dec2hex(config.heap_base) << "\tmax=0x" << dec2hex(config.heap_max) << endl;
+    out << "Latency Settings (CPU cycles): " << dec << endl;
+    out << "   Instructions: mul:" << config.latency.mul << "\tmulw:" << config.latency.mulw << 
                            "\tdiv:" << config.latency.div << "\tdivw:" << config.latency.divw <<
                            "\tecall:" << config.latency.ecall << endl;
-    cout << "   L1 Cache:     Bus:" << config.latency.l1_bus << "\tHit:" << config.latency.l1_bus << endl;
-    cout << "   L2 Cache:     Bus:" << config.latency.l2_bus << "\tHit:" << config.latency.l2_bus << endl;
-    cout << "   L3 Cache:     Bus:" << config.latency.l3_bus << "\tHit:" << config.latency.l3_bus << endl;
-    cout << "   Memory:       Bus:" << config.latency.memory_bus << "\tHit:" << config.latency.memory_bus << endl;
-    cout << "Cache Settings: " << endl;
-    cout << "   L1 Cache:     Size:" << config.cache.l1.size << "B\t\tAssoc:" << config.cache.l1.associativity << endl;
-    cout << "                 Block Size:" << config.cache.l1.block_size << "B\t\tWrite Policy:" 
+    out << "   L1 Cache:     Bus:" << config.latency.l1_bus << "\tHit:" << config.latency.l1_bus << endl;
+    out << "   L2 Cache:     Bus:" << config.latency.l2_bus << "\tHit:" << config.latency.l2_bus << endl;
+    out << "   L3 Cache:     Bus:" << config.latency.l3_bus << "\tHit:" << config.latency.l3_bus << endl;
+    out << "   Memory:       Bus:" << config.latency.memory_bus << "\tHit:" << config.latency.memory_bus << endl;
+    out << "Cache Settings: " << (config.cache.tag_only || config.harts > 1 ? "(tag-only, data kept in memory)" : "") << endl;
+    out << "   L1 Cache:     Size:" << config.cache.l1.size << "B\t\tAssoc:" << config.cache.l1.associativity << endl;
+    out << "                 Block Size:" << config.cache.l1.block_size << "B\t\tWrite Policy:" 
          << (config.cache.l1.writeback ? "Write Back/Write Alloc" : "Write Through / No Write Alloc") << endl;
-    cout << "   L2 Cache:     Size:" << config.cache.l2.size << "B\t\tAssoc:" << config.cache.l2.associativity << endl;
-    cout << "                 Block Size:" << config.cache.l2.block_size << "B\tWrite Policy:" 
+    if (config.cache.l1.replacement != "lru")
+        out << "                 Replacement:" << config.cache.l1.replacement << endl;
+    if (config.cache.l1.prefetcher != "none")
+        out << "                 Prefetcher:" << config.cache.l1.prefetcher << " (degree " << config.cache.l1.prefetch_degree << ")" << endl;
+    if (config.cache.l1.bypass != "none")
+        out << "                 Bypass:" << config.cache.l1.bypass << endl;
+    if (config.cache.l1.mshrs > 0)
+        out << "                 MSHRs:" << config.cache.l1.mshrs << endl;
+    out << "   L2 Cache:     Size:" << config.cache.l2.size << "B\t\tAssoc:" << config.cache.l2.associativity << endl;
+    out << "                 Block Size:" << config.cache.l2.block_size << "B\tWrite Policy:" 
          << (config.cache.l2.writeback ? "Write Back/Write Alloc" : "Write Through / No Write Alloc") << endl;
-    cout << "   L3 Cache:     Size:" << config.cache.l3.size << "B\t\tAssoc:" << config.cache.l3.associativity << endl;
-    cout << "                 Block Size:" << config.cache.l3.block_size << "B\tWrite Policy:" 
+    if (config.cache.l2.replacement != "lru")
+        out << "                 Replacement:" << config.cache.l2.replacement << endl;
+    if (config.cache.l2.prefetcher != "none")
+        out << "                 Prefetcher:" << config.cache.l2.prefetcher << " (degree " << config.cache.l2.prefetch_degree << ")" << endl;
+    if (config.cache.l2.bypass != "none")
+        out << "                 Bypass:" << config.cache.l2.bypass << endl;
+    if (config.cache.l2.mshrs > 0)
+        out << "                 MSHRs:" << config.cache.l2.mshrs << endl;
+    out << "   L3 Cache:     Size:" << config.cache.l3.size << "B\t\tAssoc:" << config.cache.l3.associativity << endl;
+    out << "                 Block Size:" << config.cache.l3.block_size << "B\tWrite Policy:" 
          << (config.cache.l3.writeback ? "Write Back/Write Alloc" : "Write Through / No Write Alloc") << endl;
-    cout << "-----------------------------------------------" << endl;
+    if (config.cache.l3.replacement != "lru")
+        out << "                 Replacement:" << config.cache.l3.replacement << endl;
+    if (config.cache.l3.prefetcher != "none")
+        out << "                 Prefetcher:" << config.cache.l3.prefetcher << " (degree " << config.cache.l3.prefetch_degree << ")" << endl;
+    if (config.cache.l3.bypass != "none")
+        out << "                 Bypass:" << config.cache.l3.bypass << endl;
+    if (config.cache.l3.mshrs > 0)
+        out << "                 MSHRs:" << config.cache.l3.mshrs << endl;
+    out << "-----------------------------------------------" << endl;
 }
 
 void RISCV_proc::shell()
 {   
     string shell_prompt = "RISCV-sim > ";
     string cmd;
-    cout << "Enter 'r' to run the loaded program, enter 'q' to quit" << endl;
+    out << "Enter 'r' to run the loaded program, enter 'q' to quit" << endl;
     while (1) {
-        cout << shell_prompt;
-        getline(cin, cmd);
+        out << shell_prompt;
+        if (!getline(in, cmd)) {   // EOF
+            out << endl;
+            break;
+        }
         if (cmd[0] == 'q') break;
         else if (cmd[0] == 'r') run_simulator();
         else status(cmd);
     }
 }
 
+void RISCV_proc::set_fast_mode(const string& cmd)
+{
+    stringstream ss(cmd.substr(1, cmd.size()));
+    string mode;
+    ss >> mode;
+    if (mode == "on") storage.SetFast(true);
+    else if (mode == "off") storage.SetFast(false);
+    else if (!mode.empty()) {
+        out << "Set memory model: \"f on\" (fast, functional) or \"f off\" (timed)." << endl;
+        return;
+    }
+    out << "Memory model: " << (storage.IsFast() ? "fast (functional)" : "timed") << endl;
+}
+
+// Reads the "if <reg> <op> <value>" and "hit <n>" options of a breakpoint
+static bool parse_break_options(stringstream &ss, Breakpoint &bp, ostream &out)
+{
+    static const char *ops[] = { "", "==", "!=", "<", "<=", ">", ">=" };
+    string word;
+    while (ss >> word) {
+        if (word == "if") {
+            string reg, op, value;
+            ss >> reg >> op >> value;
+            bp.cond_reg = -1;
+            for (int i = 0; i < 32; i++)
+                if (reg == R_NAMES[i] || reg == "x" + to_string(i)) bp.cond_reg = i;
+            bp.cond = BC_NONE;
+            for (int i = BC_EQ; i <= BC_GE; i++)
+                if (op == ops[i]) bp.cond = (BreakCond)i;
+            try {
+                bp.cond_value = stoll(value, 0, 0);
+            } catch (const logic_error &) {
+                bp.cond = BC_NONE;
+            }
+            if (bp.cond_reg < 0 || bp.cond == BC_NONE) {
+                out << "Error: breakpoint condition is \"if <register> <==|!=|<|<=|>|>=> <value>\"." << endl;
+                return false;
+            }
+            bp.literal += " if " + reg + " " + op + " " + value;
+        }
+        else if (word == "hit") {
+            long long n = 0;
+            if (!(ss >> n) || n < 1) {
+                out << "Error: breakpoint hit count must be at least 1." << endl;
+                return false;
+            }
+            bp.hit = n;
+            bp.literal += " hit " + to_string(n);
+        }
+        else {
+            out << "Error: unknown breakpoint option: " << word << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+void RISCV_proc::add_breakpoint(const Breakpoint &bp)
+{
+    breakpoints.push_back(bp);
+    bp_index[bp.addr].push_back(breakpoints.size() - 1);
+    bp_pages.insert(bp.addr / PGSIZE);
+    out << "Breakpoint [" << dec << breakpoints.size() << "] set at " << bp.literal << endl;
+}
+
 void RISCV_proc::set_breakpoint(const string& cmd)
 {
     if (cmd.size() <= 2) {
-        cout << "Set breakpoint: \"b [address]\" or \"b *[symbol]\"." << endl;
+        out << "Set breakpoint: \"b [address]\" or \"b *[symbol]\", then optionally" << endl;
+        out << "\"if [register] [==|!=|<|<=|>|>=] [value]\" and \"hit [n]\" (stop from the n-th time)." << endl;
         return;
     }
     size_t addr;
@@ -955,37 +1632,35 @@ void RISCV_proc::set_breakpoint(const string& cmd)
 
         if (get_symbol(addr_s, &psym)) {
             if (psym->type != STT_FUNC) {
-                cout << "Error: symbol type not allowed: " << addr_s << endl;
+                out << "Error: symbol type not allowed: " << addr_s << endl;
                 return;
             }
             addr = psym->value;
         }
         else {
-            cout << "Error: symbol not found: " << addr_s << endl;
+            out << "Error: symbol not found: " << addr_s << endl;
             return;
         }
         Breakpoint bp = Breakpoint(addr, "<"+addr_s+", 0x"+ dec2hex(addr)+">");
-        breakpoints.push_back(bp);
-        cout << "Breakpoint [" << dec << breakpoints.size() << "] set at " << bp.literal << endl;
+        if (parse_break_options(ss, bp, out)) add_breakpoint(bp);
     }
     else {
         ss << cmd.substr(2, cmd.size());
         ss >> addr_s;
         try {
             addr = ROUND_UP(stol(addr_s, 0, 0), sizeof(raw_inst_t));
-        } catch (invalid_argument) {
-            cout << "Error: Unidentified breakpoint address." << endl;
+        } catch (const logic_error &) {
+            out << "Error: Unidentified breakpoint address." << endl;
             return;
         }
-        if (addr < 0 || addr >= config.max_memory_addr) 
-            cout << "Breakpoint: address out of range." << endl;
+        if (addr >= config.max_memory_addr)
+            out << "Breakpoint: address out of range." << endl;
         else {
             if (!PG_ALLOC(pg_table[PAGE(addr)]) || !PG_EXEC(pg_table[PAGE(addr)]))
-                cout << "Breakpoint: address not executable, cannot set there." << endl;
+                out << "Breakpoint: address not executable, cannot set there." << endl;
             else {
                 Breakpoint bp = Breakpoint(addr, "<0x"+ dec2hex(addr)+">");
-                breakpoints.push_back(bp);
-                cout << "Breakpoint [" << dec << breakpoints.size() << "] set at " << bp.literal << endl;
+                if (parse_break_options(ss, bp, out)) add_breakpoint(bp);
             }
         }
     }
@@ -995,7 +1670,7 @@ void RISCV_proc::status(const string& cmd)
 {
     int bytes = sizeof(long long);
     if (cmd.size() <= 3) {
-        cout << "Unrecognized command: " << cmd << endl;
+        out << "Unrecognized command: " << cmd << endl;
         return;
     }
     if (cmd[3] == 'b') bytes = sizeof(char);
@@ -1008,20 +1683,21 @@ void RISCV_proc::status(const string& cmd)
             int reg_num;
             try {
                 reg_num = stoi(cmd.substr(5, cmd.size()), 0, 0);
-            } catch (invalid_argument) {
-                cout << "Error: Unidentified register number." << endl;
+            } catch (const logic_error &) {
+                out << "Error: Unidentified register number." << endl;
+                return;
             }
             if (reg_num < 0 || reg_num > 31)
-                cout << "Error: Wrong register number." << endl;
+                out << "Error: Wrong register number." << endl;
             else {
-                cout << dec << reg_num << "\t" << R_NAMES[reg_num] << ":\t";
-                cout << reg_format(reg_ulong[reg_num], bytes) << endl;   
+                out << dec << reg_num << "\t" << R_NAMES[reg_num] << ":\t";
+                out << reg_format(reg_ulong[reg_num], bytes) << endl;   
             }
         }
         else {
             for (int i = 0; i < 32; i++) {
-                cout << i << "\t" << R_NAMES[i] << ":\t";
-                cout << reg_format(reg_ulong[i], bytes) << endl;  
+                out << i << "\t" << R_NAMES[i] << ":\t";
+                out << reg_format(reg_ulong[i], bytes) << endl;  
             }
         }
     }
@@ -1029,7 +1705,7 @@ void RISCV_proc::status(const string& cmd)
         if (cmd.size() > 5 && cmd[4] == ' ') {
             stringstream ss;
             string addr_s;
-            size_t addr, count = 1;
+            size_t addr = 0, count = 1;
             REG dword;
 
             if (cmd[1] == 'm' && cmd[5] == '*') {    // addr in register
@@ -1038,12 +1714,12 @@ void RISCV_proc::status(const string& cmd)
                 ss >> addr_s >> count;
                 try {
                     reg_num = stol(addr_s, 0, 0);
-                } catch (invalid_argument) {
-                    cout << "Error: Unidentified register number." << endl;
+                } catch (const logic_error &) {
+                    out << "Error: Unidentified register number." << endl;
                     return;
                 }
                 if (reg_num < 0 || reg_num > 31) {
-                    cout << "Error: Wrong register number." << endl;
+                    out << "Error: Wrong register number." << endl;
                     return;
                 }
                 addr = reg_ulong[reg_num];
@@ -1053,8 +1729,8 @@ void RISCV_proc::status(const string& cmd)
                 ss >> addr_s >> count;
                 try {
                     addr = ROUND_DOWN(stol(addr_s, 0, 0), bytes ? bytes : sizeof(raw_inst_t));
-                } catch (invalid_argument) {
-                    cout << "Error: Unidentified memory address." << endl;
+                } catch (const logic_error &) {
+                    out << "Error: Unidentified memory address." << endl;
                     return;
                 }
             }
@@ -1065,34 +1741,34 @@ void RISCV_proc::status(const string& cmd)
 
                 if (get_symbol(addr_s, &psym)) {
                     if (psym->type != STT_OBJECT) {
-                        cout << "Error: Symbol type not allowed: " << addr_s << endl;
+                        out << "Error: Symbol type not allowed: " << addr_s << endl;
                         return;
                     }
                     addr = psym->value;
                 }
                 else {
-                    cout << "Error: Symbol not found: " << addr_s << endl;
+                    out << "Error: Symbol not found: " << addr_s << endl;
                     return;
                 }
             }
             for (size_t i = 0; i < count; i += (bytes ? bytes : 1)) {
-                if (addr < 0 || addr > config.max_memory_addr - bytes || 
+                if (addr > config.max_memory_addr - bytes ||
                     (bytes == 0 && addr > config.max_memory_addr - sizeof(raw_inst_t))) {
-                    cout << "Error: Memory address out of range." << endl;
+                    out << "Error: Memory address out of range." << endl;
                     break;
                 }
                 else if (!PG_ALLOC(pg_table[PAGE(addr)])) {
-                    cout << "Error: Address in unallocated page." << endl;
+                    out << "Error: Address in unallocated page." << endl;
                     break;
                 }
                 else {
-                    cout << dec2hex(addr, sizeof(size_t)) << ":\t";
+                    out << dec2hex(addr, sizeof(size_t)) << ":\t";
                     if (bytes == 0) {   // 'i'
                         if (!PG_EXEC(pg_table[PAGE(addr)])) {
-                            cout << "Error: Address not executable." << endl;
+                            out << "Error: Address not executable." << endl;
                             break;
                         }
-                        cout << RISCV_inst(memread<raw_inst_t>(addr)) << endl;
+                        out << RISCV_inst(memread<raw_inst_t>(addr)) << endl;
                         addr += sizeof(raw_inst_t);
                         continue;
                     }
@@ -1100,43 +1776,111 @@ void RISCV_proc::status(const string& cmd)
                     else if (bytes == sizeof(short)) dword = memread<short>(addr);
                     else if (bytes == sizeof(int)) dword = memread<int>(addr);
                     else if (bytes == sizeof(int64_t)) dword = memread<int64_t>(addr);
-                    cout << reg_format(dword, bytes) << endl;   
+                    out << reg_format(dword, bytes) << endl;   
                 }
                 addr += bytes;
             }
         }
     }
-    else cout << "Unrecognized command: " << cmd << endl;
+    else out << "Unrecognized command: " << cmd << endl;
     return;
 }
 
 void RISCV_proc::summary(bool finished)
 {
     if (finished)
-        cout << endl << "================SUMMARY================" << endl;
-    cout << "Total instructions executed: " << dec << inst_count << endl;
+        out << endl << "================SUMMARY================" << endl;
+    out << "Total instructions executed: " << dec << inst_count << endl;
+    out << "Decoded inst. cache: " << dec << decode_hit << " hits, " << decode_miss << " misses";
+    if (decode_hit + decode_miss)
+        out << " (" << fixed << setprecision(2) << 100 * (double)decode_hit / (decode_hit + decode_miss) << "% hit)";
+    out << endl;
+    out << "Software TLB: " << dec << tlb_hit << " hits, " << tlb_miss << " misses";
+    if (tlb_hit + tlb_miss)
+        out << " (" << fixed << setprecision(2) << 100 * (double)tlb_hit / (tlb_hit + tlb_miss) << "% hit)";
+    out << endl;
+#ifndef PIPE
+    if (!tb_map.empty())
+        out << "Translated blocks: " << tb_map.size() << endl;
+    if (jit_blocks)
+        out << "JIT compiled blocks: " << jit_blocks << " (" << jit_cache_used << " bytes)" << endl;
+#endif
 #ifdef PIPE
-    cout << "Total Execution time (CPU cycles): " << dec << pipe_cycle_count << endl;
+    size_t cycles = elapsed_cycles();
+    out << "Total Execution time (CPU cycles): " << dec << cycles << endl;
     if (finished) 
-        cout << "   CPI: " << fixed << setprecision(3) << (double)(pipe_cycle_count) / inst_count << endl << endl;
+        out << "   CPI: " << fixed << setprecision(3) << (double)cycles / inst_count << endl << endl;
+    if (nonblocking && harts.empty())
+        out << "Load-use stall cycles: " << dec << load_stall_cycles << endl;
+    size_t branches, mispredicts;
+    bpred_totals(branches, mispredicts);
+    out << "Branch predictor: " << bpred[0].name() << endl;
+    out << "   Conditional branches: " << dec << branches << "\tMispredicted: " << mispredicts;
+    if (branches)
+        out << " (" << fixed << setprecision(2) << 100 * (1 - (double)mispredicts / branches) << "% accuracy)";
+    out << endl;
+    out << "   MPKI: " << fixed << setprecision(3) << (inst_count ? 1000.0 * mispredicts / inst_count : 0)
+        << "\tMispredict penalty (CPU cycles): " << mispredicts * BPRED_PENALTY << endl << endl;
 #endif
-    if (finished) 
-        storage.PrintStats();
+    if (!harts.empty()) hart_summary();
+    if (finished) {
+        storage.PrintStats(out);
+        if (storage.GetDirectory()) sharing_summary();
+    }
+}
+
+void RISCV_proc::summary_json(const char *stop)
+{
+    out << "{" << endl;
+    out << "  \"stop\": \"" << stop << "\"," << endl;
+    if (flag_finished)
+        out << "  \"exit_code\": " << dec << (SREG)reg_ulong[R_A5] << "," << endl;
+    out << "  \"instructions\": " << dec << inst_count << "," << endl;
+    size_t cycles = elapsed_cycles();
+    out << "  \"cycles\": " << cycles << "," << endl;
+#ifdef PIPE
+    out << "  \"cpi\": " << fixed << setprecision(3) << (inst_count ? (double)cycles / inst_count : 0) << "," << endl;
+    if (nonblocking && harts.empty())
+        out << "  \"load_stall_cycles\": " << load_stall_cycles << "," << endl;
+    {
+        size_t branches, mispredicts;
+        bpred_totals(branches, mispredicts);
+        out << "  \"branch_predictor\": {\"kind\": \"" << bpred[0].name() << "\", \"branches\": " << branches
+            << ", \"mispredicts\": " << mispredicts << ", \"accuracy\": " << fixed << setprecision(4)
+            << (branches ? 1 - (double)mispredicts / branches : 0) << ", \"mpki\": " << setprecision(3)
+            << (inst_count ? 1000.0 * mispredicts / inst_count : 0) << ", \"penalty_cycles\": "
+            << mispredicts * BPRED_PENALTY << "}," << endl;
+    }
+#endif
+    if (!harts.empty()) hart_summary_json();
+    if (storage.GetDirectory()) sharing_summary_json();
+    out << "  \"decode_cache\": {\"hits\": " << decode_hit << ", \"misses\": " << decode_miss << "}," << endl;
+    out << "  \"tlb\": {\"hits\": " << tlb_hit << ", \"misses\": " << tlb_miss << "}," << endl;
+    storage.PrintStatsJSON(out);
+    out << endl << "}" << endl;
 }
 
 void RISCV_proc::exit()
 {
-    cout << "Exiting MarkYu's RISC-V simulator, bye!" << endl;
+    out << "Exiting MarkYu's RISC-V simulator, bye!" << endl;
 }
 
 PIPE_REG_D RISCV_proc::calc_reg_D()
 {
     PIPE_REG_D result;
+    access_op = kTraceFetch;
+    access_pc = reg_F.PC;
     raw_inst_t inst = memread<raw_inst_t>(reg_F.PC);
+    access_op = -1;
     result.inst = inst;
     result.PC = reg_F.PC;
 #ifndef PIPE
     reg_F.PC += sizeof(raw_inst_t);
+#else
+    if (OPCODE(inst) == 0x63) {
+        result.taken = bpred[hart].predict(reg_F.PC, SB_IMM(inst));
+        result.history = bpred[hart].global_history();
+    }
 #endif
     return result;
 }
@@ -1144,117 +1888,53 @@ PIPE_REG_D RISCV_proc::calc_reg_D()
 PIPE_REG_E RISCV_proc::calc_reg_E()
 {
     PIPE_REG_E result;
-    raw_inst_t raw_inst = reg_D.inst;
-    RISCV_inst riscv_inst = RISCV_inst(raw_inst);
+    const DECODED_INST &inst = decode_inst(reg_D.PC, reg_D.inst);
 #ifdef PIPE
     result.PC = reg_D.PC;
+    result.taken = reg_D.taken;
+    result.history = reg_D.history;
+    if (nonblocking) wait_for_loads(inst);
 #endif
-    result.opcode = OPCODE(riscv_inst.raw_inst);
-    result.funct3 = FUNCT3(riscv_inst.raw_inst);
-    switch (riscv_inst.type) {
-    case IT_R: {
-        const uint8_t &rs1 = riscv_inst.inst.inst_r.rs1;
-        const uint8_t &rs2 = riscv_inst.inst.inst_r.rs2;
-        const uint8_t &rd = riscv_inst.inst.inst_r.rd;
-        result.alu_func = (uint8_t)(riscv_inst.subtype.type_r);
-        result.rd = rd;
-        result.src1 = reg_ulong[rs1];
-        result.src2 = reg_ulong[rs2];
-#ifdef PIPE
-        if (rs1 && rs1 == reg_e.rd) result.src1 = DATA_FORWARD(reg_e); 
-        else if (rs1 && rs1 == reg_m.rd) result.src1 = DATA_FORWARD(reg_m);
-        if (rs2 && rs2 == reg_e.rd) result.src2 = DATA_FORWARD(reg_e); 
-        else if (rs2 && rs2 == reg_m.rd) result.src2 = DATA_FORWARD(reg_m);
-#endif
-    }   break;
-    case IT_I: {
-        const uint8_t &opcode = riscv_inst.inst.inst_i.opcode;
-        const uint8_t &rs1 = riscv_inst.inst.inst_i.rs1;
-        const I_INST_TYPE &type_i = riscv_inst.subtype.type_i;
-        result.rd = riscv_inst.inst.inst_i.rd;
-        result.src1 = reg_ulong[rs1];
-        result.src2 = riscv_inst.inst.inst_i.imm;
-        if (opcode == 0x03) result.alu_func = ALU_ADD;
-        else if (type_i == I_ADDI) result.alu_func = ALU_ADD;
-        else if (type_i == I_SLLI) result.alu_func = ALU_SLL;
-        else if (type_i == I_SLTI) result.alu_func = ALU_SLT;
-        else if (type_i == I_SLTIU) result.alu_func = ALU_SLTU;
-        else if (type_i == I_XORI) result.alu_func = ALU_XOR;
-        else if (type_i == I_SRLI) result.alu_func = ALU_SRL;
-        else if (type_i == I_SRAI) result.alu_func = ALU_SRA;
-        else if (type_i == I_ORI)  result.alu_func = ALU_OR;
-        else if (type_i == I_ANDI) result.alu_func = ALU_AND;
-        else if (type_i == I_ADDIW) result.alu_func = ALU_ADDW;
-        else if (type_i == I_SLLIW) result.alu_func = ALU_SLLW;
-        else if (type_i == I_SRLIW) result.alu_func = ALU_SRLW;
-        else if (type_i == I_SRAIW) result.alu_func = ALU_SRAW;
-        else if (type_i == I_JALR) { result.alu_func = ALU_ADD; result.val = reg_D.PC + sizeof(raw_inst_t); }
-        else if (type_i == I_ECALL) { 
-            result.src1 = reg_ulong[R_A0]; result.src2 = reg_ulong[R_A7]; 
-            result.alu_func = ALU_NOP; result.rd = R_A5;
-        }
-        else result.alu_func = ALU_NOP;
-#ifdef PIPE
-        if (rs1 && rs1 == reg_e.rd) result.src1 = DATA_FORWARD(reg_e); 
-        else if (rs1 && rs1 == reg_m.rd) result.src1 = DATA_FORWARD(reg_m);
-        if (type_i == I_ECALL) {
-            if (reg_e.rd == R_A0) result.src1 = DATA_FORWARD(reg_e); 
-            else if (reg_m.rd == R_A0) result.src1 = DATA_FORWARD(reg_m); 
-            if (reg_e.rd == R_A7) result.src2 = DATA_FORWARD(reg_e); 
-            else if (reg_m.rd == R_A7) result.src2 = DATA_FORWARD(reg_m); 
-        }
-#endif
-    }   break;
-    case IT_S: {
-        const uint8_t &rs1 = riscv_inst.inst.inst_s.rs1;
-        const uint8_t &rs2 = riscv_inst.inst.inst_s.rs2;
-        result.val = reg_ulong[rs2];
-        result.src1 = reg_ulong[rs1];
-        result.src2 = riscv_inst.inst.inst_s.imm;
-#ifdef PIPE
-        if (rs1 && rs1 == reg_e.rd) result.src1 = DATA_FORWARD(reg_e); 
-        else if (rs1 && rs1 == reg_m.rd) result.src1 = DATA_FORWARD(reg_m);
-        if (rs2 && rs2 == reg_e.rd) result.val = DATA_FORWARD(reg_e); 
-        else if (rs2 && rs2 == reg_m.rd) result.val = DATA_FORWARD(reg_m);
-#endif
-        if (riscv_inst.subtype.type_s != S_UNIMP) result.alu_func = ALU_ADD;
-        else result.alu_func = ALU_NOP;
-    }   break;
+    result.opcode = inst.opcode;
+    result.funct3 = inst.funct3;
+    result.alu_func = inst.alu_func;
+    result.rd = inst.rd;
+    switch (inst.type) {
+    case IT_R:
+        result.src1 = read_reg(inst.rs1);
+        result.src2 = read_reg(inst.rs2);
+        break;
+    case IT_I:
+        result.src1 = read_reg(inst.rs1);
+        if (inst.subtype == I_ECALL) result.src2 = read_reg(inst.rs2);
+        else result.src2 = inst.imm;
+        if (inst.subtype == I_JALR) result.val = reg_D.PC + sizeof(raw_inst_t);
+        break;
+    case IT_S:
+        result.val = read_reg(inst.rs2);
+        result.src1 = read_reg(inst.rs1);
+        result.src2 = inst.imm;
+        break;
     case IT_SB: {
-        const SB_INST_TYPE &type_sb = riscv_inst.subtype.type_sb;
-        const uint8_t &rs1 = riscv_inst.inst.inst_sb.rs1;
-        const uint8_t &rs2 = riscv_inst.inst.inst_sb.rs2;
         result.src1 = reg_D.PC;
-        result.src2 = riscv_inst.inst.inst_sb.imm;
-        result.alu_func = ALU_ADD;
-        REG r1 = reg_ulong[rs1], r2 = reg_ulong[rs2];
-#ifdef PIPE
-        if (rs1 && rs1 == reg_e.rd) r1 = DATA_FORWARD(reg_e); 
-        else if (rs1 && rs1 == reg_m.rd) r1 = DATA_FORWARD(reg_m);
-        if (rs2 && rs2 == reg_e.rd) r2 = DATA_FORWARD(reg_e); 
-        else if (rs2 && rs2 == reg_m.rd) r2 = DATA_FORWARD(reg_m);
-#endif
-        if (type_sb == SB_BEQ) result.cond = (r1 == r2);
-        else if (type_sb == SB_BNE) result.cond = (r1 != r2);
-        else if (type_sb == SB_BLT) result.cond = ((SREG)r1 < (SREG)r2);
-        else if (type_sb == SB_BGE) result.cond = ((SREG)r1 >= (SREG)r2);
-        else if (type_sb == SB_BLTU) result.cond = (r1 < r2);
-        else if (type_sb == SB_BGEU) result.cond = (r1 >= r2);
-    }   break;
-    case IT_U: {
-        const U_INST_TYPE &type_u = riscv_inst.subtype.type_u;
-        result.rd = riscv_inst.inst.inst_u.rd;
-        result.alu_func = ALU_ADD;
-        result.src1 = (type_u == U_AUPIC) ? reg_D.PC : 0;
-        result.src2 = riscv_inst.inst.inst_u.imm;
+        result.src2 = inst.imm;
+        REG r1 = read_reg(inst.rs1), r2 = read_reg(inst.rs2);
+        if (inst.subtype == SB_BEQ) result.cond = (r1 == r2);
+        else if (inst.subtype == SB_BNE) result.cond = (r1 != r2);
+        else if (inst.subtype == SB_BLT) result.cond = ((SREG)r1 < (SREG)r2);
+        else if (inst.subtype == SB_BGE) result.cond = ((SREG)r1 >= (SREG)r2);
+        else if (inst.subtype == SB_BLTU) result.cond = (r1 < r2);
+        else if (inst.subtype == SB_BGEU) result.cond = (r1 >= r2);
     }   break;
-    case IT_UJ: {
-        result.rd = riscv_inst.inst.inst_u.rd;
-        result.alu_func = ALU_ADD;
+    case IT_U:
+        result.src1 = (inst.subtype == U_AUPIC) ? reg_D.PC : 0;
+        result.src2 = inst.imm;
+        break;
+    case IT_UJ:
         result.src1 = reg_D.PC;
-        result.src2 = riscv_inst.inst.inst_u.imm;
+        result.src2 = inst.imm;
         result.val = reg_D.PC + sizeof(raw_inst_t);
-    }   break;
+        break;
     }
     return result;
 }
@@ -1268,21 +1948,14 @@ PIPE_REG_M RISCV_proc::calc_reg_M()
     result.opcode = reg_E.opcode;
     result.funct3 = reg_E.funct3;
     if (reg_E.opcode == 0x73) { // ECALL
-        // cout << "SYSCALL" << endl;
+        // out << "SYSCALL" << endl;
         result.res = reg_E.src1;
         result.val = reg_E.src2;
     }
     else {
         result.res = alu_calc(reg_E.src1, reg_E.src2, reg_E.alu_func);
         result.val = reg_E.val;
-        if (reg_E.alu_func >= ALU_MUL && reg_E.alu_func <= ALU_MULHU)
-            pipe_cycle_count += config.latency.mul - 1;
-        else if (reg_E.alu_func >= ALU_DIV && reg_E.alu_func <= ALU_REMU)
-            pipe_cycle_count += config.latency.div - 1;
-        else if (reg_E.alu_func == ALU_MULW)
-            pipe_cycle_count += config.latency.mulw - 1;
-        else if (reg_E.alu_func >= ALU_DIVW && reg_E.alu_func <= ALU_REMUW)
-            pipe_cycle_count += config.latency.divw - 1;
+        pipe_cycle_count += alu_stall(reg_E.alu_func);
     }
     result.rd = reg_E.rd;
     result.cond = reg_E.cond;
@@ -1300,6 +1973,14 @@ PIPE_REG_W RISCV_proc::calc_reg_W()
     REG val = reg_M.val;
     result.rd = reg_M.rd;
     result.cond = reg_M.cond;
+    access_op = kTraceRead;
+#ifdef PIPE
+    access_pc = reg_M.PC;
+    posted = nonblocking && (reg_M.opcode == 0x03 || reg_M.opcode == 0x23);
+    posted_time = 0;
+#else
+    access_pc = reg_D.PC;
+#endif
     if (reg_M.opcode == 0x03) {
         if (reg_M.funct3 == 0x0) result.res = REG(SREG(memread<char>(res)));
         else if (reg_M.funct3 == 0x1) result.res = REG(SREG(memread<short>(res)));
@@ -1319,5 +2000,11 @@ PIPE_REG_W RISCV_proc::calc_reg_W()
         result.val = val;
         result.res = res;
     }
+    access_op = -1;
+#ifdef PIPE
+    if (posted && reg_M.opcode == 0x03 && reg_M.rd != R_ZERO)
+        reg_ready[reg_M.rd] = pipe_cycle_count + posted_time;
+    posted = false;
+#endif
     return result;
 }
\ No newline at end of file
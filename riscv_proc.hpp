@@ -4,12 +4,20 @@
 #include <elfio/elfio.hpp>
 #include <cache/cache.h>
 #include <cache/memory.h>
+#include <cache/coherence.h>
+#include <cache/tracefile.h>
 #include <riscv_isa.hpp>
 #include <riscv_config.hpp>
 #include <string>
 #include <sstream>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #define PGSIZE      4096
 #define PTE_P       0x1
@@ -22,6 +30,16 @@
 
 #define STACK_ALIGN 1024
 
+#define MAX_HARTS   16
+#define HART_STACK  (8 << 20)   // Stack of hart i starts i * HART_STACK below hart 0's
+
+#define DECODE_CACHE_SIZE   4096    // Entries of the pre-decoded inst. cache, power of 2
+#define DECODE_IDX(PC)      (((PC) / sizeof(raw_inst_t)) & (DECODE_CACHE_SIZE - 1))
+
+#define TLB_SIZE            64      // Entries of the software TLB, power of 2
+#define TLB_IDX(vaddr)      (((vaddr) / PGSIZE) & (TLB_SIZE - 1))
+#define TLB_INVALID         (~(size_t)0)
+
 #define ALU_ADD     0
 #define ALU_SUB     1
 #define ALU_SLL     2
@@ -60,6 +78,9 @@
 #define SYS_SBRK    6       // Extend heap for malloc
 #define SYS_HEAP_LO 7
 #define SYS_HEAP_HI 8
+#define SYS_HART_ID 9       // This hart's number, from 0
+#define SYS_HARTS   10      // Number of harts
+#define SYS_BARRIER 11      // Wait until every running hart arrives
 #define SYS_EXIT    93
 
 #ifdef PIPE
@@ -76,6 +97,14 @@ typedef struct {
 } pte_t;
 typedef std::map<size_t, pte_t> pgtb_t;    // PageTable
 
+// Direct-mapped cache of pg_table lookups. Map nodes never move, so pte stays
+// valid until the entry is removed from pg_table
+typedef struct {
+    size_t vpage = TLB_INVALID;
+    pte_t *pte = nullptr;
+    char *host = nullptr;       // Page in host memory, null if not allocated
+} tlb_entry_t;
+
 enum PipeControl { PCTRL_NORMAL, PCTRL_STALL, PCTRL_BUBBLE };
 
 static size_t ROUND_UP(size_t bytes, size_t ALIGN)
@@ -92,32 +121,167 @@ std::string dec2hex(size_t i);
 std::string dec2hex(size_t i, size_t bytes);
 REG alu_calc(REG src1, REG src2, unsigned ALU_FUNC);
 
+// Caches and memory of all harts: L1 and L2 are private to each hart, L3
+// and memory are shared. Requests go through the hart set by SetHart().
 class CachedStorage {
 public:
     CachedStorage() {
         memory.SetPGSize(PGSIZE);
-        L1.SetLower(&L2);
-        L2.SetLower(&L3);
+        for (int i = 0; i < MAX_HARTS; i++) {
+            L1[i].SetLower(&L2[i]);
+            L2[i].SetLower(&L3);
+        }
         L3.SetLower(&memory);
+        harts = 1;
+        hart = 0;
+        fast = tag_only = coherent = false;
         ClearStats();
     }
     ~CachedStorage() {}
     void ClearStats();
-    void PrintStats();
+    void PrintStats(std::ostream &out);
+    // The same stats as one JSON object member per level
+    void PrintStatsJSON(std::ostream &out);
+    // Stats of L1, L2 (summed over the harts) and L3
+    void GetStats(StorageStats stats[3]);
+    // Stats of the private L1 and L2 of hart h
+    void GetHartStats(int h, StorageStats stats[2]);
+    // Checkpoints: line state of L1, L2 and L3
+    void SaveCaches(std::vector<char> state[3]) const;
+    bool LoadCaches(const std::vector<char> state[3]);
+    // Dirty lines of all levels, L3 first so the newest copy comes last
+    template<class F> void ForEachDirty(F f) const {
+        L3.ForEachDirty(f);
+        for (int i = 0; i < harts; i++) {
+            L2[i].ForEachDirty(f); L1[i].ForEachDirty(f);
+        }
+    }
     void flush();
+    void SetFast(bool fast);
+    void SetTagOnly(bool tag_only);
+    bool IsFast() const { return fast; }
     void reset_memory() { memory.reset(); }
+    // Number of harts, takes effect with the following SetConfig
+    void SetHarts(int harts) { this->harts = harts; }
+    void SetHart(int hart) { this->hart = hart; }
+    // MESI directory between the harts' L2 and the L3, takes effect with the
+    // following SetConfig
+    void SetCoherence(bool coherent) { this->coherent = coherent; }
+    // The directory, null when the harts' caches are not kept coherent
+    const Directory *GetDirectory() const { return coherent && harts > 1 ? &directory : nullptr; }
     void SetConfig(CacheConfig cc1, CacheConfig cc2, CacheConfig cc3);
+    void SetPC(size_t pc) { L1[hart].SetPC(pc); }
+    void SetCycle(size_t cycle) { L1[hart].SetCycle(cycle); }
+    // Some prefetcher or bypass policy needs the PC of data accesses
+    bool UsesPC() const { return L1[0].UsesPC() || L2[0].UsesPC() || L3.UsesPC(); }
     void SetLatency(StorageLatency ltc1, StorageLatency ltc2, StorageLatency ltc3, StorageLatency ltcm);
     void free_page(size_t addr) { memory.free_page(addr); }
     size_t alloc_page() { return memory.alloc_page(); }
+    char *HostPage(size_t addr) { return memory.GetPage(addr); }
+    // Functional access through a host pointer from HostPage()
+    void FastAccess(char *host, int bytes, int read, char *content) {
+        if (read) memcpy(content, host, bytes);
+        else if (content) memcpy(host, content, bytes);
+        else memset(host, 0, bytes);
+        fast_accesses++;
+    }
     void HandleRequest(size_t addr, int bytes, int read,
                        char *content, int &time);
 private:
-    void StatsInfo(const StorageStats &s, bool ismem);
-    Cache L1, L2, L3;
+    void StatsInfo(std::ostream &out, const StorageStats &s, bool ismem, const Cache *cache = nullptr);
+    Cache L1[MAX_HARTS], L2[MAX_HARTS], L3;
     Memory memory;
+    int harts, hart;
+    bool fast;              // Functional mode: requests go straight to memory
+    size_t fast_accesses;
+    bool tag_only;          // Caches track tags only, memory holds all data
+    bool coherent;
+    Directory directory;
 };
 
+#define TRACE_BUF_RECORDS   (1 << 16)   // Records handed to the trace writer at once
+#define TRACE_MAX_PENDING   16          // Full buffers queued before recording blocks
+
+// Memory access trace in the cache-sim binary format. Records are batched
+// and encoded/written by a background thread.
+class TraceCapture {
+public:
+    TraceCapture() : running(false) {}
+    ~TraceCapture() { close(); }
+    bool open(const std::string &path);
+    void record(uint8_t op, size_t addr, size_t size, REG pc) {
+        TraceRecord r;
+        r.op = op; r.addr = addr; r.size = size; r.pc = pc;
+        buf.push_back(r);
+        if (buf.size() == TRACE_BUF_RECORDS) hand_off();
+    }
+    void close();
+    bool is_open() const { return running; }
+    uint64_t records() const { return writer.Records(); }
+    uint64_t bytes() const { return writer.Bytes(); }
+private:
+    void hand_off();
+    void write_loop();
+    TraceWriter writer;
+    std::vector<TraceRecord> buf;
+    std::deque<std::vector<TraceRecord> > pending;
+    std::mutex lock;
+    std::condition_variable cv;
+    std::thread thread;
+    bool running, done;
+};
+
+#ifdef PIPE
+// Direction predictors of conditional branches for the pipeline, one per
+// hart. Branches are predicted at fetch and the predictor learns their
+// outcome when they resolve in E (riscv_bpred.cpp).
+enum BPredKind { BP_NEVER, BP_ALWAYS, BP_BTFNT, BP_FTBNT, BP_BIMODAL, BP_GSHARE, BP_TOURNAMENT, BP_TAGE };
+
+#define BPRED_PENALTY   2       // Cycles of a misprediction, D and E are flushed
+
+class BranchPredictor {
+public:
+    BranchPredictor() : branches(0), mispredicts(0), kind(BP_NEVER), history(0), updates(0) {}
+    // The predictor named by config.branch_prediction with the table sizes
+    // of config.predictor. False when the name is unknown, never taken is used.
+    bool init(const Config &config);
+    const char *name() const;
+    int kind_of() const { return kind; }
+    bool predict(REG pc, int imm) const;
+    // The global history predict() uses now, kept with the branch until it resolves
+    uint64_t global_history() const { return history; }
+    // The branch at pc resolved, predicted was the prediction it was fetched
+    // with and hist the global history at that time
+    void update(REG pc, uint64_t hist, bool taken, bool predicted);
+    size_t branches, mispredicts;
+
+private:
+    struct TageEntry {
+        uint16_t tag = 0;
+        int8_t ctr = 0;             // 3-bit signed, taken when >= 0
+        uint8_t u = 0;              // 2-bit useful counter
+    };
+    size_t bimodal_index(REG pc) const;
+    size_t gshare_index(REG pc, uint64_t hist) const;
+    size_t tage_index(REG pc, uint64_t hist, int t) const;
+    uint16_t tage_tag(REG pc, uint64_t hist, int t) const;
+    // The matching tagged table with the longest history (-1 if none), and
+    // the next one in alt
+    int tage_lookup(REG pc, uint64_t hist, int &alt) const;
+    bool tage_predict(REG pc, uint64_t hist) const;
+    void tage_update(REG pc, uint64_t hist, bool taken);
+
+    int kind;
+    int table_bits, history_bits;
+    uint64_t history;               // Outcomes of the latest branches, newest in bit 0
+    std::vector<uint8_t> bimodal, gshare, chooser;  // 2-bit counters
+    int tage_bits, tag_bits;
+    std::vector<int> lengths;       // History length of each tagged table
+    std::vector<std::vector<TageEntry> > tage;
+    size_t updates;
+};
+#endif
+
 struct PIPE_REG_F {
     REG PC;
     PIPE_REG_F() { PC = 0; }
@@ -126,7 +290,13 @@ struct PIPE_REG_F {
 struct PIPE_REG_D {
     raw_inst_t inst;
     REG PC;
+#ifdef PIPE
+    bool taken;                 // Branch predicted taken at fetch
+    uint64_t history;           // Global history of that prediction
+    PIPE_REG_D() { inst = PC = 0; taken = false; history = 0; }
+#else
     PIPE_REG_D() { inst = PC = 0; }
+#endif
 };
 
 struct PIPE_REG_E {
@@ -135,7 +305,9 @@ struct PIPE_REG_E {
     REG src1, src2, val;
 #ifdef PIPE
     REG PC;
-    PIPE_REG_E() { alu_func = ALU_NOP; rd = opcode = funct3 = 0; cond = false; src1 = src2 = val = PC = 0; }
+    bool taken;
+    uint64_t history;
+    PIPE_REG_E() { alu_func = ALU_NOP; rd = opcode = funct3 = 0; cond = taken = false; src1 = src2 = val = PC = 0; history = 0; }
 #endif
 };
 
@@ -156,9 +328,95 @@ struct PIPE_REG_W {
 #ifdef PIPE
     REG PC;
     PIPE_REG_W() { rd = opcode = 0; cond = false; res = val = PC = 0; }
+    // Where the program continues after this instruction
+    REG next_PC() const {
+        if (opcode == 0x67 || opcode == 0x6f || (opcode == 0x63 && cond)) return res;
+        return PC + sizeof(raw_inst_t);
+    }
 #endif
 };
 
+// Fully resolved instruction, cached by PC so that decoding happens only once
+struct DECODED_INST {
+    bool valid;
+    size_t PC;
+    INST_TYPE type;
+    uint8_t subtype, opcode, funct3, alu_func, rd, rs1, rs2;
+    REG imm;
+    DECODED_INST() { valid = false; PC = 0; }
+};
+
+// Registers, pipeline and counters of a hart, saved while other harts run
+// (riscv_hart.cpp). Memory, page table and the decoded/translated code are
+// shared by all harts.
+struct HART_CONTEXT {
+    REG regs[32];
+    PIPE_REG_F F;
+    PIPE_REG_D D;
+    PIPE_REG_E E;
+    PIPE_REG_M M;
+    PIPE_REG_W W;
+#ifdef PIPE
+    PipeControl ctrl_F, ctrl_D, ctrl_E, ctrl_M, ctrl_W;
+    uint8_t mispred;
+    size_t reg_ready[32];
+    size_t load_stall_cycles;
+#endif
+    size_t insts, cycles;
+    size_t barrier_cycles;      // Spent waiting for the other harts at barriers
+    bool finished, waiting;     // waiting: at a barrier
+    HART_CONTEXT() { insts = cycles = barrier_cycles = 0; finished = waiting = false; }
+};
+
+#define TB_MAX_INSTS    64      // Max instructions in one translated block
+#ifndef PIPE
+#define JIT_THRESHOLD   64      // Interpreted runs before a block is compiled
+#define JIT_CACHE_SIZE  (16 << 20)  // Bytes of executable memory for compiled blocks
+
+enum ExecEngine { ENGINE_STAGE, ENGINE_THREADED, ENGINE_JIT };
+#endif
+
+// Handler kinds of the threaded interpreter, the first ones follow ALU_ADD ... ALU_SUBW
+enum TB_KIND {
+    TB_ADD, TB_SUB, TB_SLL, TB_SLT, TB_SLTU, TB_XOR, 
+    TB_SRL, TB_SRA, TB_OR, TB_AND, TB_ADDW, TB_SUBW,
+    TB_ALU, TB_LI,
+    TB_LB, TB_LH, TB_LW, TB_LD, TB_LBU, TB_LHU, TB_LWU,     // funct3 order
+    TB_SB, TB_SH, TB_SW, TB_SD,                             // funct3 order
+    TB_BEQ, TB_BNE, TB_BLT, TB_BGE, TB_BLTU, TB_BGEU,       // SB_INST_TYPE order
+    TB_JAL, TB_JALR, TB_ECALL, 
+    TB_STAGE, TB_STAGE_JUMP,    // Run through the stages (rare or sp-writing insts)
+    TB_EXIT,                    // Fall through to the next block
+    TB_NUM_KINDS
+};
+
+struct TB_BLOCK;
+struct TB_OP {
+    const void *handler;        // Label in the dispatch loop, bound on first execution
+    uint8_t kind, alu_func;
+    raw_inst_t raw_inst;
+    REG *rd;
+    const REG *rs1, *rs2;       // rs2 points to imm for register-immediate insts
+    REG imm, PC;                // imm holds the target address for branches and jumps
+    TB_BLOCK *target;           // Last JALR target
+};
+
+struct TB_BLOCK {
+    REG PC, end;                // Covers guest addresses [PC, end)
+    size_t len;                 // Number of guest instructions
+    bool bound;
+    std::vector<TB_OP> ops;
+    TB_BLOCK *next[2];          // Chained successors: taken, fall-through
+    size_t exec_count;          // Interpreted runs, for the JIT
+    void *native;               // Compiled x86-64 code, see riscv_jit.cpp
+};
+
+#ifndef PIPE
+class RISCV_proc;
+// Compiled block: returns the next guest PC, stores the instructions done in *done
+typedef REG (*JIT_FUNC)(REG *regs, RISCV_proc *proc, size_t *done);
+#endif
+
 struct ELF_SYMBOL {
     uint8_t bind, type, other;
     unsigned idx;
@@ -172,15 +430,23 @@ struct ELF_SYMBOL {
                ELFIO::Elf_Half section_index, std::string name);
 };
 
+enum BreakCond { BC_NONE, BC_EQ, BC_NE, BC_LT, BC_LE, BC_GT, BC_GE };
+
 struct Breakpoint {
     bool activated;
     size_t addr;
     std::string literal;
+    BreakCond cond;                         // Stop only if reg <cond> value (signed)
+    int cond_reg;
+    SREG cond_value;
+    size_t hit, hits;                       // Stop from the hit-th time the condition holds
 
     void enable() { activated = true; }
     void disable() { activated = false; }
+    // Counts a pass with the registers regs, true if it stops there
+    bool check(const REG *regs);
     Breakpoint(size_t addr, std::string literal) : addr(addr), literal(literal) 
-    { activated = true; }
+    { activated = true; cond = BC_NONE; cond_reg = 0; cond_value = 0; hit = 1; hits = 0; }
 };
 
 class RISCV_proc {
@@ -189,10 +455,43 @@ public:
     bool set_entry_symbol(const std::string &symbol);
     bool set_entry_addr(size_t addr);
 
-    RISCV_proc(const ELFIO::elfio &reader, const Config &config);
+    // The shell reads input and everything is printed to output, so several
+    // simulators can run side by side
+    RISCV_proc(const ELFIO::elfio &reader, const Config &config,
+               std::istream &input = std::cin, std::ostream &output = std::cout);
     ~RISCV_proc();
 
     void start();
+    // Runs the program once without the shell and returns its exit code.
+    // max_insts/max_cycles: stop early when reached (0: no limit).
+    // json: print the summary as JSON instead of text
+    int run_batch(size_t max_insts, size_t max_cycles, bool json);
+    // Batch run that simulates warmup + detail instructions in detail out of
+    // every period and fast-forwards the rest (riscv_sample.cpp)
+    int run_sampled(size_t period, size_t warmup, size_t detail, size_t max_insts, bool json);
+#ifndef PIPE
+    // Writes the basic block vector of every interval instructions to path
+    // (riscv_simpoint.cpp)
+    int run_bbv(const std::string &path, size_t interval);
+    // Clusters a BBV file into simulation points and checkpoints each of
+    // them warmup instructions ahead, listed in <bbv_path>.simpoints
+    int run_simpoint(const std::string &bbv_path, size_t interval, size_t warmup, int clusters);
+#endif
+    // Simulates the points of a .simpoints file and combines them by weight
+    int run_simpoints(const std::string &list_path, bool json);
+    // Capture the memory accesses of every run to path
+    void set_trace_file(const std::string &path) { trace_path = path; }
+    // Start every run from this checkpoint instead of the ELF entry point
+    void set_restore_file(const std::string &path) { restore_path = path; }
+    // Batch mode: save a checkpoint where the run stops, with the cache state if caches
+    void set_save_file(const std::string &path, bool caches) { save_path = path; save_caches = caches; }
+    // Drop the loading and configuration messages
+    void set_quiet(bool quiet) {
+        this->quiet = quiet;
+        info.rdbuf(quiet ? nullptr : out.rdbuf());
+    }
+    // Send what the program prints to this buffer instead of the output
+    void set_console(std::streambuf *buf) { console.rdbuf(buf); }
 
 private:
     const Config &config;
@@ -201,19 +500,74 @@ private:
     std::vector<ELF_SYMBOL> symtab;
 
     Breakpoint* curbp;
-    std::vector<Breakpoint> breakpoints;
+    std::deque<Breakpoint> breakpoints;     // Numbered from 1, never move
+    // Breakpoints by PC, looked up only on the pages in bp_pages
+    std::unordered_map<REG, std::vector<size_t> > bp_index;
+    std::unordered_set<REG> bp_pages;
     bool flag_finished, flag_break;
+    bool flag_barrier;                      // The hart stopped at a barrier (flag_finished is set too)
     size_t entry_addr, entry_offset;
     size_t heap, heap_base;
     std::string entry_literal;
     std::stringstream inputstream;
+    bool quiet;
+    std::istream in;                        // Shell commands and program input
+    std::ostream out;                       // Shell, messages and summaries
+    std::ostream console;                   // Program output, out unless set_console()
+    std::ostream info;                      // Loading messages, out unless quiet
 
     size_t inst_count, pipe_cycle_count;
+    size_t decode_hit, decode_miss;
+    std::vector<DECODED_INST> decode_cache;
+
+    // Threaded interpreter (riscv_tb.cpp), riscv-sim-pipe fast-forwards with it
+    bool tb_flush;                          // Translated code is stale
+    REG tb_sink;                            // Write target for rd == zero
+    std::unordered_map<REG, TB_BLOCK*> tb_map;
+    TB_BLOCK* tb_lookup(REG PC);
+    TB_BLOCK* tb_translate(REG PC);
+    bool tb_breakpoint(const TB_BLOCK *tb);
+    size_t tb_run(TB_BLOCK *tb, size_t budget, bool chain);
+    void tb_clear();
+    void execute_threaded(size_t steps);
+    void tb_stage(const TB_OP *op);
+    void tb_ecall();
+#ifndef PIPE
+    void step();
+
+    ExecEngine engine;
+    char *jit_cache;                        // Executable code cache (mmap)
+    size_t jit_cache_used, jit_blocks;
+    bool jit_compile(TB_BLOCK *tb);
+    size_t jit_run(TB_BLOCK *tb, size_t budget);
+    void set_engine(const std::string& cmd);
+    static void jit_load(RISCV_proc *proc, TB_OP *op);
+    static int jit_store(RISCV_proc *proc, TB_OP *op);
+    static void jit_alu(RISCV_proc *proc, TB_OP *op);
+    static void jit_ecall(RISCV_proc *proc, TB_OP *op);
+    static REG jit_stage(RISCV_proc *proc, TB_OP *op);
+#endif
 
     pgtb_t pg_table;
+    tlb_entry_t tlb[TLB_SIZE];
+    size_t tlb_hit, tlb_miss;
+    tlb_entry_t& tlb_lookup(size_t vaddr);
+    void tlb_invalidate();
     REG reg_ulong[32];
     CachedStorage storage; // Contains 3-level caches and memory
 
+    TraceCapture trace;
+    std::string trace_path;
+    std::string restore_path, save_path;
+    bool save_caches;
+    // riscv_checkpoint.cpp
+    bool save_checkpoint(const std::string &path, bool caches);
+    bool restore_checkpoint(const std::string &path);
+    void checkpoint_command(const std::string &cmd);
+    // Access being made by the stages, for the trace and the PC-indexed prefetchers
+    int access_op;          // TraceOp (kTraceRead for loads and stores), -1 otherwise
+    REG access_pc;
+
 #ifdef F_EXT
     REG reg_float[32];
 #endif
@@ -234,23 +588,71 @@ private:
     uint8_t mispred;
     void clock_tick();
     void set_pipe_control();
-    REG predict_PC(REG thisPC, int imm);
     PIPE_REG_F select_PC();
+    std::vector<BranchPredictor> bpred;     // One per hart
+    void bpred_totals(size_t &branches, size_t &mispredicts) const;
+
+    // Non-blocking loads (L1 with MSHRs): a load leaves M without waiting
+    // for its data, and the first instruction using the register stalls in
+    // D until the data arrives. Stores are posted.
+    bool nonblocking, posted;
+    size_t posted_time;                     // Cycles of the access being posted
+    size_t reg_ready[32];                   // Cycle the pending load of each register completes
+    size_t load_stall_cycles;
+    void wait_for_loads(const DECODED_INST &inst);
 #endif 
+    void memory_time(int time);
     void reset_cache();
     void print_config();
 
     void read_memory(char *buf, size_t vaddr, size_t len);
-    void write_memory(char *buf, size_t vaddr, size_t len, uint8_t flags); 
+    void write_memory(char *buf, size_t vaddr, size_t len, uint8_t flags = 0);
+    // Reads memory itself, past the TLB, caches and trace. Current only while
+    // no cache holds a dirty copy, e.g. right after loading.
+    void peek_memory(char *buf, size_t vaddr, size_t len);
     void alloc_page(size_t vaddr, uint8_t flags);
 
     template<typename T> T memread(size_t vaddr);
     template<typename T> void memwrite(size_t vaddr, T val);
     std::string read_string(size_t addr);
 
+    const DECODED_INST& decode_inst(size_t PC, raw_inst_t raw_inst);
+    void invalidate_code(size_t vaddr, size_t len);
+    REG read_reg(uint8_t rs);
+    size_t alu_stall(uint8_t alu_func);
+
     void load_memory();
     bool get_symbol(const std::string &symbol, ELF_SYMBOL** psym);
     void execute(size_t steps);
+    void execute_hart(size_t steps);
+    bool run_insts(size_t n);
+    bool fast_forward(size_t n);
+
+    // riscv_hart.cpp: with config.harts > 1, execute() switches between the
+    // harts every config.quantum instructions
+    std::vector<HART_CONTEXT> harts;        // Empty when running a single hart
+    size_t hart;                            // The hart in the registers
+    void start_harts();
+    void save_hart();
+    void load_hart(size_t h);
+    int pick_hart();
+    bool release_barrier();
+    size_t elapsed_cycles();
+    void hart_summary();
+    void hart_summary_json();
+    // Coherence misses per cache block and per symbol, with the MESI directory
+    std::vector<std::pair<REG, CoherenceBlockStats> > sharing_blocks();
+    std::string block_symbols(REG addr, size_t size);
+    void sharing_summary();
+    void sharing_summary_json();
+    bool hit_breakpoint(REG pc);
+    // Breakpoints set at pc, null when none. One page lookup for most PCs.
+    const std::vector<size_t> *breakpoints_at(REG pc) const {
+        if (!bp_pages.count(pc / PGSIZE)) return nullptr;
+        auto it = bp_index.find(pc);
+        return it == bp_index.end() ? nullptr : &it->second;
+    }
+    void add_breakpoint(const Breakpoint &bp);
     void clear_pg_table();
     void clear_regs();
 
@@ -265,14 +667,39 @@ private:
     PIPE_REG_M calc_reg_M();
     PIPE_REG_W calc_reg_W();
 
+    bool start_run();
+    void finish_run();
     void run_simulator();
+    void summary_json(const char *stop);
     void set_breakpoint(const std::string& cmd);
+    void set_fast_mode(const std::string& cmd);
     void status(const std::string& cmd);
     void summary(bool finished = false);
     void shell();
     void exit();
 };
 
+template<typename T> T RISCV_proc::memread(size_t vaddr)
+{
+    if (!vaddr) return 0;
+    T res;
+    read_memory((char *)&res, vaddr, sizeof(T));
+    return res;
+}
+
+template<typename T> void RISCV_proc::memwrite(size_t vaddr, T val)
+{
+    write_memory((char *)&val, vaddr, sizeof(T));
+}
+
+// Program and config checks before a run, 0 or the exit code to give up with
+int check_elf(const ELFIO::elfio &reader, std::ostream &info, std::ostream &out);
+int check_config(const Config &config, std::ostream &out);
+
+// Runs the jobs of a manifest in up to workers processes at once, one JSON
+// line per job appended to results as they finish (riscv_jobs.cpp)
+int run_manifest(const std::string &path, int workers, const std::string &results);
+
 #ifndef PIPE    // SEQ
 #endif
 
@@ -0,0 +1,148 @@
+#include <riscv_proc.hpp>
+#include <iomanip>
+#include <math.h>
+using namespace std;
+
+// SMARTS-style sampled simulation. Every period of instructions ends with
+//   warm-up    timed execution whose results are discarded, refilling the
+//              caches that fast-forwarding left empty
+//   detail     timed execution that is measured
+// and the rest of the period is fast-forwarded in functional mode. CPI and
+// miss rates are averaged over the detail windows, with a 95% confidence
+// interval from their spread (normal approximation, so use 30+ samples).
+// Functional mode empties the caches, so every warm-up starts cold and has
+// to be long enough to refill them. riscv-sim-pipe keeps its branch predictor
+// trained while fast-forwarding.
+
+#define SAMPLE_Z    1.96    // 95% confidence
+
+struct SampleMean {
+    size_t n = 0;
+    double sum = 0, sum2 = 0;
+    void add(double x) { n++; sum += x; sum2 += x * x; }
+    double mean() const { return n ? sum / n : 0; }
+    // Half width of the confidence interval of the mean
+    double error() const {
+        if (n < 2) return 0;
+        double var = (sum2 - sum * sum / n) / (n - 1);
+        return SAMPLE_Z * sqrt(max(var, 0.0) / n);
+    }
+};
+
+// Runs up to n more instructions, false when the program finished first
+bool RISCV_proc::run_insts(size_t n)
+{
+    size_t end = inst_count + n;
+    while (!flag_finished && inst_count < end) execute(end - inst_count);
+    return !flag_finished;
+}
+
+// Runs up to n more instructions in functional mode, false when the program
+// finished first. riscv-sim-pipe runs a single hart with the threaded
+// interpreter: the instruction in W completes, the younger ones are dropped
+// and the pipeline refills from the next PC when timed execution resumes.
+// A trace being captured needs the accesses of the stages.
+bool RISCV_proc::fast_forward(size_t n)
+{
+    if (!n) return !flag_finished;      // Leaves the caches warm
+    storage.SetFast(true);
+#ifdef PIPE
+    if (harts.empty() && !trace.is_open()) {
+        size_t end = inst_count + n;
+        if (!reg_W.PC) execute_hart(1);     // Still filling after a restore
+        writeback();
+        reg_F.PC = reg_W.next_PC();
+        reg_D = PIPE_REG_D(); reg_E = PIPE_REG_E(); reg_M = PIPE_REG_M(); reg_W = PIPE_REG_W();
+        reg_e = PIPE_REG_M(); reg_m = PIPE_REG_W();
+        memset(reg_ready, 0, sizeof(reg_ready));
+        if (!flag_finished && inst_count < end) execute_threaded(end - inst_count);
+        reg_D = PIPE_REG_D(); reg_E = PIPE_REG_E(); reg_M = PIPE_REG_M(); reg_W = PIPE_REG_W();
+        set_pipe_control();
+        storage.SetFast(false);
+        return !flag_finished;
+    }
+#endif
+    bool running = run_insts(n);
+    storage.SetFast(false);
+    return running;
+}
+
+int RISCV_proc::run_sampled(size_t period, size_t warmup, size_t detail, size_t max_insts, bool json)
+{
+    if (period < warmup + detail || detail == 0) {
+        out << "Sampling period must hold the warm-up and a non-empty detail window" << endl;
+        return -1;
+    }
+    if (config.fast_mode) {
+        out << "Sampling needs the timed memory model, fast_mode is set" << endl;
+        return -1;
+    }
+    load_prog();
+    if (!quiet) print_config();
+    if (!start_run()) return -1;
+
+    // Every hart's clock runs only for its own instructions, so CPI is per hart
+    auto hart_cycles = [this]() {
+        if (harts.empty()) return pipe_cycle_count;
+        save_hart();
+        size_t cycles = 0;
+        for (auto &c : harts) cycles += c.cycles;
+        return cycles;
+    };
+    static const char *names[3] = { "l1", "l2", "l3" };
+    SampleMean cpi, miss[3];
+    size_t detailed = 0;
+    while (!flag_finished && (!max_insts || inst_count < max_insts)) {
+        if (!fast_forward(period - warmup - detail)) break;
+        if (!run_insts(warmup)) break;
+
+        StorageStats before[3], after[3];
+        storage.GetStats(before);
+        size_t insts = inst_count, cycles = hart_cycles();
+        bool complete = run_insts(detail);
+        storage.GetStats(after);
+        if (!complete) break;   // Cut short by the program exit
+        insts = inst_count - insts;
+        cycles = hart_cycles() - cycles;
+        detailed += insts;
+        cpi.add((double)cycles / insts);
+        for (int i = 0; i < 3; i++) {
+            size_t accesses = after[i].access_counter - before[i].access_counter;
+            if (accesses) miss[i].add((double)(after[i].miss_num - before[i].miss_num) / accesses);
+        }
+    }
+    finish_run();
+
+    if (json) {
+        out << "{" << endl;
+        out << "  \"stop\": \"" << (flag_finished ? "exit" : "max_insts") << "\"," << endl;
+        if (flag_finished)
+            out << "  \"exit_code\": " << dec << (SREG)reg_ulong[R_A5] << "," << endl;
+        out << "  \"instructions\": " << dec << inst_count << "," << endl;
+        out << "  \"samples\": " << cpi.n << "," << endl;
+        out << "  \"detailed_instructions\": " << detailed << "," << endl;
+        out << fixed << setprecision(6);
+        out << "  \"cpi\": {\"mean\": " << cpi.mean() << ", \"error\": " << cpi.error() << "}," << endl;
+        out << "  \"miss_rate\": {";
+        for (int i = 0; i < 3; i++)
+            out << (i ? ", " : "") << "\"" << names[i] << "\": {\"mean\": " << miss[i].mean()
+                 << ", \"error\": " << miss[i].error() << ", \"samples\": " << miss[i].n << "}";
+        out << "}" << endl << "}" << endl;
+    } else {
+        out << endl << "================SAMPLING================" << endl;
+        if (flag_finished)
+            out << "Program exited with code: " << dec << reg_ulong[R_A5] << endl;
+        out << "Total instructions executed: " << dec << inst_count << endl;
+        out << "Samples: " << cpi.n << " (period " << period << ", warm-up " << warmup
+             << ", detail " << detail << " instructions)" << endl;
+        out << "Detailed instructions: " << detailed << " (" << fixed << setprecision(2)
+             << (inst_count ? 100 * (double)detailed / inst_count : 0) << "%)" << endl;
+        out << "CPI: " << setprecision(3) << cpi.mean() << " +/- " << cpi.error() << " (95% confidence, "
+             << setprecision(2) << (cpi.mean() ? 100 * cpi.error() / cpi.mean() : 0) << "%)" << endl;
+        out << "   Estimated execution time (CPU cycles): " << setprecision(0) << cpi.mean() * inst_count / max(harts.size(), (size_t)1) << endl;
+        for (int i = 0; i < 3; i++)
+            out << "L" << i + 1 << " miss rate: " << setprecision(2) << 100 * miss[i].mean() << "% +/- "
+                 << 100 * miss[i].error() << "%" << endl;
+    }
+    return flag_finished ? (int)reg_ulong[R_A5] : 0;
+}
@@ -0,0 +1,320 @@
+#include <riscv_proc.hpp>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <random>
+#include <math.h>
+using namespace std;
+
+// SimPoint-style phase selection, in three batch runs:
+//   --bbv       profile: one basic block vector per interval of instructions,
+//               each block counted with the instructions it executed
+//   --simpoint  cluster the vectors with k-means, write the representative
+//               interval of each cluster and its weight to <bbv>.simpoints,
+//               and checkpoint the program --warmup instructions before each
+//   --simrun    restore every checkpoint, simulate the warm-up and the
+//               interval, and combine the intervals by weight
+// BBV files use the SimPoint text format ("T:<block>:<count> ..." per
+// interval, blocks numbered from 1 by first execution).
+
+#define BBV_DIMS        15      // Random projection of the vectors, as SimPoint
+#define KMEANS_SEEDS    5       // Clusterings tried, the tightest is kept
+#define KMEANS_ITERS    100
+
+#ifndef PIPE
+int RISCV_proc::run_bbv(const string &path, size_t interval)
+{
+    if (config.harts > 1) {
+        out << "BBV profiling follows a single hart, set harts to 1" << endl;
+        return -1;
+    }
+    ofstream file(path);
+    if (!file) {
+        out << "Cannot open BBV file " << path << endl;
+        return -1;
+    }
+    load_prog();
+    if (!quiet) print_config();
+    if (!start_run()) return -1;
+    storage.SetFast(true);      // Profiling needs no timing
+
+    unordered_map<REG, size_t> ids;
+    map<size_t, size_t> bbv;    // Block id -> instructions in this interval
+    size_t intervals = 0, len = 0, left = interval;
+    REG block = reg_F.PC;
+    auto count = [&]() {
+        if (len == 0) return;
+        auto it = ids.emplace(block, ids.size() + 1).first;
+        bbv[it->second] += len;
+        len = 0;
+    };
+    auto dump = [&]() {
+        count();
+        if (bbv.empty()) return;
+        file << "T";
+        for (auto &b : bbv) file << ":" << b.first << ":" << b.second << " ";
+        file << endl;
+        bbv.clear();
+        intervals++;
+    };
+    while (!flag_finished) {
+        REG pc = reg_F.PC;
+        if (!PG_EXEC(pg_table[PAGE(pc)])) {
+            out << "Fatal: PC Encountered unexecutable memory address! Execution stopped." << endl;
+            break;
+        }
+        step();
+        inst_count++;
+        len++;
+        uint8_t opcode = OPCODE(reg_D.inst);
+        if (opcode == 0x63 || opcode == 0x67 || opcode == 0x6f || opcode == 0x73 ||
+            reg_F.PC != pc + sizeof(raw_inst_t)) {
+            count();
+            block = reg_F.PC;
+        }
+        if (--left == 0) {  // The block in progress continues in the next interval
+            dump();
+            left = interval;
+        }
+    }
+    dump();
+    storage.SetFast(false);
+    finish_run();
+    out << "BBV: " << dec << intervals << " intervals of " << interval << " instructions, "
+         << ids.size() << " basic blocks, " << inst_count << " instructions written to " << path << endl;
+    return flag_finished ? (int)reg_ulong[R_A5] : 0;
+}
+
+// Normalized, randomly projected vectors from a BBV file, insts: their total length
+static vector<vector<double> > read_bbv(const string &path, size_t &insts)
+{
+    ifstream in(path);
+    string line;
+    vector<vector<pair<size_t, double> > > raw;
+    insts = 0;
+    while (getline(in, line)) {
+        if (line.empty() || line[0] != 'T') continue;
+        vector<pair<size_t, double> > v;
+        double total = 0;
+        stringstream ss(line.substr(1));
+        char colon;
+        size_t id, n;
+        while (ss >> colon >> id >> colon >> n) {
+            v.push_back(make_pair(id, (double)n));
+            total += n;
+        }
+        for (auto &b : v) b.second /= total;
+        insts += total;
+        raw.push_back(v);
+    }
+    mt19937_64 rng(1);
+    uniform_real_distribution<double> dist(-1, 1);
+    unordered_map<size_t, vector<double> > proj;   // Projection row per block
+    vector<vector<double> > points;
+    for (auto &v : raw) {
+        vector<double> p(BBV_DIMS, 0);
+        for (auto &b : v) {
+            auto it = proj.find(b.first);
+            if (it == proj.end()) {
+                vector<double> row(BBV_DIMS);
+                for (auto &x : row) x = dist(rng);
+                it = proj.emplace(b.first, row).first;
+            }
+            for (int d = 0; d < BBV_DIMS; d++) p[d] += b.second * it->second[d];
+        }
+        points.push_back(p);
+    }
+    return points;
+}
+
+static double dist2(const vector<double> &a, const vector<double> &b)
+{
+    double s = 0;
+    for (size_t d = 0; d < a.size(); d++) s += (a[d] - b[d]) * (a[d] - b[d]);
+    return s;
+}
+
+// k-means with k-means++ seeding, returns the cluster of each point
+static vector<int> kmeans(const vector<vector<double> > &points, int k, vector<vector<double> > &centers)
+{
+    size_t n = points.size();
+    vector<int> best;
+    double best_sse = INFINITY;
+    for (int seed = 0; seed < KMEANS_SEEDS; seed++) {
+        mt19937_64 rng(seed + 1);
+        vector<vector<double> > c(1, points[rng() % n]);
+        vector<double> d(n);
+        while ((int)c.size() < k) {
+            double total = 0;
+            for (size_t i = 0; i < n; i++) {
+                d[i] = INFINITY;
+                for (auto &ci : c) d[i] = min(d[i], dist2(points[i], ci));
+                total += d[i];
+            }
+            double r = uniform_real_distribution<double>(0, total)(rng);
+            size_t i = 0;
+            for (; i + 1 < n && r > d[i]; i++) r -= d[i];
+            c.push_back(points[i]);
+        }
+        vector<int> cluster(n, -1);
+        double sse = 0;
+        for (int iter = 0; iter < KMEANS_ITERS; iter++) {
+            bool moved = false;
+            sse = 0;
+            for (size_t i = 0; i < n; i++) {
+                int bc = 0;
+                double bd = INFINITY;
+                for (int j = 0; j < k; j++) {
+                    double dj = dist2(points[i], c[j]);
+                    if (dj < bd) { bd = dj; bc = j; }
+                }
+                moved |= cluster[i] != bc;
+                cluster[i] = bc;
+                sse += bd;
+            }
+            if (!moved) break;
+            // An empty cluster keeps its previous center
+            vector<size_t> size(k, 0);
+            vector<vector<double> > sum(k, vector<double>(BBV_DIMS, 0));
+            for (size_t i = 0; i < n; i++) {
+                size[cluster[i]]++;
+                for (int dd = 0; dd < BBV_DIMS; dd++) sum[cluster[i]][dd] += points[i][dd];
+            }
+            for (int j = 0; j < k; j++)
+                if (size[j])
+                    for (int dd = 0; dd < BBV_DIMS; dd++) c[j][dd] = sum[j][dd] / size[j];
+        }
+        if (sse < best_sse) {
+            best_sse = sse;
+            best = cluster;
+            centers = c;
+        }
+    }
+    return best;
+}
+
+int RISCV_proc::run_simpoint(const string &bbv_path, size_t interval, size_t warmup, int clusters)
+{
+    size_t insts;
+    vector<vector<double> > points = read_bbv(bbv_path, insts);
+    if (points.empty()) {
+        out << "No intervals in BBV file " << bbv_path << endl;
+        return -1;
+    }
+    int k = min((size_t)clusters, points.size());
+    vector<vector<double> > centers;
+    vector<int> cluster = kmeans(points, k, centers);
+
+    // The interval closest to each center represents its cluster
+    vector<pair<size_t, double> > simpoints;    // Interval, weight
+    for (int j = 0; j < k; j++) {
+        size_t members = 0, pick = 0;
+        double bd = INFINITY;
+        for (size_t i = 0; i < points.size(); i++) {
+            if (cluster[i] != j) continue;
+            members++;
+            double d = dist2(points[i], centers[j]);
+            if (d < bd) { bd = d; pick = i; }
+        }
+        if (members) simpoints.push_back(make_pair(pick, (double)members / points.size()));
+    }
+    sort(simpoints.begin(), simpoints.end());
+
+    // Fast-forward to each checkpoint
+    load_prog();
+    if (!quiet) print_config();
+    if (!start_run()) return -1;
+    storage.SetFast(true);
+    string list_path = bbv_path + ".simpoints";
+    ofstream list(list_path);
+    list << "# simpoints " << insts << " " << interval << " " << warmup << endl;
+    for (auto &sp : simpoints) {
+        size_t start = sp.first * interval;
+        size_t at = start > warmup ? start - warmup : 0;
+        if (at > inst_count && !run_insts(at - inst_count)) break;
+        string ckpt = bbv_path + "." + to_string(sp.first) + ".ckpt";
+        if (!save_checkpoint(ckpt, false)) return -1;
+        list << sp.first << " " << fixed << setprecision(6) << sp.second << " "
+             << (start - at) << " " << ckpt << endl;
+    }
+    storage.SetFast(false);
+    finish_run();
+    out << "SimPoint: " << dec << simpoints.size() << " simulation points from " << points.size()
+         << " intervals written to " << list_path << endl;
+    return 0;
+}
+#endif
+
+// Simulates the intervals of a .simpoints file from their checkpoints
+int RISCV_proc::run_simpoints(const string &list_path, bool json)
+{
+    ifstream list(list_path);
+    string line, tag;
+    size_t total = 0, interval = 0, warmup = 0;
+    if (!getline(list, line) || !(stringstream(line) >> tag >> tag >> total >> interval >> warmup)) {
+        out << list_path << " is not a simpoints file" << endl;
+        return -1;
+    }
+    load_prog();
+    if (!quiet) print_config();
+    if (!start_run()) return -1;
+
+    static const char *names[3] = { "l1", "l2", "l3" };
+    double cpi = 0, miss[3] = {}, weights = 0;
+    size_t points = 0, detailed = 0;
+    while (getline(list, line)) {
+        size_t index, lead;
+        double weight;
+        string ckpt;
+        if (!(stringstream(line) >> index >> weight >> lead >> ckpt)) continue;
+        if (!restore_checkpoint(ckpt)) return -1;
+        run_insts(lead);    // Warm-up
+        StorageStats before[3], after[3];
+        storage.GetStats(before);
+        size_t insts = inst_count, cycles = pipe_cycle_count;
+        run_insts(interval);
+        storage.GetStats(after);
+        insts = inst_count - insts;
+        cycles = pipe_cycle_count - cycles;
+        if (insts == 0) continue;
+        double point_cpi = (double)cycles / insts;
+        info << "Interval " << dec << index << " (weight " << fixed << setprecision(4) << weight
+             << "): CPI " << setprecision(3) << point_cpi << endl;
+        cpi += weight * point_cpi;
+        for (int i = 0; i < 3; i++) {
+            size_t accesses = after[i].access_counter - before[i].access_counter;
+            if (accesses) miss[i] += weight * (after[i].miss_num - before[i].miss_num) / accesses;
+        }
+        weights += weight;
+        detailed += insts;
+        points++;
+    }
+    finish_run();
+    if (weights > 0) {      // Intervals cut short by the program exit
+        cpi /= weights;
+        for (auto &m : miss) m /= weights;
+    }
+
+    if (json) {
+        out << "{" << endl;
+        out << "  \"simpoints\": " << dec << points << "," << endl;
+        out << "  \"instructions\": " << total << "," << endl;
+        out << "  \"detailed_instructions\": " << detailed << "," << endl;
+        out << fixed << setprecision(6);
+        out << "  \"cpi\": " << cpi << "," << endl;
+        out << "  \"miss_rate\": {";
+        for (int i = 0; i < 3; i++)
+            out << (i ? ", " : "") << "\"" << names[i] << "\": " << miss[i];
+        out << "}" << endl << "}" << endl;
+    } else {
+        out << endl << "================SIMPOINTS================" << endl;
+        out << "Simulation points: " << dec << points << " (interval " << interval << ", warm-up "
+             << warmup << " instructions)" << endl;
+        out << "Detailed instructions: " << detailed << " of " << total << endl;
+        out << "Weighted CPI: " << fixed << setprecision(3) << cpi << endl;
+        out << "   Estimated execution time (CPU cycles): " << setprecision(0) << cpi * total << endl;
+        for (int i = 0; i < 3; i++)
+            out << "L" << i + 1 << " miss rate: " << setprecision(2) << 100 * miss[i] << "%" << endl;
+    }
+    return 0;
+}
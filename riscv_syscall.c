@@ -52,4 +52,22 @@ char read_c()
 {
     asm("li a7, 5");
     asm("ecall");
-}
\ No newline at end of file
+}
+
+long hart_id()
+{
+    asm("li a7, 9");
+    asm("ecall");
+}
+
+long num_harts()
+{
+    asm("li a7, 10");
+    asm("ecall");
+}
+
+void barrier()
+{
+    asm("li a7, 11");
+    asm("ecall");
+}
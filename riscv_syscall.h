@@ -12,5 +12,8 @@ void *      mem_heap_lo();
 void *      mem_heap_hi();
 long long   read_i();
 char        read_c();
+long        hart_id();
+long        num_harts();
+void        barrier();
 
 #endif // RISCV_SYSCALL_H
\ No newline at end of file
@@ -0,0 +1,350 @@
+#include <riscv_proc.hpp>
+#include <iostream>
+#include <stdint.h>
+using namespace std;
+
+// Threaded-code interpreter for the SEQ core.
+// Guest code is split into basic blocks ending at a branch, jump or ecall. Each
+// block is translated once into an array of TB_OPs whose operands are pointers
+// into the register file, and is then run by a computed-goto dispatch loop that
+// chains directly into successor blocks. Data accesses still go through
+// memread/memwrite (and the caches), instruction fetch is only done at
+// translation time.
+// riscv-sim-pipe runs it to fast-forward sampled simulation, past the pipeline
+// registers and with the branch predictor trained at every block end.
+
+#ifdef PIPE
+#define TB_CYCLES   1       // Cycles per instruction: the pipeline without stalls
+#else
+#define TB_CYCLES   5       // Cycles per instruction: one per SEQ stage
+#endif
+
+void RISCV_proc::tb_clear()
+{
+    for (auto &it : tb_map) delete it.second;
+    tb_map.clear();
+    tb_flush = false;
+#ifndef PIPE
+    jit_cache_used = 0;
+#endif
+}
+
+TB_BLOCK* RISCV_proc::tb_lookup(REG PC)
+{
+    auto it = tb_map.find(PC);
+    if (it != tb_map.end()) return it->second;
+    auto pte = pg_table.find(PAGE(PC));
+    if (pte == pg_table.end() || !PG_EXEC(pte->second)) return nullptr;
+    TB_BLOCK *tb = tb_translate(PC);
+    tb_map[PC] = tb;
+    return tb;
+}
+
+TB_BLOCK* RISCV_proc::tb_translate(REG PC)
+{
+    TB_BLOCK *tb = new TB_BLOCK;
+    tb->PC = PC;
+    tb->bound = false;
+    tb->next[0] = tb->next[1] = nullptr;
+    tb->exec_count = 0;
+    tb->native = nullptr;
+
+    REG pc = PC;
+    bool stop = false;
+    while (!stop) {
+        raw_inst_t raw_inst = memread<raw_inst_t>(pc);
+        const DECODED_INST &inst = decode_inst(pc, raw_inst);
+        TB_OP op;
+        op.kind = TB_STAGE;
+        op.alu_func = inst.alu_func;
+        op.raw_inst = raw_inst;
+        op.rd = inst.rd ? &reg_ulong[inst.rd] : &tb_sink;
+        op.rs1 = &reg_ulong[inst.rs1];
+        op.rs2 = &reg_ulong[inst.rs2];
+        op.imm = inst.imm;
+        op.PC = pc;
+        op.target = nullptr;
+
+        switch (inst.opcode) {
+        case 0x33: case 0x3b:   // R-type ALU
+        case 0x13: case 0x1b:   // I-type ALU
+            if (inst.alu_func <= ALU_SUBW) op.kind = inst.alu_func;
+            else if (inst.alu_func != ALU_NOP) op.kind = TB_ALU;
+            if (inst.type == IT_I) op.rs2 = nullptr;
+            break;
+        case 0x03:  // LXX
+            if (inst.subtype <= I_LWU) op.kind = TB_LB + inst.funct3;
+            break;
+        case 0x23:  // SXX
+            if (inst.subtype != S_UNIMP) op.kind = TB_SB + inst.funct3;
+            break;
+        case 0x63:  // BXX
+            if (inst.subtype != SB_UNIMP) op.kind = TB_BEQ + inst.subtype;
+            else op.kind = TB_STAGE_JUMP;
+            op.imm = pc + inst.imm;
+            stop = true;
+            break;
+        case 0x6f:  // JAL
+            op.kind = TB_JAL;
+            op.imm = pc + inst.imm;
+            stop = true;
+            break;
+        case 0x67:  // JALR
+            op.kind = (inst.subtype == I_JALR) ? TB_JALR : TB_STAGE_JUMP;
+            stop = true;
+            break;
+        case 0x73:  // ECALL
+            op.kind = (inst.subtype == I_ECALL) ? TB_ECALL : TB_STAGE_JUMP;
+            stop = true;
+            break;
+        case 0x17: case 0x37:   // AUIPC, LUI
+            op.kind = TB_LI;
+            op.imm = (inst.subtype == U_AUPIC ? pc : 0) + inst.imm;
+            break;
+        }
+        // Writes to sp allocate stack pages in writeback()
+        if (inst.rd == R_SP && op.kind != TB_STAGE)
+            op.kind = stop ? TB_STAGE_JUMP : TB_STAGE;
+        tb->ops.push_back(op);
+
+        pc += sizeof(raw_inst_t);
+        if (tb->ops.size() == TB_MAX_INSTS || PAGE(pc) != PAGE(PC)) break;
+    }
+    tb->end = pc;
+    tb->len = tb->ops.size();
+    if (!stop) {
+        TB_OP op;
+        op.kind = TB_EXIT;
+        op.PC = pc;
+        tb->ops.push_back(op);
+    }
+    // Operand pointers into ops are only stable once the vector is complete
+    for (auto &op : tb->ops)
+        if (op.kind != TB_EXIT && op.rs2 == nullptr) op.rs2 = &op.imm;
+    return tb;
+}
+
+// True if an enabled breakpoint lies inside tb after its first instruction
+bool RISCV_proc::tb_breakpoint(const TB_BLOCK *tb)
+{
+    if (bp_pages.empty()) return false;
+    for (REG pc = tb->PC + sizeof(raw_inst_t); pc < tb->end; pc += sizeof(raw_inst_t))
+        if (const vector<size_t> *at = breakpoints_at(pc))
+            for (size_t i : *at)
+                if (breakpoints[i].activated) return true;
+    return false;
+}
+
+// Runs tb and, if chain is set, its successors for at most budget instructions.
+// Returns the number of guest instructions executed, reg_F.PC is the next PC.
+size_t RISCV_proc::tb_run(TB_BLOCK *tb, size_t budget, bool chain)
+{
+    static const void *handlers[TB_NUM_KINDS] = {
+        &&do_add, &&do_sub, &&do_sll, &&do_slt, &&do_sltu, &&do_xor,
+        &&do_srl, &&do_sra, &&do_or, &&do_and, &&do_addw, &&do_subw,
+        &&do_alu, &&do_li,
+        &&do_lb, &&do_lh, &&do_lw, &&do_ld, &&do_lbu, &&do_lhu, &&do_lwu,
+        &&do_sb, &&do_sh, &&do_sw, &&do_sd,
+        &&do_beq, &&do_bne, &&do_blt, &&do_bge, &&do_bltu, &&do_bgeu,
+        &&do_jal, &&do_jalr, &&do_ecall,
+        &&do_stage, &&do_stage_jump,
+        &&do_exit
+    };
+    size_t n = 0;
+    int succ;           // Successor slot in tb->next, -1 for indirect jumps
+    REG next_pc;
+    TB_OP *op;
+
+#define DISPATCH()  goto *op->handler
+#define NEXT()      do { op++; DISPATCH(); } while (0)
+#define TAKEN()     do { next_pc = op->imm; succ = 0; goto block_end; } while (0)
+#define NOT_TAKEN() do { next_pc = op->PC + sizeof(raw_inst_t); succ = 1; goto block_end; } while (0)
+
+enter:
+    if (!tb->bound) {
+        for (auto &o : tb->ops) o.handler = handlers[o.kind];
+        tb->bound = true;
+    }
+    op = tb->ops.data();
+    DISPATCH();
+
+do_add:  *op->rd = (SREG)*op->rs1 + (SREG)*op->rs2; NEXT();
+do_sub:  *op->rd = (SREG)*op->rs1 - (SREG)*op->rs2; NEXT();
+do_sll:  *op->rd = *op->rs1 << (*op->rs2 & 0x3f); NEXT();
+do_slt:  *op->rd = ((SREG)*op->rs1 < (SREG)*op->rs2) ? 1 : 0; NEXT();
+do_sltu: *op->rd = (*op->rs1 < *op->rs2) ? 1 : 0; NEXT();
+do_xor:  *op->rd = *op->rs1 ^ *op->rs2; NEXT();
+do_srl:  *op->rd = *op->rs1 >> (*op->rs2 & 0x3f); NEXT();
+do_sra:  *op->rd = REG((SREG(*op->rs1)) >> (*op->rs2 & 0x3f)); NEXT();
+do_or:   *op->rd = *op->rs1 | *op->rs2; NEXT();
+do_and:  *op->rd = *op->rs1 & *op->rs2; NEXT();
+do_addw: *op->rd = REG(SREG(int(*op->rs1 + *op->rs2))); NEXT();
+do_subw: *op->rd = REG(SREG(int(*op->rs1 - *op->rs2))); NEXT();
+do_alu:
+    *op->rd = alu_calc(*op->rs1, *op->rs2, op->alu_func);
+    pipe_cycle_count += alu_stall(op->alu_func);
+    NEXT();
+do_li:   *op->rd = op->imm; NEXT();
+
+do_lb:  *op->rd = REG(SREG(memread<char>(*op->rs1 + op->imm))); NEXT();
+do_lh:  *op->rd = REG(SREG(memread<short>(*op->rs1 + op->imm))); NEXT();
+do_lw:  *op->rd = REG(SREG(memread<int>(*op->rs1 + op->imm))); NEXT();
+do_ld:  *op->rd = REG(SREG(memread<int64_t>(*op->rs1 + op->imm))); NEXT();
+do_lbu: *op->rd = REG(memread<uint8_t>(*op->rs1 + op->imm)); NEXT();
+do_lhu: *op->rd = REG(memread<uint16_t>(*op->rs1 + op->imm)); NEXT();
+do_lwu: *op->rd = REG(memread<uint32_t>(*op->rs1 + op->imm)); NEXT();
+
+do_sb: memwrite(*op->rs1 + op->imm, char(*op->rs2 & 0xff)); goto store_done;
+do_sh: memwrite(*op->rs1 + op->imm, short(*op->rs2 & 0xffff)); goto store_done;
+do_sw: memwrite(*op->rs1 + op->imm, int(*op->rs2 & 0xffffffff)); goto store_done;
+do_sd: memwrite(*op->rs1 + op->imm, SREG(*op->rs2)); goto store_done;
+store_done:
+    if (tb_flush) {     // Self-modifying code, leave before running stale ops
+        n += op - tb->ops.data() + 1;
+        pipe_cycle_count += TB_CYCLES * (op - tb->ops.data() + 1);
+        reg_F.PC = op->PC + sizeof(raw_inst_t);
+        return n;
+    }
+    NEXT();
+
+do_beq:  if (*op->rs1 == *op->rs2) TAKEN(); NOT_TAKEN();
+do_bne:  if (*op->rs1 != *op->rs2) TAKEN(); NOT_TAKEN();
+do_blt:  if ((SREG)*op->rs1 < (SREG)*op->rs2) TAKEN(); NOT_TAKEN();
+do_bge:  if ((SREG)*op->rs1 >= (SREG)*op->rs2) TAKEN(); NOT_TAKEN();
+do_bltu: if (*op->rs1 < *op->rs2) TAKEN(); NOT_TAKEN();
+do_bgeu: if (*op->rs1 >= *op->rs2) TAKEN(); NOT_TAKEN();
+
+do_jal:
+    *op->rd = op->PC + sizeof(raw_inst_t);
+    TAKEN();
+do_jalr:
+    next_pc = (SREG)*op->rs1 + (SREG)op->imm;
+    *op->rd = op->PC + sizeof(raw_inst_t);
+    succ = -1;
+    goto block_end;
+
+do_ecall:
+    tb_ecall();
+    NOT_TAKEN();
+
+do_stage:
+    tb_stage(op);
+    NEXT();
+do_stage_jump:
+    tb_stage(op);
+    next_pc = reg_F.PC;
+    succ = -1;
+    goto block_end;
+
+do_exit:
+    next_pc = op->PC;
+    succ = 1;
+    goto block_end;
+
+block_end:
+#ifdef PIPE
+    if (op->kind >= TB_BEQ && op->kind <= TB_BGEU) {
+        BranchPredictor &bp = bpred[hart];
+        bp.update(op->PC, bp.global_history(), succ == 0, bp.predict(op->PC, op->imm - op->PC));
+    }
+#endif
+    n += tb->len;
+    pipe_cycle_count += TB_CYCLES * tb->len;
+    reg_F.PC = next_pc;
+    if (!chain || flag_finished || tb_flush) return n;
+    {
+        TB_BLOCK *nb;
+        if (succ >= 0) {
+            nb = tb->next[succ];
+            if (nb == nullptr) {
+                if ((nb = tb_lookup(next_pc)) == nullptr) return n;
+                tb->next[succ] = nb;
+            }
+        }
+        else {
+            if (op->target == nullptr || op->target->PC != next_pc) {
+                if ((op->target = tb_lookup(next_pc)) == nullptr) return n;
+            }
+            nb = op->target;
+        }
+        if (n + nb->len > budget) return n;
+        tb = nb;
+    }
+    goto enter;
+
+#undef DISPATCH
+#undef NEXT
+#undef TAKEN
+#undef NOT_TAKEN
+}
+
+// Syscalls are handled by writeback()
+void RISCV_proc::tb_ecall()
+{
+    reg_W.opcode = 0x73;
+    reg_W.rd = R_A5;
+    reg_W.res = reg_ulong[R_A0];
+    reg_W.val = reg_ulong[R_A7];
+    writeback();
+}
+
+// Runs one instruction through the stages, reg_F.PC is its next PC
+void RISCV_proc::tb_stage(const TB_OP *op)
+{
+    reg_D.inst = op->raw_inst;
+    reg_D.PC = op->PC;
+    reg_F.PC = op->PC + sizeof(raw_inst_t);
+#ifdef PIPE
+    // From latch to latch with nothing in flight, the forwarding latches stay empty
+    reg_E = calc_reg_E(); reg_M = calc_reg_M(); reg_W = calc_reg_W(); writeback();
+    reg_F.PC = reg_W.next_PC();
+#else
+    decode(); exec(); mem(); writeback();
+#endif
+}
+
+#ifdef PIPE
+// Runs steps instructions from reg_F.PC with the pipeline registers empty:
+// no breakpoints or JIT, blocks longer than the rest go one instruction at
+// a time
+void RISCV_proc::execute_threaded(size_t steps)
+{
+    size_t s = 0;
+    while (!flag_finished && s < steps) {
+        if (tb_flush) tb_clear();
+        TB_BLOCK *tb = tb_lookup(reg_F.PC);
+        if (tb && tb->len <= steps - s) s += tb_run(tb, steps - s, true);
+        else {
+            TB_OP op;
+            op.raw_inst = memread<raw_inst_t>(reg_F.PC);
+            op.PC = reg_F.PC;
+            tb_stage(&op);
+            s++;
+        }
+    }
+    inst_count += s;
+}
+#else
+void RISCV_proc::execute_threaded(size_t steps)
+{
+    size_t s = 0;
+    while (!flag_finished && (!steps || s < steps)) {
+        if (hit_breakpoint(reg_F.PC)) break;
+        if (tb_flush) tb_clear();
+        size_t budget = steps ? steps - s : SIZE_MAX;
+        TB_BLOCK *tb = tb_lookup(reg_F.PC);
+        if (tb && tb->len <= budget && !tb_breakpoint(tb)) {
+            if (!breakpoints.empty()) s += tb_run(tb, budget, false);
+            else if (engine == ENGINE_JIT) s += jit_run(tb, budget);
+            else s += tb_run(tb, budget, true);
+        }
+        else {
+            if (!PG_EXEC((*tlb_lookup(reg_F.PC).pte))) break;
+            step();
+            s++;
+        }
+    }
+    inst_count += s;
+}
+
+#endif
@@ -0,0 +1,61 @@
+#include <riscv_proc.hpp>
+using namespace std;
+
+// Memory access trace capture.
+// The simulator thread only appends records to a buffer; full buffers are
+// handed to a writer thread that does the delta/varint encoding and the file
+// I/O. At most TRACE_MAX_PENDING buffers are queued, after that the simulator
+// waits for the writer so memory use stays bounded.
+
+bool TraceCapture::open(const string &path)
+{
+    close();
+    if (!writer.Open(path.c_str(), kTraceHasPC))
+        return false;
+    buf.clear();
+    buf.reserve(TRACE_BUF_RECORDS);
+    done = false;
+    running = true;
+    thread = std::thread(&TraceCapture::write_loop, this);
+    return true;
+}
+
+void TraceCapture::hand_off()
+{
+    unique_lock<mutex> lk(lock);
+    cv.wait(lk, [this] { return pending.size() < TRACE_MAX_PENDING; });
+    pending.push_back(std::move(buf));
+    lk.unlock();
+    cv.notify_all();
+    buf = vector<TraceRecord>();
+    buf.reserve(TRACE_BUF_RECORDS);
+}
+
+void TraceCapture::write_loop()
+{
+    while (1) {
+        unique_lock<mutex> lk(lock);
+        cv.wait(lk, [this] { return done || !pending.empty(); });
+        if (pending.empty()) return;    // done and drained
+        vector<TraceRecord> batch = std::move(pending.front());
+        pending.pop_front();
+        lk.unlock();
+        cv.notify_all();
+        for (const TraceRecord &r : batch)
+            writer.Write(r);
+    }
+}
+
+void TraceCapture::close()
+{
+    if (!running) return;
+    if (!buf.empty()) hand_off();
+    {
+        lock_guard<mutex> lk(lock);
+        done = true;
+    }
+    cv.notify_all();
+    thread.join();
+    writer.Close();
+    running = false;
+}